@@ -20,6 +20,7 @@ testScripts=(
     'wallet_1941.py'
     'listtransactions.py'
     'mempool_resurrect_test.py'
+    'mempool_persist.py'
     'txn_doublespend.py'
     'txn_doublespend.py --mineblock'
     'getchaintips.py'
@@ -37,6 +38,7 @@ testScripts=(
     'walletbackup.py'
     'nodehandling.py'
     'reindex.py'
+    'chainstate_writebehind.py'
     'decodescript.py'
     'disablewallet.py'
     'zcjoinsplit.py'
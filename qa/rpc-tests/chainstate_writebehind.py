@@ -0,0 +1,69 @@
+#!/usr/bin/env python2
+# Copyright (c) 2018 The Bitcoin Private developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test that a node killed while writing its chainstate in the background
+# (-writebehind) comes back at a consistent state: it restarts from the
+# previously written best block and reconnects the rest.
+#
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+
+class ChainstateWriteBehindTest(BitcoinTestFramework):
+
+    def setup_chain(self):
+        print("Initializing test directory "+self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 2)
+
+    def setup_network(self):
+        self.nodes = start_nodes(2, self.options.tmpdir)
+        connect_nodes_bi(self.nodes, 0, 1)
+        self.is_network_split = False
+        self.sync_all()
+
+    def run_test(self):
+        self.nodes[1].generate(110)
+        self.sync_all()
+
+        # A clean shutdown writes node 0's chainstate at height 110. Its
+        # next background write will kill it.
+        stop_node(self.nodes[0], 0)
+        self.nodes[0] = start_node(0, self.options.tmpdir, ["-dbcrashratio=1", "-debug=coindb"])
+        connect_nodes_bi(self.nodes, 0, 1)
+        self.nodes[1].generate(20)
+        sync_blocks(self.nodes)
+        tip = self.nodes[1].getbestblockhash()
+
+        # gettxoutsetinfo flushes the chainstate first.
+        crashed = False
+        try:
+            self.nodes[0].gettxoutsetinfo()
+        except Exception:
+            crashed = True
+        assert(crashed)
+        assert(bitcoind_processes[0].wait() != 0)
+        del bitcoind_processes[0]
+
+        # The block index was written before the chainstate, so the node
+        # reconnects blocks 111-130 on top of the state at height 110.
+        self.nodes[0] = start_node(0, self.options.tmpdir, ["-checkblockindex=1"])
+        assert_equal(self.nodes[0].getbestblockhash(), tip)
+        assert(self.nodes[0].verifychain(4, 0))
+        info0 = self.nodes[0].gettxoutsetinfo()
+        info1 = self.nodes[1].gettxoutsetinfo()
+        assert_equal(info0['height'], 130)
+        assert_equal(info0['bestblock'], info1['bestblock'])
+        assert_equal(info0['hash_serialized'], info1['hash_serialized'])
+        assert_equal(info0['total_amount'], info1['total_amount'])
+
+        # Background writes keep working after the restart.
+        connect_nodes_bi(self.nodes, 0, 1)
+        self.nodes[1].generate(10)
+        sync_blocks(self.nodes)
+        assert_equal(self.nodes[0].gettxoutsetinfo()['hash_serialized'],
+                     self.nodes[1].gettxoutsetinfo()['hash_serialized'])
+
+if __name__ == '__main__':
+    ChainstateWriteBehindTest().main()
@@ -0,0 +1,80 @@
+#!/usr/bin/env python2
+# Copyright (c) 2018 The Bitcoin Private developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test that the mempool is saved to mempool.dat on shutdown and loaded again
+# on restart, with the entry times of its transactions, that
+# -persistmempool=0 disables both, and that savemempool and loadmempool
+# do the same on demand.
+#
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+import os
+import shutil
+import time
+
+class MempoolPersistTest(BitcoinTestFramework):
+
+    def setup_network(self):
+        self.nodes = start_nodes(2, self.options.tmpdir, [[], ["-persistmempool=0"]])
+        connect_nodes_bi(self.nodes, 0, 1)
+        self.is_network_split = False
+        self.sync_all()
+
+    def wait_for_mempool(self, node, size):
+        # The mempool is loaded in the background once the node has started.
+        for i in range(60):
+            if len(node.getrawmempool()) == size:
+                return
+            time.sleep(0.5)
+        assert_equal(len(node.getrawmempool()), size)
+
+    def run_test(self):
+        address = self.nodes[1].getnewaddress()
+        txids = [self.nodes[0].sendtoaddress(address, 1) for i in range(5)]
+        self.sync_all()
+        assert_equal(len(self.nodes[0].getrawmempool()), 5)
+        assert_equal(len(self.nodes[1].getrawmempool()), 5)
+
+        self.nodes[0].prioritisetransaction(txids[0], 0, 1000)
+        before = self.nodes[0].getrawmempool(True)
+
+        # Node 0 restores its mempool. Node 1 ran with -persistmempool=0, so it
+        # has nothing to restore.
+        stop_nodes(self.nodes)
+        wait_bitcoinds()
+        self.nodes = []
+        self.nodes.append(start_node(0, self.options.tmpdir))
+        self.nodes.append(start_node(1, self.options.tmpdir))
+        self.wait_for_mempool(self.nodes[0], 5)
+        after = self.nodes[0].getrawmempool(True)
+        assert_equal(sorted(after.keys()), sorted(before.keys()))
+        for txid in txids:
+            assert_equal(after[txid]['time'], before[txid]['time'])
+        assert_equal(len(self.nodes[1].getrawmempool()), 0)
+
+        # A node started with -persistmempool=0 neither loads mempool.dat nor
+        # overwrites it on shutdown.
+        stop_node(self.nodes[0], 0)
+        self.nodes[0] = start_node(0, self.options.tmpdir, ["-persistmempool=0"])
+        assert_equal(len(self.nodes[0].getrawmempool()), 0)
+        stop_node(self.nodes[0], 0)
+        self.nodes[0] = start_node(0, self.options.tmpdir)
+        self.wait_for_mempool(self.nodes[0], 5)
+
+        # loadmempool adds the transactions in mempool.dat to a running node.
+        mempooldat0 = os.path.join(self.options.tmpdir, "node0", "regtest", "mempool.dat")
+        mempooldat1 = os.path.join(self.options.tmpdir, "node1", "regtest", "mempool.dat")
+        shutil.copyfile(mempooldat0, mempooldat1)
+        self.nodes[1].loadmempool()
+        assert_equal(sorted(self.nodes[1].getrawmempool()), sorted(txids))
+
+        # savemempool writes mempool.dat on demand.
+        os.remove(mempooldat0)
+        self.nodes[0].savemempool()
+        assert(os.path.isfile(mempooldat0))
+
+if __name__ == '__main__':
+    MempoolPersistTest().main()
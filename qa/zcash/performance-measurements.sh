@@ -100,7 +100,7 @@ EOF
 case "$1" in
     *)
         case "$2" in
-            verifyjoinsplit)
+            verifyjoinsplit|verifyjoinsplitbatch)
                 btcpd_start
                 RAWJOINSPLIT=$(zcash_rpc zcsamplejoinsplit)
                 btcpd_stop
@@ -123,6 +123,12 @@ case "$1" in
             verifyjoinsplit)
                 zcash_rpc zcbenchmark verifyjoinsplit 1000 "\"$RAWJOINSPLIT\""
                 ;;
+            verifyjoinsplitbatch)
+                zcash_rpc zcbenchmark verifyjoinsplitbatch 100 "\"$RAWJOINSPLIT\"" "${@:3}"
+                ;;
+            verifyjoinsplitsigs)
+                zcash_rpc zcbenchmark verifyjoinsplitsigs 100 "${@:3}"
+                ;;
             solveequihash)
                 zcash_rpc_slow zcbenchmark solveequihash 50 "${@:3}"
                 ;;
@@ -152,19 +152,18 @@ bool AMQPPublishRawBlockNotifier::NotifyBlock(const CBlockIndex *pindex)
 {
     LogPrint("amqp", "amqp: Publish rawblock %s\n", pindex->GetBlockHash().GetHex());
 
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    // The new tip is normally in the block cache already
+    CSerializeDataRef pmsg;
     {
         LOCK(cs_main);
-        CBlock block;
-        if(!ReadBlockFromDisk(block, pindex)) {
+        pmsg = GetBlockMessage(pindex);
+        if (!pmsg) {
             LogPrint("amqp", "amqp: Can't read block from disk");
             return false;
         }
-
-        ss << block;
     }
 
-    return SendMessage(MSG_RAWBLOCK, &(*ss.begin()), ss.size());
+    return SendMessage(MSG_RAWBLOCK, &(*pmsg)[CMessageHeader::HEADER_SIZE], pmsg->size() - CMessageHeader::HEADER_SIZE);
 }
 
 bool AMQPPublishRawTransactionNotifier::NotifyTransaction(const CTransaction &transaction)
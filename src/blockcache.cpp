@@ -0,0 +1,178 @@
+// Copyright (c) 2018 The Bitcoin Private developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockcache.h"
+
+#include "hash.h"
+
+#include <string.h>
+
+#include <atomic>
+#include <list>
+#include <map>
+
+#include <boost/thread.hpp>
+
+namespace {
+
+class CBlockMessageCache
+{
+private:
+    typedef std::pair<int, uint256> Key;
+    struct Entry
+    {
+        Key key;
+        CSerializeDataRef pmsg;
+    };
+    typedef std::list<Entry>::iterator EntryIter;
+
+    //! Most recently used first
+    std::list<Entry> listEntries;
+    std::map<Key, EntryIter> mapEntries;
+    size_t nBytes;
+    //! Read without the lock by IsBlockCacheEnabled
+    std::atomic<size_t> nMaxBytes;
+    CBlockCacheStats stats;
+    boost::mutex cs_blockcache;
+
+    void Erase(EntryIter it)
+    {
+        nBytes -= it->pmsg->size();
+        mapEntries.erase(it->key);
+        listEntries.erase(it);
+    }
+
+    void EvictToLimit()
+    {
+        while (nBytes > nMaxBytes) {
+            Erase(--listEntries.end());
+            stats.nEvicted++;
+        }
+    }
+
+public:
+    CBlockMessageCache() : nBytes(0), nMaxBytes((size_t)DEFAULT_BLOCK_CACHE_SIZE << 20)
+    {
+        memset(&stats, 0, sizeof(stats));
+    }
+
+    size_t GetMaxBytes() const
+    {
+        return nMaxBytes;
+    }
+
+    void SetMaxBytes(size_t nMaxBytesIn)
+    {
+        boost::unique_lock<boost::mutex> lock(cs_blockcache);
+        nMaxBytes = nMaxBytesIn;
+        EvictToLimit();
+    }
+
+    CSerializeDataRef Get(BlockCacheKind kind, const uint256& hash)
+    {
+        boost::unique_lock<boost::mutex> lock(cs_blockcache);
+        std::map<Key, EntryIter>::iterator it = mapEntries.find(Key(kind, hash));
+        if (it == mapEntries.end())
+            return CSerializeDataRef();
+        listEntries.splice(listEntries.begin(), listEntries, it->second);
+        return it->second->pmsg;
+    }
+
+    void CountLookup(BlockCacheKind kind, bool fHit)
+    {
+        boost::unique_lock<boost::mutex> lock(cs_blockcache);
+        if (fHit)
+            stats.nHits[kind]++;
+        else
+            stats.nMisses[kind]++;
+    }
+
+    void Add(BlockCacheKind kind, const uint256& hash, const CSerializeDataRef& pmsg)
+    {
+        boost::unique_lock<boost::mutex> lock(cs_blockcache);
+        if (pmsg->size() > nMaxBytes)
+            return;
+
+        std::map<Key, EntryIter>::iterator it = mapEntries.find(Key(kind, hash));
+        if (it != mapEntries.end())
+            Erase(it->second);
+
+        Entry entry;
+        entry.key = Key(kind, hash);
+        entry.pmsg = pmsg;
+        listEntries.push_front(entry);
+        mapEntries[entry.key] = listEntries.begin();
+        nBytes += pmsg->size();
+        EvictToLimit();
+    }
+
+    void Clear(BlockCacheKind kind)
+    {
+        boost::unique_lock<boost::mutex> lock(cs_blockcache);
+        for (EntryIter it = listEntries.begin(); it != listEntries.end(); ) {
+            if (it->key.first == kind)
+                Erase(it++);
+            else
+                ++it;
+        }
+    }
+
+    CBlockCacheStats GetStats()
+    {
+        boost::unique_lock<boost::mutex> lock(cs_blockcache);
+        CBlockCacheStats ret = stats;
+        ret.nEntries = listEntries.size();
+        ret.nBytes = nBytes;
+        ret.nMaxBytes = nMaxBytes;
+        return ret;
+    }
+};
+
+CBlockMessageCache& GetBlockMessageCache()
+{
+    static CBlockMessageCache blockMessageCache;
+    return blockMessageCache;
+}
+
+}
+
+bool IsBlockCacheEnabled()
+{
+    return GetBlockMessageCache().GetMaxBytes() > 0;
+}
+
+void SetBlockCacheSize(size_t nMaxBytes)
+{
+    GetBlockMessageCache().SetMaxBytes(nMaxBytes);
+}
+
+CSerializeDataRef GetCachedMessage(BlockCacheKind kind, const uint256& key)
+{
+    return GetBlockMessageCache().Get(kind, key);
+}
+
+void CountCacheLookup(BlockCacheKind kind, bool fHit)
+{
+    GetBlockMessageCache().CountLookup(kind, fHit);
+}
+
+void AddMessageToCache(BlockCacheKind kind, const uint256& key, const CSerializeDataRef& pmsg)
+{
+    GetBlockMessageCache().Add(kind, key, pmsg);
+}
+
+void ClearCachedMessages(BlockCacheKind kind)
+{
+    GetBlockMessageCache().Clear(kind);
+}
+
+CBlockCacheStats GetBlockCacheStats()
+{
+    return GetBlockMessageCache().GetStats();
+}
+
+uint256 GetHeadersCacheKey(const uint256& hashStart, const uint256& hashStop)
+{
+    return Hash(hashStart.begin(), hashStart.end(), hashStop.begin(), hashStop.end());
+}
@@ -0,0 +1,62 @@
+// Copyright (c) 2018 The Bitcoin Private developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKCACHE_H
+#define BITCOIN_BLOCKCACHE_H
+
+#include "net.h"
+#include "uint256.h"
+
+#include <stdint.h>
+
+/** Default for -blockcachesize, in megabytes */
+static const unsigned int DEFAULT_BLOCK_CACHE_SIZE = 32;
+
+/** Kinds of cached messages */
+enum BlockCacheKind {
+    BLOCK_CACHE_BLOCK = 0,      //!< "block" messages, keyed by block hash
+    BLOCK_CACHE_HEADERS,        //!< "headers" replies, keyed by GetHeadersCacheKey
+    BLOCK_CACHE_KINDS
+};
+
+struct CBlockCacheStats
+{
+    uint64_t nHits[BLOCK_CACHE_KINDS];
+    uint64_t nMisses[BLOCK_CACHE_KINDS];
+    uint64_t nEvicted;
+    size_t nEntries;
+    size_t nBytes;
+    size_t nMaxBytes;
+};
+
+/**
+ * Cache of recently connected or served blocks, and of replies to
+ * getheaders, kept as complete serialized P2P messages.
+ *
+ * After a new tip every peer asks for the same block within seconds, and
+ * peers catching up from the same point walk the same headers. They are
+ * all queued the one cached buffer instead of each request reading and
+ * serializing it again; REST and ZMQ read the block after its message
+ * header. The least recently used entries are evicted to stay within
+ * -blockcachesize.
+ *
+ * Header batches depend on the active chain, so they must be dropped
+ * whenever its tip changes.
+ *
+ * Callers count their lookups with CountCacheLookup, as a message may
+ * also be found elsewhere before it has to be read from disk or rebuilt.
+ */
+bool IsBlockCacheEnabled();
+/** Set the size the cache is kept within, evicting entries as needed (0 disables it) */
+void SetBlockCacheSize(size_t nMaxBytes);
+CSerializeDataRef GetCachedMessage(BlockCacheKind kind, const uint256& key);
+void CountCacheLookup(BlockCacheKind kind, bool fHit);
+void AddMessageToCache(BlockCacheKind kind, const uint256& key, const CSerializeDataRef& pmsg);
+void ClearCachedMessages(BlockCacheKind kind);
+CBlockCacheStats GetBlockCacheStats();
+
+/** Key of the headers reply starting at hashStart and ending at hashStop at the latest */
+uint256 GetHeadersCacheKey(const uint256& hashStart, const uint256& hashStop);
+
+#endif // BITCOIN_BLOCKCACHE_H
@@ -12,6 +12,8 @@
 
 #include <assert.h>
 
+#include <algorithm>
+
 /**
  * calculate number of bytes for the bitmask, and its number of non-zero bytes
  * each bit in the bitmask represents the availability of one output, but the
@@ -43,6 +45,23 @@ bool CCoins::Spend(uint32_t nPos)
     Cleanup();
     return true;
 }
+
+void CCoinsParentState::Set(const CCoins &coins)
+{
+    if (coins.IsPruned()) {
+        std::vector<unsigned char>().swap(vAvail);
+    } else {
+        vAvail.assign((coins.vout.size() + 7) / 8, 0);
+        for (uint32_t n = 0; n < coins.vout.size(); n++) {
+            if (!coins.vout[n].IsNull())
+                vAvail[n / 8] |= 1 << (n % 8);
+        }
+    }
+    fCoinBase = coins.fCoinBase;
+    nHeight = coins.nHeight;
+    nVersion = coins.nVersion;
+}
+
 bool CCoinsView::GetAnchorAt(const uint256 &rt, ZCIncrementalMerkleTree &tree, const bool postBurn) const { return false; }
 bool CCoinsView::GetNullifier(const uint256 &nullifier) const { return false; }
 bool CCoinsView::GetCoins(const uint256 &txid, CCoins &coins) const { return false; }
@@ -54,6 +73,28 @@ bool CCoinsView::BatchWrite(CCoinsMap &mapCoins,
                             const uint256 &hashAnchor,
                             CAnchorsMap &mapAnchors,
                             CNullifiersMap &mapNullifiers) { return false; }
+bool CCoinsView::BatchWriteDirty(const CCoinsMap &mapCoins,
+                                 const uint256 &hashBlock,
+                                 const uint256 &hashAnchor,
+                                 const CAnchorsMap &mapAnchors,
+                                 const CNullifiersMap &mapNullifiers) {
+    CCoinsMap mapCoinsDirty;
+    CAnchorsMap mapAnchorsDirty;
+    CNullifiersMap mapNullifiersDirty;
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        if (it->second.flags & CCoinsCacheEntry::DIRTY)
+            mapCoinsDirty.insert(*it);
+    }
+    for (CAnchorsMap::const_iterator it = mapAnchors.begin(); it != mapAnchors.end(); it++) {
+        if (it->second.flags & CAnchorsCacheEntry::DIRTY)
+            mapAnchorsDirty.insert(*it);
+    }
+    for (CNullifiersMap::const_iterator it = mapNullifiers.begin(); it != mapNullifiers.end(); it++) {
+        if (it->second.flags & CNullifiersCacheEntry::DIRTY)
+            mapNullifiersDirty.insert(*it);
+    }
+    return BatchWrite(mapCoinsDirty, hashBlock, hashAnchor, mapAnchorsDirty, mapNullifiersDirty);
+}
 bool CCoinsView::GetStats(CCoinsStats &stats) const { return false; }
 
 CCoinsViewBacked::CCoinsViewBacked(CCoinsView *viewIn) : base(viewIn) { }
@@ -74,7 +115,7 @@ bool CCoinsViewBacked::GetStats(CCoinsStats &stats) const { return base->GetStat
 
 CCoinsKeyHasher::CCoinsKeyHasher() : salt(GetRandHash()) {}
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), cachedCoinsUsage(0) { }
+CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), cachedCoinsUsage(0), nAccessTick(0) { }
 
 CCoinsViewCache::~CCoinsViewCache()
 {
@@ -90,19 +131,26 @@ size_t CCoinsViewCache::DynamicMemoryUsage() const {
 
 CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256 &txid) const {
     CCoinsMap::iterator it = cacheCoins.find(txid);
-    if (it != cacheCoins.end())
+    if (it != cacheCoins.end()) {
+        it->second.nLastUsed = nAccessTick;
+        cacheStats.nHits++;
         return it;
+    }
+    cacheStats.nMisses++;
     CCoins tmp;
     if (!base->GetCoins(txid, tmp))
         return cacheCoins.end();
     CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry())).first;
     tmp.swap(ret->second.coins);
+    ret->second.nLastUsed = nAccessTick;
     if (ret->second.coins.IsPruned()) {
         // The parent only has an empty entry for this txid; we can consider our
         // version as fresh.
         ret->second.flags = CCoinsCacheEntry::FRESH;
+    } else {
+        ret->second.parent.Set(ret->second.coins);
     }
-    cachedCoinsUsage += ret->second.coins.DynamicMemoryUsage();
+    cachedCoinsUsage += ret->second.coins.DynamicMemoryUsage() + ret->second.parent.DynamicMemoryUsage();
     return ret;
 }
 
@@ -218,6 +266,7 @@ CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256 &txid) {
     std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
     size_t cachedCoinUsage = 0;
     if (ret.second) {
+        cacheStats.nMisses++;
         if (!base->GetCoins(txid, ret.first->second.coins)) {
             // The parent view does not have this entry; mark it as fresh.
             ret.first->second.coins.Clear();
@@ -225,12 +274,17 @@ CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256 &txid) {
         } else if (ret.first->second.coins.IsPruned()) {
             // The parent view only has a pruned entry for this; mark it as fresh.
             ret.first->second.flags = CCoinsCacheEntry::FRESH;
+        } else {
+            ret.first->second.parent.Set(ret.first->second.coins);
+            cachedCoinsUsage += ret.first->second.parent.DynamicMemoryUsage();
         }
     } else {
+        cacheStats.nHits++;
         cachedCoinUsage = ret.first->second.coins.DynamicMemoryUsage();
     }
     // Assume that whenever ModifyCoins is called, the entry will be modified.
     ret.first->second.flags |= CCoinsCacheEntry::DIRTY;
+    ret.first->second.nLastUsed = nAccessTick;
     return CCoinsModifier(*this, ret.first, cachedCoinUsage);
 }
 
@@ -275,6 +329,7 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins,
                                  CAnchorsMap &mapAnchors,
                                  CNullifiersMap &mapNullifiers) {
     assert(!hasModifier);
+    nAccessTick++;
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) { // Ignore non-dirty entries (optimization).
             CCoinsMap::iterator itUs = cacheCoins.find(it->first);
@@ -289,6 +344,7 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins,
                     entry.coins.swap(it->second.coins);
                     cachedCoinsUsage += entry.coins.DynamicMemoryUsage();
                     entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
+                    entry.nLastUsed = nAccessTick;
                 }
             } else {
                 if ((itUs->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
@@ -303,6 +359,7 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins,
                     itUs->second.coins.swap(it->second.coins);
                     cachedCoinsUsage += itUs->second.coins.DynamicMemoryUsage();
                     itUs->second.flags |= CCoinsCacheEntry::DIRTY;
+                    itUs->second.nLastUsed = nAccessTick;
                 }
             }
         }
@@ -377,6 +434,132 @@ bool CCoinsViewCache::Flush() {
     return fOk;
 }
 
+bool CCoinsViewCache::WriteBack() {
+    assert(!hasModifier);
+    // The base only reads the dirty entries, so hand it the cache itself.
+    bool fOk = base->BatchWriteDirty(cacheCoins, hashBlock, hashAnchor, cacheAnchors, cacheNullifiers);
+    cacheStats.nWriteBacks++;
+    if (!fOk)
+        return false;
+
+    // Everything left now matches the base. Pruned coins and removed
+    // anchors are gone from it, so drop them here as well.
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end();) {
+        CCoinsCacheEntry &entry = it->second;
+        if (entry.coins.IsPruned()) {
+            cachedCoinsUsage -= entry.coins.DynamicMemoryUsage() + entry.parent.DynamicMemoryUsage();
+            cacheCoins.erase(it++);
+        } else {
+            if (entry.flags & CCoinsCacheEntry::DIRTY) {
+                cachedCoinsUsage -= entry.parent.DynamicMemoryUsage();
+                entry.parent.Set(entry.coins);
+                cachedCoinsUsage += entry.parent.DynamicMemoryUsage();
+            }
+            entry.flags = 0;
+            it++;
+        }
+    }
+    for (CAnchorsMap::iterator it = cacheAnchors.begin(); it != cacheAnchors.end();) {
+        if (!it->second.entered) {
+            cachedCoinsUsage -= it->second.tree.DynamicMemoryUsage();
+            cacheAnchors.erase(it++);
+        } else {
+            it->second.flags = 0;
+            it++;
+        }
+    }
+    for (CNullifiersMap::iterator it = cacheNullifiers.begin(); it != cacheNullifiers.end(); it++) {
+        it->second.flags = 0;
+    }
+    return true;
+}
+
+size_t CCoinsViewCache::DirtyUsage() const {
+    size_t nUsage = 0;
+    for (CCoinsMap::const_iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
+        if (it->second.flags & CCoinsCacheEntry::DIRTY)
+            nUsage += it->second.coins.DynamicMemoryUsage();
+    }
+    for (CAnchorsMap::const_iterator it = cacheAnchors.begin(); it != cacheAnchors.end(); it++) {
+        if (it->second.flags & CAnchorsCacheEntry::DIRTY)
+            nUsage += it->second.tree.DynamicMemoryUsage();
+    }
+    return nUsage;
+}
+
+namespace {
+/** Orders (age, entry) pairs oldest first. */
+struct CompareCoinsAge
+{
+    bool operator()(const std::pair<uint32_t, CCoinsMap::iterator>& a, const std::pair<uint32_t, CCoinsMap::iterator>& b) const
+    {
+        return a.first > b.first;
+    }
+};
+}
+
+void CCoinsViewCache::EvictUnmodified(size_t nTargetUsage) {
+    // Anchors and nullifiers are cheap to look up again and carry no usage
+    // information; drop the unmodified ones first.
+    for (CAnchorsMap::iterator it = cacheAnchors.begin(); it != cacheAnchors.end();) {
+        if (!(it->second.flags & CAnchorsCacheEntry::DIRTY)) {
+            cachedCoinsUsage -= it->second.tree.DynamicMemoryUsage();
+            cacheAnchors.erase(it++);
+        } else {
+            it++;
+        }
+    }
+    for (CNullifiersMap::iterator it = cacheNullifiers.begin(); it != cacheNullifiers.end();) {
+        if (!(it->second.flags & CNullifiersCacheEntry::DIRTY))
+            cacheNullifiers.erase(it++);
+        else
+            it++;
+    }
+    if (DynamicMemoryUsage() <= nTargetUsage)
+        return;
+
+    std::vector<std::pair<uint32_t, CCoinsMap::iterator> > vCandidates;
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+            vCandidates.push_back(std::make_pair(nAccessTick - it->second.nLastUsed, it));
+    }
+    std::sort(vCandidates.begin(), vCandidates.end(), CompareCoinsAge());
+    for (size_t i = 0; i < vCandidates.size() && DynamicMemoryUsage() > nTargetUsage; i++) {
+        const CCoinsCacheEntry &entry = vCandidates[i].second->second;
+        cachedCoinsUsage -= entry.coins.DynamicMemoryUsage() + entry.parent.DynamicMemoryUsage();
+        cacheCoins.erase(vCandidates[i].second);
+        cacheStats.nEvicted++;
+    }
+}
+
+bool CCoinsViewCache::Trim(size_t nTargetUsage, bool* pfWritten) {
+    assert(!hasModifier);
+    if (pfWritten)
+        *pfWritten = false;
+    if (DynamicMemoryUsage() <= nTargetUsage)
+        return true;
+    cacheStats.nTrims++;
+    // Once the modifications alone are over the target, evicting unmodified
+    // entries cannot get there; write them back first so that the most
+    // recently used entries survive the eviction.
+    bool fWritten = false;
+    bool fOk = true;
+    if (DirtyUsage() > nTargetUsage) {
+        fWritten = true;
+        fOk = WriteBack();
+    }
+    EvictUnmodified(nTargetUsage);
+    // The map overhead of the modified entries is not counted above.
+    if (fOk && !fWritten && DynamicMemoryUsage() > nTargetUsage) {
+        fWritten = true;
+        fOk = WriteBack();
+        EvictUnmodified(nTargetUsage);
+    }
+    if (pfWritten)
+        *pfWritten = fWritten;
+    return fOk;
+}
+
 unsigned int CCoinsViewCache::GetCacheSize() const {
     return cacheCoins.size();
 }
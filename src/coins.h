@@ -10,11 +10,14 @@
 #include "core_memusage.h"
 #include "memusage.h"
 #include "serialize.h"
+#include "support/allocators/pool.h"
 #include "uint256.h"
 
 #include <assert.h>
 #include <stdint.h>
 
+#include <functional>
+
 #include <boost/foreach.hpp>
 #include <boost/unordered_map.hpp>
 #include "zcash/IncrementalMerkleTree.hpp"
@@ -78,7 +81,7 @@ public:
     bool fCoinBase;
 
     //! unspent transaction outputs; spent outputs are .IsNull(); spent outputs at the end of the array are dropped
-    std::vector<CTxOut> vout;
+    std::vector<CTxOut, pool_allocator<CTxOut> > vout;
 
     //! at which height this transaction was included in the active block chain
     int nHeight;
@@ -89,7 +92,7 @@ public:
 
     void FromTx(const CTransaction &tx, int nHeightIn) {
         fCoinBase = tx.IsCoinBase();
-        vout = tx.vout;
+        vout.assign(tx.vout.begin(), tx.vout.end());
         nHeight = nHeightIn;
         nVersion = tx.nVersion;
         ClearUnspendable();
@@ -102,7 +105,7 @@ public:
 
     void Clear() {
         fCoinBase = false;
-        std::vector<CTxOut>().swap(vout);
+        std::vector<CTxOut, pool_allocator<CTxOut> >().swap(vout);
         nHeight = 0;
         nVersion = 0;
     }
@@ -115,7 +118,7 @@ public:
         while (vout.size() > 0 && vout.back().IsNull())
             vout.pop_back();
         if (vout.empty())
-            std::vector<CTxOut>().swap(vout);
+            std::vector<CTxOut, pool_allocator<CTxOut> >().swap(vout);
     }
 
     void ClearUnspendable() {
@@ -283,17 +286,57 @@ public:
     }
 };
 
+/**
+ * What the parent view held for a cache entry: which outputs were unspent
+ * and the transaction metadata stored with them. Lets the database write
+ * only the outputs that changed without reading them back first.
+ */
+class CCoinsParentState
+{
+private:
+    std::vector<unsigned char> vAvail; // Bit n is set if output n is unspent.
+    bool fCoinBase;
+    int nHeight;
+    int nVersion;
+
+public:
+    CCoinsParentState() : fCoinBase(false), nHeight(0), nVersion(0) {}
+
+    //! Record coins as what the parent holds
+    void Set(const CCoins &coins);
+
+    //! Number of outputs covered, spent or not
+    uint32_t GetOutputCount() const {
+        return vAvail.size() * 8;
+    }
+
+    bool IsAvailable(uint32_t nPos) const {
+        return nPos / 8 < vAvail.size() && (vAvail[nPos / 8] & (1 << (nPos % 8)));
+    }
+
+    //! Whether outputs stored with this metadata can be kept for coins
+    bool HasSameMetadata(const CCoins &coins) const {
+        return fCoinBase == coins.fCoinBase && nHeight == coins.nHeight && nVersion == coins.nVersion;
+    }
+
+    size_t DynamicMemoryUsage() const {
+        return memusage::DynamicUsage(vAvail);
+    }
+};
+
 struct CCoinsCacheEntry
 {
     CCoins coins; // The actual cached data.
     unsigned char flags;
+    uint32_t nLastUsed; // Access tick of the owning cache when this entry was last used.
+    CCoinsParentState parent; // The parent's version of coins; empty if FRESH.
 
     enum Flags {
         DIRTY = (1 << 0), // This cache entry is potentially different from the version in the parent view.
         FRESH = (1 << 1), // The parent view does not have this entry (or it is pruned).
     };
 
-    CCoinsCacheEntry() : coins(), flags(0) {}
+    CCoinsCacheEntry() : coins(), flags(0), nLastUsed(0) {}
 };
 
 struct CAnchorsCacheEntry
@@ -322,7 +365,7 @@ struct CNullifiersCacheEntry
     CNullifiersCacheEntry() : entered(false), flags(0) {}
 };
 
-typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
+typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher, std::equal_to<uint256>, pool_allocator<std::pair<const uint256, CCoinsCacheEntry> > > CCoinsMap;
 typedef boost::unordered_map<uint256, CAnchorsCacheEntry, CCoinsKeyHasher> CAnchorsMap;
 typedef boost::unordered_map<uint256, CNullifiersCacheEntry, CCoinsKeyHasher> CNullifiersMap;
 
@@ -371,6 +414,15 @@ public:
                             CAnchorsMap &mapAnchors,
                             CNullifiersMap &mapNullifiers);
 
+    //! Write the DIRTY entries of the maps like BatchWrite, but leave the
+    //! maps untouched. By default the entries are copied for BatchWrite;
+    //! views that only pass them on to storage write them directly.
+    virtual bool BatchWriteDirty(const CCoinsMap &mapCoins,
+                                 const uint256 &hashBlock,
+                                 const uint256 &hashAnchor,
+                                 const CAnchorsMap &mapAnchors,
+                                 const CNullifiersMap &mapNullifiers);
+
     //! Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats &stats) const;
 
@@ -426,6 +478,18 @@ public:
     friend class CCoinsViewCache;
 };
 
+/** Counters describing how a CCoinsViewCache is performing. */
+struct CCoinsCacheStats
+{
+    uint64_t nHits;       //!< Coins lookups answered from the cache
+    uint64_t nMisses;     //!< Coins lookups passed on to the base view
+    uint64_t nEvicted;    //!< Entries dropped by Trim()
+    uint64_t nTrims;      //!< Calls to Trim() that had to evict entries
+    uint64_t nWriteBacks; //!< Writes to the base view that kept the entries cached
+
+    CCoinsCacheStats() : nHits(0), nMisses(0), nEvicted(0), nTrims(0), nWriteBacks(0) {}
+};
+
 /** CCoinsView that adds a memory cache for transactions to another CCoinsView */
 class CCoinsViewCache : public CCoinsViewBacked
 {
@@ -447,6 +511,12 @@ protected:
     /* Cached dynamic memory usage for the inner CCoins objects. */
     mutable size_t cachedCoinsUsage;
 
+    /* Advanced on every batch written into this cache (i.e. per connected
+     * block); entries remember the tick they were last used at. */
+    uint32_t nAccessTick;
+
+    mutable CCoinsCacheStats cacheStats;
+
 public:
     CCoinsViewCache(CCoinsView *baseIn);
     ~CCoinsViewCache();
@@ -499,6 +569,26 @@ public:
      */
     bool Flush();
 
+    /**
+     * Push the modifications applied to this cache to its base, but keep
+     * the entries cached (as unmodified). The entries stay marked as
+     * modified unless the base accepted them.
+     * If false is returned, the state of this cache (and its backing view) will be undefined.
+     */
+    bool WriteBack();
+
+    /**
+     * Evict unmodified entries, least recently used first, until
+     * DynamicMemoryUsage() is at most nTargetUsage. If the modified entries
+     * alone take up more than nTargetUsage, they are written back first so
+     * that they can be evicted too; if pfWritten is given, it is set to
+     * whether that happened.
+     * If false is returned, the state of this cache (and its backing view) will be undefined.
+     */
+    bool Trim(size_t nTargetUsage, bool* pfWritten = NULL);
+
+    const CCoinsCacheStats& GetCacheStats() const { return cacheStats; }
+
     //! Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize() const;
 
@@ -532,6 +622,12 @@ private:
     CCoinsMap::iterator FetchCoins(const uint256 &txid);
     CCoinsMap::const_iterator FetchCoins(const uint256 &txid) const;
 
+    //! Drop unmodified entries, least recently used first, down to nTargetUsage
+    void EvictUnmodified(size_t nTargetUsage);
+
+    //! Memory used by the modified coins and anchors
+    size_t DirtyUsage() const;
+
     /**
      * By making the copy constructor private, we prevent accidentally using it when one intends to create a cache on top of a base cache.
      */
@@ -0,0 +1,315 @@
+// Copyright (c) 2018 The Bitcoin Private developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinsprefetch.h"
+
+#include "chainparams.h"
+#include "clientversion.h"
+#include "main.h"
+#include "primitives/block.h"
+#include "streams.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <algorithm>
+
+#include <boost/foreach.hpp>
+#include <boost/thread/locks.hpp>
+
+//! Number of recently queued block hashes remembered to avoid queueing a block twice
+static const size_t MAX_QUEUED_HASHES = 1024;
+
+CCoinsViewPrefetch::CCoinsViewPrefetch(CCoinsView *viewIn, int nBlocksAheadIn) :
+    CCoinsViewBacked(viewIn), cachedUsage(0), nGeneration(0), nHits(0), nMisses(0),
+    nBlocksAhead(nBlocksAheadIn), fBusy(false), fStop(false) { }
+
+void CCoinsViewPrefetch::Clear() const
+{
+    AssertLockHeld(cs);
+    cacheCoins.clear();
+    cacheNullifiers.clear();
+    cacheAnchors.clear();
+    cachedUsage = 0;
+}
+
+bool CCoinsViewPrefetch::GetAnchorAt(const uint256 &rt, ZCIncrementalMerkleTree &tree, const bool postBurn) const
+{
+    {
+        LOCK(cs);
+        CPrefetchAnchorsMap::iterator it = cacheAnchors.find(std::make_pair(rt, postBurn));
+        if (it != cacheAnchors.end()) {
+            tree = it->second;
+            cachedUsage -= it->second.DynamicMemoryUsage();
+            cacheAnchors.erase(it);
+            return true;
+        }
+    }
+    return base->GetAnchorAt(rt, tree, postBurn);
+}
+
+bool CCoinsViewPrefetch::GetNullifier(const uint256 &nullifier) const
+{
+    {
+        LOCK(cs);
+        CPrefetchNullifiersMap::iterator it = cacheNullifiers.find(nullifier);
+        if (it != cacheNullifiers.end()) {
+            bool fSpent = it->second;
+            cacheNullifiers.erase(it);
+            return fSpent;
+        }
+    }
+    return base->GetNullifier(nullifier);
+}
+
+bool CCoinsViewPrefetch::GetCoins(const uint256 &txid, CCoins &coins) const
+{
+    {
+        LOCK(cs);
+        CPrefetchCoinsMap::iterator it = cacheCoins.find(txid);
+        if (it != cacheCoins.end()) {
+            cachedUsage -= it->second.DynamicMemoryUsage();
+            it->second.swap(coins);
+            cacheCoins.erase(it);
+            nHits++;
+            return true;
+        }
+        nMisses++;
+    }
+    return base->GetCoins(txid, coins);
+}
+
+bool CCoinsViewPrefetch::HaveCoins(const uint256 &txid) const
+{
+    {
+        LOCK(cs);
+        if (cacheCoins.count(txid))
+            return true;
+    }
+    return base->HaveCoins(txid);
+}
+
+bool CCoinsViewPrefetch::BatchWrite(CCoinsMap &mapCoins,
+                                    const uint256 &hashBlock,
+                                    const uint256 &hashAnchor,
+                                    CAnchorsMap &mapAnchors,
+                                    CNullifiersMap &mapNullifiers)
+{
+    bool fOk = false;
+    try {
+        fOk = base->BatchWrite(mapCoins, hashBlock, hashAnchor, mapAnchors, mapNullifiers);
+    } catch (...) {
+        LOCK(cs);
+        nGeneration++;
+        Clear();
+        throw;
+    }
+    // Anything prefetched so far, or read while the write was in progress,
+    // may predate the write: invalidate it all.
+    LOCK(cs);
+    nGeneration++;
+    Clear();
+    return fOk;
+}
+
+bool CCoinsViewPrefetch::BatchWriteDirty(const CCoinsMap &mapCoins,
+                                         const uint256 &hashBlock,
+                                         const uint256 &hashAnchor,
+                                         const CAnchorsMap &mapAnchors,
+                                         const CNullifiersMap &mapNullifiers)
+{
+    bool fOk = false;
+    try {
+        fOk = base->BatchWriteDirty(mapCoins, hashBlock, hashAnchor, mapAnchors, mapNullifiers);
+    } catch (...) {
+        LOCK(cs);
+        nGeneration++;
+        Clear();
+        throw;
+    }
+    LOCK(cs);
+    nGeneration++;
+    Clear();
+    return fOk;
+}
+
+uint64_t CCoinsViewPrefetch::GetGeneration() const
+{
+    LOCK(cs);
+    return nGeneration;
+}
+
+bool CCoinsViewPrefetch::AddPrefetchedCoins(const uint256 &txid, CCoins &coins, uint64_t &nGen)
+{
+    LOCK(cs);
+    if (nGeneration != nGen) {
+        nGen = nGeneration;
+        return false;
+    }
+    size_t nUsage = coins.DynamicMemoryUsage();
+    CCoins& entry = cacheCoins[txid];
+    if (!entry.IsPruned())
+        return false;
+    entry.swap(coins);
+    cachedUsage += nUsage;
+    return true;
+}
+
+void CCoinsViewPrefetch::PrefetchBlock(const CPrefetchBlock& job)
+{
+    int64_t nTimeStart = GetTimeMicros();
+
+    // The block was fully checked when it was accepted, so skip the proof of
+    // work checks ReadBlockFromDisk would repeat.
+    CBlock block;
+    {
+        CAutoFile filein(OpenBlockFile(job.pos, true), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return;
+        try {
+            filein >> block;
+        } catch (const std::exception&) {
+            return;
+        }
+    }
+    if (block.GetHash() != job.hash)
+        return;
+
+    const bool postBurn = job.nHeight > Params().GetConsensus().zResetHeight;
+    uint64_t nGen;
+    {
+        LOCK(cs);
+        if (cachedUsage > MAX_PREFETCH_USAGE)
+            Clear();
+        nGen = nGeneration;
+    }
+
+    // Each lookup reads the database without holding cs, and is only stored
+    // if no BatchWrite happened in the meantime. A lookup that loses that
+    // race is dropped, and the connecting thread reads the database itself.
+    std::set<uint256> setCreated;
+    unsigned int nFetched = 0;
+    try {
+        BOOST_FOREACH(const CTransactionRef& ptx, block.vtx) {
+            const CTransaction& tx = *ptx;
+            if (!tx.IsCoinBase()) {
+                BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+                    const uint256& txid = txin.prevout.hash;
+                    if (setCreated.count(txid))
+                        continue;
+                    {
+                        LOCK(cs);
+                        if (cacheCoins.count(txid))
+                            continue;
+                    }
+                    CCoins coins;
+                    if (!base->GetCoins(txid, coins))
+                        continue;
+                    if (AddPrefetchedCoins(txid, coins, nGen))
+                        nFetched++;
+                }
+            }
+
+            BOOST_FOREACH(const JSDescription& joinsplit, tx.vjoinsplit) {
+                BOOST_FOREACH(const uint256& nullifier, joinsplit.nullifiers) {
+                    bool fSpent = base->GetNullifier(nullifier);
+                    LOCK(cs);
+                    if (nGeneration != nGen) {
+                        nGen = nGeneration;
+                        continue;
+                    }
+                    cacheNullifiers[nullifier] = fSpent;
+                }
+
+                // Anchors created earlier in this block are not in the
+                // database; those lookups simply find nothing.
+                ZCIncrementalMerkleTree tree;
+                if (!base->GetAnchorAt(joinsplit.anchor, tree, postBurn))
+                    continue;
+                LOCK(cs);
+                if (nGeneration != nGen) {
+                    nGen = nGeneration;
+                    continue;
+                }
+                std::pair<CPrefetchAnchorsMap::iterator, bool> ret = cacheAnchors.insert(std::make_pair(std::make_pair(joinsplit.anchor, postBurn), tree));
+                if (ret.second)
+                    cachedUsage += tree.DynamicMemoryUsage();
+            }
+
+            setCreated.insert(tx.GetHash());
+        }
+    } catch (const std::exception& e) {
+        // Leave reporting database errors to the connecting thread.
+        LogPrint("bench", "%s: aborted at block %s: %s\n", __func__, job.hash.ToString(), e.what());
+        return;
+    }
+
+    uint64_t nHitsNow, nMissesNow;
+    {
+        LOCK(cs);
+        nHitsNow = nHits;
+        nMissesNow = nMisses;
+    }
+    LogPrint("bench", "    - Prefetch %u coins for block %d: %.2fms (coins served %u, missed %u)\n",
+        nFetched, job.nHeight, (GetTimeMicros() - nTimeStart) * 0.001, nHitsNow, nMissesNow);
+}
+
+void CCoinsViewPrefetch::Enqueue(const std::vector<CPrefetchBlock>& vBlocks, int nTipHeight)
+{
+    boost::unique_lock<boost::mutex> lock(mutexQueue);
+    if (fStop)
+        return;
+
+    std::deque<CPrefetchBlock>::iterator itEnd = queue.begin();
+    while (itEnd != queue.end() && itEnd->nHeight <= nTipHeight)
+        ++itEnd;
+    queue.erase(queue.begin(), itEnd);
+
+    BOOST_FOREACH(const CPrefetchBlock& block, vBlocks) {
+        if (block.nHeight <= nTipHeight)
+            continue;
+        if (block.nHeight > nTipHeight + nBlocksAhead)
+            break;
+        if (!setQueued.insert(block.hash).second)
+            continue;
+        vQueuedOrder.push_back(block.hash);
+        if (vQueuedOrder.size() > MAX_QUEUED_HASHES) {
+            setQueued.erase(vQueuedOrder.front());
+            vQueuedOrder.pop_front();
+        }
+        queue.push_back(block);
+    }
+    if (!queue.empty())
+        condQueue.notify_one();
+}
+
+void CCoinsViewPrefetch::Thread()
+{
+    RenameThread("zcash-prefetch");
+    while (true) {
+        CPrefetchBlock job;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexQueue);
+            fBusy = false;
+            condQueue.notify_all();
+            while (!fStop && queue.empty())
+                condQueue.wait(lock);
+            if (fStop)
+                return;
+            job = queue.front();
+            queue.pop_front();
+            fBusy = true;
+        }
+        PrefetchBlock(job);
+    }
+}
+
+void CCoinsViewPrefetch::Stop()
+{
+    boost::unique_lock<boost::mutex> lock(mutexQueue);
+    fStop = true;
+    queue.clear();
+    condQueue.notify_all();
+    while (fBusy)
+        condQueue.wait(lock);
+}
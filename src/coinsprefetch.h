@@ -0,0 +1,127 @@
+// Copyright (c) 2018 The Bitcoin Private developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_COINSPREFETCH_H
+#define BITCOIN_COINSPREFETCH_H
+
+#include "chain.h"
+#include "coins.h"
+#include "sync.h"
+
+#include <deque>
+#include <map>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
+
+class CBlock;
+
+//! -prefetchinputs default (number of blocks ahead of the tip)
+static const int DEFAULT_PREFETCH_BLOCKS = 16;
+//! Memory held by prefetched entries before they are dropped (bytes)
+static const size_t MAX_PREFETCH_USAGE = 32 << 20;
+
+/** A block waiting to have its inputs prefetched. */
+struct CPrefetchBlock
+{
+    uint256 hash;
+    int nHeight;
+    CDiskBlockPos pos;
+
+    CPrefetchBlock() : nHeight(0) {}
+    CPrefetchBlock(const uint256& hashIn, int nHeightIn, const CDiskBlockPos& posIn) :
+        hash(hashIn), nHeight(nHeightIn), pos(posIn) {}
+};
+
+/**
+ * CCoinsView that sits directly on top of the coins database and is filled
+ * ahead of time by a background thread with the coins, nullifiers and
+ * anchors that blocks about to be connected will look up.
+ *
+ * The background thread reads the database without holding any lock the
+ * validation code uses. Every write bumps a generation counter and
+ * drops everything prefetched so far, and results read under an older
+ * generation are discarded, so the layer never returns anything that
+ * differs from what the database would return at the time of the call.
+ */
+class CCoinsViewPrefetch : public CCoinsViewBacked
+{
+private:
+    typedef boost::unordered_map<uint256, CCoins, CCoinsKeyHasher> CPrefetchCoinsMap;
+    typedef boost::unordered_map<uint256, bool, CCoinsKeyHasher> CPrefetchNullifiersMap;
+    typedef std::map<std::pair<uint256, bool>, ZCIncrementalMerkleTree> CPrefetchAnchorsMap;
+
+    //! Protects the prefetched entries, the generation and the counters
+    mutable CCriticalSection cs;
+    mutable CPrefetchCoinsMap cacheCoins;
+    mutable CPrefetchNullifiersMap cacheNullifiers;
+    mutable CPrefetchAnchorsMap cacheAnchors;
+    mutable size_t cachedUsage;
+    uint64_t nGeneration;
+    mutable uint64_t nHits;
+    mutable uint64_t nMisses;
+    //! How far ahead of the tip blocks are prefetched
+    const int nBlocksAhead;
+
+    //! Protects the queue of blocks to prefetch
+    boost::mutex mutexQueue;
+    boost::condition_variable condQueue;
+    std::deque<CPrefetchBlock> queue;
+    //! Blocks already queued, so repeated calls do not queue them again
+    std::set<uint256> setQueued;
+    std::deque<uint256> vQueuedOrder;
+    bool fBusy;
+    bool fStop;
+
+    void Clear() const;
+    void PrefetchBlock(const CPrefetchBlock& job);
+
+public:
+    CCoinsViewPrefetch(CCoinsView *viewIn, int nBlocksAheadIn);
+
+    bool GetAnchorAt(const uint256 &rt, ZCIncrementalMerkleTree &tree, const bool postBurn) const;
+    bool GetNullifier(const uint256 &nullifier) const;
+    bool GetCoins(const uint256 &txid, CCoins &coins) const;
+    bool HaveCoins(const uint256 &txid) const;
+    bool BatchWrite(CCoinsMap &mapCoins,
+                    const uint256 &hashBlock,
+                    const uint256 &hashAnchor,
+                    CAnchorsMap &mapAnchors,
+                    CNullifiersMap &mapNullifiers);
+    bool BatchWriteDirty(const CCoinsMap &mapCoins,
+                         const uint256 &hashBlock,
+                         const uint256 &hashAnchor,
+                         const CAnchorsMap &mapAnchors,
+                         const CNullifiersMap &mapNullifiers);
+
+    /** Generation a lookup must start under for its result to be stored */
+    uint64_t GetGeneration() const;
+
+    /**
+     * Store coins read from the database by a lookup started under
+     * generation nGen. If a BatchWrite happened since, they may be out of
+     * date: they are dropped and nGen is moved to the current generation.
+     * Returns whether the coins were stored.
+     */
+    bool AddPrefetchedCoins(const uint256 &txid, CCoins &coins, uint64_t &nGen);
+
+    /**
+     * Queue blocks (in the order they will be connected) for prefetching.
+     * Blocks at or below nTipHeight, or more than nBlocksAhead above it, are
+     * skipped, and queued blocks at or below nTipHeight are dropped.
+     */
+    void Enqueue(const std::vector<CPrefetchBlock>& vBlocks, int nTipHeight);
+
+    /** Worker loop; returns once Stop() has been called. */
+    void Thread();
+
+    /** Make Thread() return, and wait for the block in progress to finish. */
+    void Stop();
+};
+
+#endif // BITCOIN_COINSPREFETCH_H
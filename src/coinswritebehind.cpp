@@ -0,0 +1,232 @@
+// Copyright (c) 2018 The Bitcoin Private developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinswritebehind.h"
+
+#include "random.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <stdlib.h>
+
+#include <boost/thread/thread.hpp>
+
+CCoinsViewWriteBehind::CCoinsViewWriteBehind(CCoinsView *viewIn, int nCrashRatioIn) :
+    CCoinsViewBacked(viewIn), fPending(false), fFailed(false), fRunning(false), fStop(false),
+    nCrashRatio(nCrashRatioIn) { }
+
+// Only entries marked dirty differ from the backing view; everything else
+// is answered by it.
+
+bool CCoinsViewWriteBehind::GetAnchorAt(const uint256 &rt, ZCIncrementalMerkleTree &tree, const bool postBurn) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fPending && rt != ZCIncrementalMerkleTree::empty_root()) {
+            CAnchorsMap::const_iterator it = mapAnchorsPending.find(rt);
+            if (it != mapAnchorsPending.end() && (it->second.flags & CAnchorsCacheEntry::DIRTY)) {
+                if (!it->second.entered)
+                    return false;
+                tree = it->second.tree;
+                return (!postBurn || it->second.postBurn);
+            }
+        }
+    }
+    return base->GetAnchorAt(rt, tree, postBurn);
+}
+
+bool CCoinsViewWriteBehind::GetNullifier(const uint256 &nullifier) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fPending) {
+            CNullifiersMap::const_iterator it = mapNullifiersPending.find(nullifier);
+            if (it != mapNullifiersPending.end() && (it->second.flags & CNullifiersCacheEntry::DIRTY))
+                return it->second.entered;
+        }
+    }
+    return base->GetNullifier(nullifier);
+}
+
+bool CCoinsViewWriteBehind::GetCoins(const uint256 &txid, CCoins &coins) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fPending) {
+            CCoinsMap::const_iterator it = mapCoinsPending.find(txid);
+            if (it != mapCoinsPending.end() && (it->second.flags & CCoinsCacheEntry::DIRTY)) {
+                // Pruned entries are erased from the database.
+                if (it->second.coins.IsPruned())
+                    return false;
+                coins = it->second.coins;
+                return true;
+            }
+        }
+    }
+    return base->GetCoins(txid, coins);
+}
+
+bool CCoinsViewWriteBehind::HaveCoins(const uint256 &txid) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fPending) {
+            CCoinsMap::const_iterator it = mapCoinsPending.find(txid);
+            if (it != mapCoinsPending.end() && (it->second.flags & CCoinsCacheEntry::DIRTY))
+                return !it->second.coins.IsPruned();
+        }
+    }
+    return base->HaveCoins(txid);
+}
+
+uint256 CCoinsViewWriteBehind::GetBestBlock() const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fPending && !hashBlockPending.IsNull())
+            return hashBlockPending;
+    }
+    return base->GetBestBlock();
+}
+
+uint256 CCoinsViewWriteBehind::GetBestAnchor() const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fPending && !hashAnchorPending.IsNull())
+            return hashAnchorPending;
+    }
+    return base->GetBestAnchor();
+}
+
+bool CCoinsViewWriteBehind::BatchWrite(CCoinsMap &mapCoins,
+                                       const uint256 &hashBlock,
+                                       const uint256 &hashAnchor,
+                                       CAnchorsMap &mapAnchors,
+                                       CNullifiersMap &mapNullifiers)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (!WaitForPending(lock))
+        return false;
+
+    // The previous snapshot has been written and cleared; take over the
+    // caller's maps, which it expects to find emptied.
+    mapCoinsPending.swap(mapCoins);
+    mapAnchorsPending.swap(mapAnchors);
+    mapNullifiersPending.swap(mapNullifiers);
+    hashBlockPending = hashBlock;
+    hashAnchorPending = hashAnchor;
+    fPending = true;
+
+    if (!fRunning)
+        return WaitForPending(lock);
+    cond.notify_all();
+    return true;
+}
+
+void CCoinsViewWriteBehind::WritePending()
+{
+    // The snapshot is not modified while it is pending, so it can be read
+    // here without the lock. It is written in place: lookups keep using it
+    // until the write is done.
+    int64_t nTimeStart = GetTimeMicros();
+
+    if (nCrashRatio > 0 && GetRand(nCrashRatio) == 0) {
+        LogPrintf("Simulating a crash while writing the chainstate (-dbcrashratio)\n");
+        _Exit(EXIT_FAILURE);
+    }
+
+    bool fOk = false;
+    try {
+        fOk = base->BatchWriteDirty(mapCoinsPending, hashBlockPending, hashAnchorPending, mapAnchorsPending, mapNullifiersPending);
+    } catch (const std::runtime_error& e) {
+        LogPrintf("%s: %s\n", __func__, e.what());
+    }
+    LogPrint("coindb", "Wrote chainstate for block %s in the background: %.2fms\n",
+        hashBlockPending.ToString(), (GetTimeMicros() - nTimeStart) * 0.001);
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (fOk) {
+        mapCoinsPending.clear();
+        mapAnchorsPending.clear();
+        mapNullifiersPending.clear();
+        fPending = false;
+    } else {
+        // Keep answering lookups from the snapshot, as the backing view
+        // does not have it; the next flush reports the failure.
+        LogPrintf("%s: failed to write the chainstate\n", __func__);
+        fFailed = true;
+    }
+    cond.notify_all();
+}
+
+bool CCoinsViewWriteBehind::WaitForPending(boost::unique_lock<boost::mutex>& lock)
+{
+    // Callers hold cs_main; don't let an interruption abandon a flush.
+    boost::this_thread::disable_interruption di;
+    while (fPending && !fFailed) {
+        if (fRunning) {
+            cond.wait(lock);
+        } else {
+            lock.unlock();
+            WritePending();
+            lock.lock();
+        }
+    }
+    return !fFailed;
+}
+
+bool CCoinsViewWriteBehind::Sync()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return WaitForPending(lock);
+}
+
+bool CCoinsViewWriteBehind::HasFailed() const
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return fFailed;
+}
+
+void CCoinsViewWriteBehind::Thread()
+{
+    RenameThread("zcash-flush");
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fStop)
+            return;
+        fRunning = true;
+    }
+    try {
+        while (true) {
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fStop && (!fPending || fFailed))
+                    cond.wait(lock);
+                if (!fPending || fFailed)
+                    break;
+            }
+            WritePending();
+        }
+    } catch (const boost::thread_interrupted&) {
+        // Anything still pending is written by whoever waits for it.
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fRunning = false;
+        cond.notify_all();
+        throw;
+    }
+    boost::unique_lock<boost::mutex> lock(mutex);
+    fRunning = false;
+    cond.notify_all();
+}
+
+void CCoinsViewWriteBehind::Stop()
+{
+    boost::this_thread::disable_interruption di;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    fStop = true;
+    cond.notify_all();
+    while (fRunning)
+        cond.wait(lock);
+}
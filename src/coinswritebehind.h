@@ -0,0 +1,86 @@
+// Copyright (c) 2018 The Bitcoin Private developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_COINSWRITEBEHIND_H
+#define BITCOIN_COINSWRITEBEHIND_H
+
+#include "coins.h"
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+//! -writebehind default
+static const bool DEFAULT_WRITE_BEHIND = true;
+
+/**
+ * CCoinsView that writes flushed changes to its backing view on a
+ * background thread.
+ *
+ * BatchWrite takes over the caller's maps as a snapshot (BatchWriteDirty
+ * copies their dirty entries into one), wakes the writer thread and
+ * returns; the writer hands the snapshot to the backing view as is. Until
+ * the snapshot has been written, lookups are answered from it first, so
+ * callers see the state after the write as soon as BatchWrite returns. Only one snapshot is in flight at a time: a
+ * second BatchWrite waits for the first to be written. Each snapshot is
+ * still written in a single batch together with its best block, so the
+ * backing database moves from one flushed state to the next exactly as
+ * before; a crash in between leaves it at the previous one.
+ *
+ * If the writer thread is not running (during startup, or after it was
+ * interrupted), snapshots are written by the thread waiting for them.
+ */
+class CCoinsViewWriteBehind : public CCoinsViewBacked
+{
+private:
+    //! Protects everything below
+    mutable boost::mutex mutex;
+    mutable boost::condition_variable cond;
+
+    //! The snapshot being written. Not modified while fPending is set.
+    CCoinsMap mapCoinsPending;
+    CAnchorsMap mapAnchorsPending;
+    CNullifiersMap mapNullifiersPending;
+    uint256 hashBlockPending;
+    uint256 hashAnchorPending;
+
+    bool fPending;
+    bool fFailed;
+    bool fRunning;
+    bool fStop;
+    //! Test only: exit the process before 1 in nCrashRatio writes
+    int nCrashRatio;
+
+    void WritePending();
+    bool WaitForPending(boost::unique_lock<boost::mutex>& lock);
+
+public:
+    CCoinsViewWriteBehind(CCoinsView *viewIn, int nCrashRatioIn = 0);
+
+    bool GetAnchorAt(const uint256 &rt, ZCIncrementalMerkleTree &tree, const bool postBurn) const;
+    bool GetNullifier(const uint256 &nullifier) const;
+    bool GetCoins(const uint256 &txid, CCoins &coins) const;
+    bool HaveCoins(const uint256 &txid) const;
+    uint256 GetBestBlock() const;
+    uint256 GetBestAnchor() const;
+    bool BatchWrite(CCoinsMap &mapCoins,
+                    const uint256 &hashBlock,
+                    const uint256 &hashAnchor,
+                    CAnchorsMap &mapAnchors,
+                    CNullifiersMap &mapNullifiers);
+
+    /** Wait until the snapshot in flight, if any, has been written. */
+    bool Sync();
+
+    /** Whether writing a snapshot has failed. */
+    bool HasFailed() const;
+
+    /** Writer loop; returns once Stop() has been called. */
+    void Thread();
+
+    /** Write the snapshot in flight, make Thread() return and wait for it. */
+    void Stop();
+};
+
+#endif // BITCOIN_COINSWRITEBEHIND_H
@@ -94,7 +94,8 @@ size_t strnlen( const char *start, size_t max_len);
 #endif // HAVE_DECL_STRNLEN
 
 bool static inline IsSelectableSocket(SOCKET s) {
-#ifdef WIN32
+#if defined(WIN32) || defined(HAVE_SYS_EPOLL_H)
+    // Not limited by FD_SETSIZE, or not waited for with select() at all
     return true;
 #else
     return (s < FD_SETSIZE);
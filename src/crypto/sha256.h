@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string>
 
 /** A hasher class for SHA-256. */
 class CSHA256
@@ -29,4 +30,35 @@ private:
     void FinalizeNoPadding(unsigned char hash[OUTPUT_SIZE], bool enforce_compression);
 };
 
+/** SHA-256 back-ends that SHA256AutoDetect may select, as a bitmask. */
+enum SHA256Backend
+{
+    SHA256_STANDARD = 0,
+    SHA256_SSE41 = 1 << 0, //!< 4-way SHA256D64
+    SHA256_AVX2 = 1 << 1,  //!< 8-way SHA256D64
+    SHA256_SHANI = 1 << 2, //!< Single block transform
+    SHA256_ALL = SHA256_SSE41 | SHA256_AVX2 | SHA256_SHANI,
+};
+
+/**
+ * Select the fastest SHA-256 implementation the CPU supports, using only the
+ * back-ends in mask. Each back-end is self-tested before it is put to use and
+ * skipped if it gives wrong results. Not thread-safe: call it at startup
+ * before any hashing threads are running.
+ *
+ * @return a description of the implementation in use
+ */
+std::string SHA256AutoDetect(int mask = SHA256_ALL);
+
+/**
+ * Compute the double SHA-256 of each of blocks independent 64-byte inputs,
+ * several at a time where the CPU allows it. This is the inner operation of
+ * merkle root computation.
+ *
+ * @param[out] output  blocks * 32 bytes of digests; may be the same buffer
+ *                     as input
+ * @param[in]  input   blocks * 64 bytes of input
+ */
+void SHA256D64(unsigned char* output, const unsigned char* input, size_t blocks);
+
 #endif // BITCOIN_CRYPTO_SHA256_H
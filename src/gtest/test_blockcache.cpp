@@ -0,0 +1,88 @@
+#include <gtest/gtest.h>
+
+#include "blockcache.h"
+#include "random.h"
+#include "uint256.h"
+
+static CSerializeDataRef MakeMessage(size_t nSize)
+{
+    return std::make_shared<CSerializeData>(nSize);
+}
+
+TEST(BlockCache, EvictsLeastRecentlyUsed) {
+    SetBlockCacheSize(1 << 20);
+    ASSERT_TRUE(IsBlockCacheEnabled());
+    ClearCachedMessages(BLOCK_CACHE_BLOCK);
+    ClearCachedMessages(BLOCK_CACHE_HEADERS);
+    CBlockCacheStats before = GetBlockCacheStats();
+
+    uint256 hashA = GetRandHash(), hashB = GetRandHash(), hashC = GetRandHash();
+    CSerializeDataRef pmsgA = MakeMessage(400000);
+    AddMessageToCache(BLOCK_CACHE_BLOCK, hashA, pmsgA);
+    AddMessageToCache(BLOCK_CACHE_BLOCK, hashB, MakeMessage(400000));
+
+    // The cached buffer itself is handed out
+    EXPECT_EQ(pmsgA, GetCachedMessage(BLOCK_CACHE_BLOCK, hashA));
+    EXPECT_FALSE(GetCachedMessage(BLOCK_CACHE_HEADERS, hashA));
+
+    // A was used more recently than B, so B makes room for C
+    AddMessageToCache(BLOCK_CACHE_BLOCK, hashC, MakeMessage(400000));
+    EXPECT_FALSE(GetCachedMessage(BLOCK_CACHE_BLOCK, hashB));
+    EXPECT_TRUE(GetCachedMessage(BLOCK_CACHE_BLOCK, hashA));
+    EXPECT_TRUE(GetCachedMessage(BLOCK_CACHE_BLOCK, hashC));
+
+    // Messages larger than the whole cache aren't kept
+    uint256 hashLarge = GetRandHash();
+    AddMessageToCache(BLOCK_CACHE_BLOCK, hashLarge, MakeMessage(2000000));
+    EXPECT_FALSE(GetCachedMessage(BLOCK_CACHE_BLOCK, hashLarge));
+
+    // Lookups are only counted by the callers
+    CBlockCacheStats after = GetBlockCacheStats();
+    EXPECT_EQ(before.nHits[BLOCK_CACHE_BLOCK], after.nHits[BLOCK_CACHE_BLOCK]);
+    EXPECT_EQ(before.nMisses[BLOCK_CACHE_BLOCK], after.nMisses[BLOCK_CACHE_BLOCK]);
+    EXPECT_EQ(before.nEvicted + 1, after.nEvicted);
+    EXPECT_EQ(800000U, after.nBytes);
+    EXPECT_EQ(1U << 20, after.nMaxBytes);
+
+    CountCacheLookup(BLOCK_CACHE_BLOCK, true);
+    CountCacheLookup(BLOCK_CACHE_BLOCK, false);
+    CountCacheLookup(BLOCK_CACHE_HEADERS, false);
+    after = GetBlockCacheStats();
+    EXPECT_EQ(before.nHits[BLOCK_CACHE_BLOCK] + 1, after.nHits[BLOCK_CACHE_BLOCK]);
+    EXPECT_EQ(before.nMisses[BLOCK_CACHE_BLOCK] + 1, after.nMisses[BLOCK_CACHE_BLOCK]);
+    EXPECT_EQ(before.nHits[BLOCK_CACHE_HEADERS], after.nHits[BLOCK_CACHE_HEADERS]);
+    EXPECT_EQ(before.nMisses[BLOCK_CACHE_HEADERS] + 1, after.nMisses[BLOCK_CACHE_HEADERS]);
+
+    // Shrinking the cache evicts what no longer fits
+    SetBlockCacheSize(500000);
+    EXPECT_EQ(400000U, GetBlockCacheStats().nBytes);
+    EXPECT_FALSE(GetCachedMessage(BLOCK_CACHE_BLOCK, hashA));
+    EXPECT_TRUE(GetCachedMessage(BLOCK_CACHE_BLOCK, hashC));
+
+    ClearCachedMessages(BLOCK_CACHE_BLOCK);
+    EXPECT_EQ(0U, GetBlockCacheStats().nBytes);
+    SetBlockCacheSize(DEFAULT_BLOCK_CACHE_SIZE << 20);
+}
+
+TEST(BlockCache, ClearsOneKind) {
+    uint256 hashBlock = GetRandHash();
+    uint256 key = GetHeadersCacheKey(GetRandHash(), uint256());
+    AddMessageToCache(BLOCK_CACHE_BLOCK, hashBlock, MakeMessage(1000));
+    AddMessageToCache(BLOCK_CACHE_HEADERS, key, MakeMessage(1000));
+
+    ClearCachedMessages(BLOCK_CACHE_HEADERS);
+    EXPECT_FALSE(GetCachedMessage(BLOCK_CACHE_HEADERS, key));
+    EXPECT_TRUE(GetCachedMessage(BLOCK_CACHE_BLOCK, hashBlock));
+
+    ClearCachedMessages(BLOCK_CACHE_BLOCK);
+    EXPECT_FALSE(GetCachedMessage(BLOCK_CACHE_BLOCK, hashBlock));
+}
+
+TEST(BlockCache, Disabled) {
+    SetBlockCacheSize(0);
+    EXPECT_FALSE(IsBlockCacheEnabled());
+    uint256 hash = GetRandHash();
+    AddMessageToCache(BLOCK_CACHE_BLOCK, hash, MakeMessage(1000));
+    EXPECT_FALSE(GetCachedMessage(BLOCK_CACHE_BLOCK, hash));
+    SetBlockCacheSize(DEFAULT_BLOCK_CACHE_SIZE << 20);
+}
@@ -0,0 +1,53 @@
+#include <gtest/gtest.h>
+
+#include "primitives/transaction.h"
+#include "proofcache.h"
+#include "random.h"
+#include "uint256.h"
+
+TEST(ProofCache, KeyCoversPublicInputs) {
+    JSDescription js;
+    js.anchor = GetRandHash();
+    js.nullifiers[0] = GetRandHash();
+    js.commitments[1] = GetRandHash();
+    uint256 pubKeyHash = GetRandHash();
+
+    uint256 key = GetProofCacheKey(js, pubKeyHash);
+    EXPECT_EQ(key, GetProofCacheKey(js, pubKeyHash));
+    EXPECT_NE(key, GetProofCacheKey(js, GetRandHash()));
+
+    JSDescription js2 = js;
+    js2.anchor = GetRandHash();
+    EXPECT_NE(key, GetProofCacheKey(js2, pubKeyHash));
+
+    js2 = js;
+    js2.nullifiers[1] = GetRandHash();
+    EXPECT_NE(key, GetProofCacheKey(js2, pubKeyHash));
+
+    js2 = js;
+    js2.commitments[0] = GetRandHash();
+    EXPECT_NE(key, GetProofCacheKey(js2, pubKeyHash));
+
+    js2 = js;
+    js2.vpub_old = 1;
+    EXPECT_NE(key, GetProofCacheKey(js2, pubKeyHash));
+
+    js2 = js;
+    js2.proof = libzcash::ZCProof::random_invalid();
+    EXPECT_NE(key, GetProofCacheKey(js2, pubKeyHash));
+
+    // Ciphertexts are not inputs to the proof
+    js2 = js;
+    js2.ephemeralKey = GetRandHash();
+    EXPECT_EQ(key, GetProofCacheKey(js2, pubKeyHash));
+}
+
+TEST(ProofCache, InsertAndLookup) {
+    JSDescription js;
+    js.anchor = GetRandHash();
+    uint256 key = GetProofCacheKey(js, GetRandHash());
+
+    EXPECT_FALSE(IsProofCached(key));
+    AddProofToCache(key);
+    EXPECT_TRUE(IsProofCached(key));
+}
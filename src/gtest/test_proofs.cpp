@@ -518,6 +518,63 @@ TEST(proofs, zksnark_serializes_properly)
     }
 }
 
+TEST(proofs, batch_verification)
+{
+    auto example = libsnark::generate_r1cs_example_with_field_input<curve_Fr>(250, 4);
+    example.constraint_system.swap_AB_if_beneficial();
+    auto kp = libsnark::r1cs_ppzksnark_generator<curve_pp>(example.constraint_system);
+    auto vkprecomp = libsnark::r1cs_ppzksnark_verifier_process_vk(kp.vk);
+
+    std::vector<libsnark::r1cs_ppzksnark_proof<curve_pp>> proofs;
+    for (size_t i = 0; i < 5; i++) {
+        proofs.push_back(libsnark::r1cs_ppzksnark_prover<curve_pp>(
+            kp.pk,
+            example.primary_input,
+            example.auxiliary_input,
+            example.constraint_system
+        ));
+    }
+
+    // A batch of valid proofs verifies
+    {
+        auto verifier = ProofVerifier::Batch();
+        for (auto& proof : proofs) {
+            ASSERT_TRUE(verifier.check(kp.vk, vkprecomp, example.primary_input, proof));
+        }
+        ASSERT_TRUE(verifier.VerifyBatch());
+        // The batch is cleared after verification
+        ASSERT_TRUE(verifier.VerifyBatch());
+    }
+
+    // A single bad proof fails the batch and is identified
+    for (size_t bad = 0; bad < proofs.size(); bad++) {
+        auto verifier = ProofVerifier::Batch();
+        for (size_t i = 0; i < proofs.size(); i++) {
+            if (i == bad) {
+                auto badproof = ZCProof::random_invalid().to_libsnark_proof<libsnark::r1cs_ppzksnark_proof<curve_pp>>();
+                ASSERT_TRUE(verifier.check(kp.vk, vkprecomp, example.primary_input, badproof));
+            } else {
+                ASSERT_TRUE(verifier.check(kp.vk, vkprecomp, example.primary_input, proofs[i]));
+            }
+        }
+        size_t nFailed = proofs.size();
+        ASSERT_FALSE(verifier.VerifyBatch(&nFailed));
+        ASSERT_EQ(nFailed, bad);
+    }
+
+    // A valid proof for the wrong primary input fails the batch
+    {
+        auto input = example.primary_input;
+        input[0] = input[0] + curve_Fr::one();
+        auto verifier = ProofVerifier::Batch();
+        ASSERT_TRUE(verifier.check(kp.vk, vkprecomp, example.primary_input, proofs[0]));
+        ASSERT_TRUE(verifier.check(kp.vk, vkprecomp, input, proofs[1]));
+        size_t nFailed = 0;
+        ASSERT_FALSE(verifier.VerifyBatch(&nFailed));
+        ASSERT_EQ(nFailed, 1);
+    }
+}
+
 TEST(proofs, g1_deserialization)
 {
     CompressedG1 g;
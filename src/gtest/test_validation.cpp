@@ -61,3 +61,35 @@ TEST(Validation, ContextualCheckInputsPassesWithCoinbase) {
     CValidationState state;
     EXPECT_TRUE(ContextualCheckInputs(tx, state, view, false, 0, false, Params(CBaseChainParams::MAIN).GetConsensus()));
 }
+
+TEST(Validation, ScriptExecutionCache) {
+    InitScriptExecutionCache();
+
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vin[0].prevout = COutPoint(uint256S("0x1"), 0);
+    mtx.vout.resize(1);
+    mtx.vout[0].nValue = 1;
+    CTransaction tx(mtx);
+    mtx.vout[0].nValue = 2;
+    CTransaction tx2(mtx);
+
+    const unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
+
+    LOCK(cs_main);
+    uint64_t nHits, nMisses;
+    GetScriptExecutionCacheStats(nHits, nMisses);
+
+    EXPECT_FALSE(IsScriptExecutionCached(tx, flags, false));
+    AddScriptExecutionToCache(tx, flags);
+    EXPECT_TRUE(IsScriptExecutionCached(tx, flags, false));
+
+    // Entries are specific to both the transaction and the flags
+    EXPECT_FALSE(IsScriptExecutionCached(tx, flags | SCRIPT_VERIFY_FORKID, false));
+    EXPECT_FALSE(IsScriptExecutionCached(tx2, flags, false));
+
+    uint64_t nHitsAfter, nMissesAfter;
+    GetScriptExecutionCacheStats(nHitsAfter, nMissesAfter);
+    EXPECT_EQ(nHits + 1, nHitsAfter);
+    EXPECT_EQ(nMisses + 3, nMissesAfter);
+}
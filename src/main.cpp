@@ -10,16 +10,23 @@
 #include "addrman.h"
 #include "alert.h"
 #include "arith_uint256.h"
+#include "blockcache.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
+#include "coinsprefetch.h"
+#include "coinswritebehind.h"
 #include "consensus/validation.h"
+#include "crypto/sha256.h"
+#include "cuckoocache.h"
 #include "deprecation.h"
 #include "init.h"
 #include "merkleblock.h"
 #include "metrics.h"
+#include "miner.h"
 #include "net.h"
 #include "pow.h"
+#include "proofcache.h"
 #include "txdb.h"
 #include "txmempool.h"
 #include "ui_interface.h"
@@ -70,6 +77,7 @@ bool fCheckBlockIndex = false;
 bool fCheckpointsEnabled = true;
 bool fCoinbaseEnforcedProtectionEnabled = true;
 size_t nCoinCacheUsage = 5000 * 300;
+unsigned int nCoinCacheLowWater = DEFAULT_COIN_CACHE_LOW_WATER;
 uint64_t nPruneTarget = 0;
 bool fAlerts = DEFAULT_ALERTS;
 
@@ -105,14 +113,35 @@ std::string GetUTXOFileName(int nHeight)
 /** Fees smaller than this (in satoshi) are considered zero fee (for relaying and mining) */
 CFeeRate minRelayTxFee = CFeeRate(DEFAULT_MIN_RELAY_TX_FEE);
 
+/**
+ * Transactions whose input scripts and joinSplitSig have been verified under
+ * a given set of script flags, so that transactions accepted to the mempool
+ * skip script execution when their block is connected. Entries are
+ * SHA256(nonce || txid || flags); the txid commits to the scripts and to the
+ * outputs being spent. Guarded by cs_main.
+ */
+static CuckooCache::cache<uint256, SignatureCacheHasher> scriptExecutionCache;
+static uint256 scriptExecutionCacheNonce;
+//! Zero until InitScriptExecutionCache() has been called
+static uint32_t nScriptExecutionCacheElems = 0;
+static std::atomic<uint64_t> nScriptExecutionCacheHits(0);
+static std::atomic<uint64_t> nScriptExecutionCacheMisses(0);
+
 CTxMemPool mempool(::minRelayTxFee);
 
 struct COrphanTx {
-    CTransaction tx;
+    CTransactionRef tx;
     NodeId fromPeer;
+    int64_t nTimeExpire;
+    unsigned int nTxSize;
 };
-map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(cs_main);;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev GUARDED_BY(cs_main);;
+map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(cs_main);
+//! Orphans by the outputs they spend, to find them when a parent arrives
+map<COutPoint, set<uint256> > mapOrphanTransactionsByPrev GUARDED_BY(cs_main);
+//! Serialized size of all orphans
+size_t nOrphanTransactionsSize GUARDED_BY(cs_main) = 0;
+//! Orphans which may have become acceptable, in the order their parents arrived
+static std::deque<uint256> vOrphanWorkQueue GUARDED_BY(cs_main);
 void EraseOrphansFor(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
 /**
@@ -579,6 +608,8 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsViewPrefetch *pcoinsPrefetch = NULL;
+CCoinsViewWriteBehind *pcoinsWriteBehind = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
@@ -586,8 +617,9 @@ CBlockTreeDB *pblocktree = NULL;
 // mapOrphanTransactions
 //
 
-bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+bool AddOrphanTx(const CTransactionRef& ptx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
+    const CTransaction& tx = *ptx;
     uint256 hash = tx.GetHash();
     if (mapOrphanTransactions.count(hash))
         return false;
@@ -597,8 +629,8 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(c
     // large transaction with a missing parent then we assume
     // it will rebroadcast it later, after the parent transaction(s)
     // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
+    // The pool as a whole is also bounded by -maxorphantxsize, see
+    // LimitOrphanTxSize.
     unsigned int sz = tx.GetSerializeSize(SER_NETWORK, tx.nVersion);
     if (sz > 5000)
     {
@@ -606,13 +638,17 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(c
         return false;
     }
 
-    mapOrphanTransactions[hash].tx = tx;
-    mapOrphanTransactions[hash].fromPeer = peer;
+    COrphanTx& orphan = mapOrphanTransactions[hash];
+    orphan.tx = ptx;
+    orphan.fromPeer = peer;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    orphan.nTxSize = sz;
+    nOrphanTransactionsSize += sz;
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
+        mapOrphanTransactionsByPrev[txin.prevout].insert(hash);
 
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u)\n", hash.ToString(),
-             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u outsz %u bytes %u)\n", hash.ToString(),
+             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size(), nOrphanTransactionsSize);
     return true;
 }
 
@@ -621,15 +657,16 @@ void static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
     map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
     if (it == mapOrphanTransactions.end())
         return;
-    BOOST_FOREACH(const CTxIn& txin, it->second.tx.vin)
+    BOOST_FOREACH(const CTxIn& txin, it->second.tx->vin)
     {
-        map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
+        map<COutPoint, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
         if (itPrev == mapOrphanTransactionsByPrev.end())
             continue;
         itPrev->second.erase(hash);
         if (itPrev->second.empty())
             mapOrphanTransactionsByPrev.erase(itPrev);
     }
+    nOrphanTransactionsSize -= it->second.nTxSize;
     mapOrphanTransactions.erase(it);
 }
 
@@ -642,7 +679,7 @@ void EraseOrphansFor(NodeId peer)
         map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
         if (maybeErase->second.fromPeer == peer)
         {
-            EraseOrphanTx(maybeErase->second.tx.GetHash());
+            EraseOrphanTx(maybeErase->second.tx->GetHash());
             ++nErased;
         }
     }
@@ -650,10 +687,32 @@ void EraseOrphansFor(NodeId peer)
 }
 
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxOrphansSize) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
+    static int64_t nNextSweep;
+    int64_t nNow = GetTime();
+    if (nNextSweep <= nNow) {
+        // Sweep out expired orphan pool entries:
+        int nErased = 0;
+        int64_t nMinExpTime = nNow + ORPHAN_TX_EXPIRE_TIME - ORPHAN_TX_EXPIRE_INTERVAL;
+        map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
+        while (iter != mapOrphanTransactions.end())
+        {
+            map<uint256, COrphanTx>::iterator maybeErase = iter++;
+            if (maybeErase->second.nTimeExpire <= nNow) {
+                EraseOrphanTx(maybeErase->first);
+                ++nErased;
+            } else {
+                nMinExpTime = std::min(maybeErase->second.nTimeExpire, nMinExpTime);
+            }
+        }
+        // Sweep again 5 minutes after the next entry that expires in order to batch the linear scan.
+        nNextSweep = nMinExpTime + ORPHAN_TX_EXPIRE_INTERVAL;
+        if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx due to expiration\n", nErased);
+        nEvicted += nErased;
+    }
+    while (mapOrphanTransactions.size() > nMaxOrphans || nOrphanTransactionsSize > nMaxOrphansSize)
     {
         // Evict a random orphan:
         uint256 randomhash = GetRandHash();
@@ -666,7 +725,71 @@ unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRE
     return nEvicted;
 }
 
+/** Queue the orphans spending the outputs of a transaction just added to the mempool. */
+void static QueueOrphansOf(const CTransaction& tx) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+        map<COutPoint, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(COutPoint(tx.GetHash(), i));
+        if (itByPrev == mapOrphanTransactionsByPrev.end())
+            continue;
+        BOOST_FOREACH(const uint256& orphanHash, itByPrev->second)
+            vOrphanWorkQueue.push_back(orphanHash);
+    }
+}
 
+/**
+ * Reconsider up to nMax queued orphans. This runs from the message handler
+ * in small batches, rather than all at once when the parent arrives, so
+ * that a burst of parents (or a long chain of orphans) does not hold up
+ * message processing for every other peer.
+ */
+void static ProcessOrphanWorkQueue(unsigned int nMax) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    unsigned int nDone = 0;
+    while (!vOrphanWorkQueue.empty() && nDone < nMax)
+    {
+        const uint256 orphanHash = vOrphanWorkQueue.front();
+        vOrphanWorkQueue.pop_front();
+        map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(orphanHash);
+        // Already resolved through another of its parents, or evicted
+        if (it == mapOrphanTransactions.end())
+            continue;
+        nDone++;
+
+        CTransactionRef porphanTx = it->second.tx;
+        NodeId fromPeer = it->second.fromPeer;
+        bool fMissingInputs = false;
+        // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+        // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+        // anyone relaying LegitTxX banned)
+        CValidationState stateDummy;
+
+        if (AcceptToMemoryPool(mempool, stateDummy, porphanTx, true, &fMissingInputs))
+        {
+            LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+            RelayTransaction(porphanTx);
+            QueueOrphansOf(*porphanTx);
+            EraseOrphanTx(orphanHash);
+        }
+        else if (!fMissingInputs)
+        {
+            int nDos = 0;
+            if (stateDummy.IsInvalid(nDos) && nDos > 0)
+            {
+                // Punish peer that gave us an invalid orphan tx
+                Misbehaving(fromPeer, nDos);
+                LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+            }
+            // Has inputs but not accepted to mempool
+            // Probably non-standard or insufficient fee/priority
+            LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+            EraseOrphanTx(orphanHash);
+            assert(recentRejects);
+            recentRejects->insert(orphanHash);
+        }
+        mempool.check(pcoinsTip);
+    }
+}
 
 
 
@@ -843,7 +966,7 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& in
 }
 
 bool CheckTransaction(const CTransaction& tx, CValidationState &state,
-                      libzcash::ProofVerifier& verifier)
+                      libzcash::ProofVerifier& verifier, bool cacheStore)
 {
     // Don't count coinbase transactions because mining skews the count
     if (!tx.IsCoinBase()) {
@@ -855,10 +978,18 @@ bool CheckTransaction(const CTransaction& tx, CValidationState &state,
     } else {
         // Ensure that zk-SNARKs verify
         BOOST_FOREACH(const JSDescription &joinsplit, tx.vjoinsplit) {
+            uint256 cacheKey;
+            if (cacheStore) {
+                cacheKey = GetProofCacheKey(joinsplit, tx.joinSplitPubKey);
+                if (IsProofCached(cacheKey))
+                    continue;
+            }
             if (!joinsplit.Verify(*pzcashParams, verifier, tx.joinSplitPubKey)) {
                 return state.DoS(100, error("CheckTransaction(): joinsplit does not verify"),
                                     REJECT_INVALID, "bad-txns-joinsplit-verification-failed");
             }
+            if (cacheStore)
+                AddProofToCache(cacheKey);
         }
         return true;
     }
@@ -1069,10 +1200,31 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectAbsurdFee)
+void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age)
+{
+    int expired = pool.Expire(GetTime() - age);
+    if (expired != 0)
+        LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
+
+    pool.TrimToSize(limit);
+}
+
+static unsigned int GetBlockScriptFlags(int nHeight)
+{
+    unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
+    if(isForkEnabled(nHeight)) {
+        flags |= SCRIPT_VERIFY_FORKID;
+        flags |= SCRIPT_VERIFY_WITNESS;
+    }
+
+    return flags;
+}
+
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransactionRef &ptx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectAbsurdFee, bool fOverrideMempoolLimit)
 {
     AssertLockHeld(cs_main);
+    const CTransaction& tx = *ptx;
     if (pfMissingInputs)
         *pfMissingInputs = false;
 
@@ -1088,7 +1240,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     }
 
     auto verifier = libzcash::ProofVerifier::Strict();
-    if (!CheckTransaction(tx, state, verifier))
+    if (!CheckTransaction(tx, state, verifier, true))
         return error("AcceptToMemoryPool: CheckTransaction failed");
 
     // Coinbase is only valid in a block, not as a loose transaction
@@ -1201,7 +1353,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         CAmount nFees = nValueIn-nValueOut;
         double dPriority = view.GetPriority(tx, chainActive.Height());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), mempool.HasNoInputsOf(tx));
+        CTxMemPoolEntry entry(ptx, nFees, nAcceptTime, dPriority, chainActive.Height(), mempool.HasNoInputsOf(tx), nSigOps);
         unsigned int nSize = entry.GetTxSize();
 
         // Accept a tx if it contains joinsplits and has at least the default fee specified by z_sendmany.
@@ -1216,6 +1368,14 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                                 REJECT_INSUFFICIENTFEE, "insufficient fee");
         }
 
+        // Don't accept it if the mempool is full and it pays less than what was evicted to make room
+        CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+        if (mempoolRejectFee > 0 && nFees < mempoolRejectFee) {
+            return state.DoS(0, error("AcceptToMemoryPool: mempool min fee not met %s, %d < %d",
+                                    hash.ToString(), nFees, mempoolRejectFee),
+                            REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+        }
+
         // Require that free transactions have sufficient priority to be mined in the next block.
         if (GetBoolArg("-relaypriority", false) && nFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(view.GetPriority(tx, chainActive.Height() + 1))) {
             return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
@@ -1250,6 +1410,18 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                          hash.ToString(),
                          nFees, ::minRelayTxFee.GetFee(nSize) * 10000);
 
+        // Calculate in-mempool ancestors, up to a limit. Long chains make
+        // every addition and removal walk the whole package.
+        CTxMemPool::setEntries setAncestors;
+        size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+        size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000;
+        size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+        size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000;
+        std::string errString;
+        if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
+            return state.DoS(0, error("AcceptToMemoryPool: %s", errString), REJECT_NONSTANDARD, "too-long-mempool-chain");
+        }
+
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
         if (!ContextualCheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true, Params().GetConsensus()))
@@ -1271,8 +1443,27 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
             return error("AcceptToMemoryPool: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
         }
 
+        // Remember that the scripts pass under the flags the next block will
+        // be checked with, so that ConnectBlock can skip them. These differ
+        // from the mandatory flags, so the scripts are run once more; their
+        // signatures come out of the signature cache.
+        unsigned int nBlockFlags = GetBlockScriptFlags(chainActive.Height() + 1);
+        CValidationState stateBlockFlags;
+        if (nBlockFlags == MANDATORY_SCRIPT_VERIFY_FLAGS ||
+            ContextualCheckInputs(tx, stateBlockFlags, view, true, nBlockFlags, true, Params().GetConsensus()))
+        {
+            AddScriptExecutionToCache(tx, nBlockFlags);
+        }
+
         // Store transaction in memory
         pool.addUnchecked(hash, entry, !IsInitialBlockDownload());
+
+        // trim mempool and check if tx was trimmed
+        if (!fOverrideMempoolLimit) {
+            LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+            if (!pool.exists(hash))
+                return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
+        }
     }
 
     SyncWithWallets(tx, NULL);
@@ -1280,6 +1471,18 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     return true;
 }
 
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransactionRef &ptx, bool fLimitFree,
+                        bool* pfMissingInputs, bool fRejectAbsurdFee, bool fOverrideMempoolLimit)
+{
+    return AcceptToMemoryPoolWithTime(pool, state, ptx, fLimitFree, pfMissingInputs, GetTime(), fRejectAbsurdFee, fOverrideMempoolLimit);
+}
+
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                        bool* pfMissingInputs, bool fRejectAbsurdFee, bool fOverrideMempoolLimit)
+{
+    return AcceptToMemoryPool(pool, state, MakeTransactionRef(tx), fLimitFree, pfMissingInputs, fRejectAbsurdFee, fOverrideMempoolLimit);
+}
+
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1328,7 +1531,8 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
     if (pindexSlow) {
         CBlock block;
         if (ReadBlockFromDisk(block, pindexSlow)) {
-            BOOST_FOREACH(const CTransaction &tx, block.vtx) {
+            BOOST_FOREACH(const CTransactionRef& ptx, block.vtx) {
+                const CTransaction& tx = *ptx;
                 if (tx.GetHash() == hash) {
                     txOut = tx;
                     hashBlock = pindexSlow->GetBlockHash();
@@ -1416,6 +1620,44 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
     return true;
 }
 
+bool ReadRawBlockFromDisk(CSerializeData& vBlock, const CBlockIndex* pindex, size_t nOffset)
+{
+    const CDiskBlockPos pos = pindex->GetBlockPos();
+    if (pos.nPos < 8)
+        return error("%s: Invalid block position %s", __func__, pos.ToString());
+
+    // Open history file at the index header written before the block
+    CAutoFile filein(OpenBlockFile(CDiskBlockPos(pos.nFile, pos.nPos - 8), true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s: OpenBlockFile failed for %s", __func__, pos.ToString());
+
+    try {
+        CMessageHeader::MessageStartChars messageStart;
+        unsigned int nSize;
+        filein >> FLATDATA(messageStart) >> nSize;
+        if (memcmp(messageStart, Params().MessageStart(), MESSAGE_START_SIZE) != 0)
+            return error("%s: Block magic mismatch at %s", __func__, pos.ToString());
+        if (nSize < CBlockHeader::HEADER_SIZE || nSize > MAX_BLOCK_SIZE)
+            return error("%s: Invalid block size %u at %s", __func__, nSize, pos.ToString());
+        vBlock.resize(nOffset + nSize);
+        filein.read(&vBlock[nOffset], nSize);
+
+        // The header is a prefix of the serialized block: make sure it is
+        // the one the index expects.
+        const char* pbegin = &vBlock[nOffset];
+        CDataStream ssSolution(pbegin + CBlockHeader::HEADER_SIZE, pbegin + std::min(nSize, (unsigned int)CBlockHeader::HEADER_SIZE + 9), SER_DISK, CLIENT_VERSION);
+        uint64_t nSolutionSize = ReadCompactSize(ssSolution);
+        uint64_t nHeaderSize = CBlockHeader::HEADER_SIZE + GetSizeOfCompactSize(nSolutionSize) + nSolutionSize;
+        if (nHeaderSize > nSize || Hash(pbegin, pbegin + nHeaderSize) != pindex->GetBlockHash())
+            return error("%s: Block header doesn't match index for %s at %s", __func__, pindex->ToString(), pos.ToString());
+    }
+    catch (const std::exception& e) {
+        return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
+    }
+
+    return true;
+}
+
 CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams)
 {
     CAmount nSubsidy = 12.5 * COIN;
@@ -1658,6 +1900,46 @@ bool CScriptCheck::operator()() {
     return true;
 }
 
+bool CProofCheck::operator()() {
+    auto verifier = libzcash::ProofVerifier::Batch();
+    // Indexes into vJoinSplits of the proofs added to the batch; proofs
+    // already verified when their transaction entered the mempool are skipped.
+    std::vector<unsigned int> vBatched;
+    vBatched.reserve(vJoinSplits.size());
+    for (unsigned int i = 0; i < vJoinSplits.size(); i++) {
+        const CTransaction& tx = *vJoinSplits[i].first;
+        const JSDescription& joinsplit = tx.vjoinsplit[vJoinSplits[i].second];
+        if (IsProofCached(GetProofCacheKey(joinsplit, tx.joinSplitPubKey)))
+            continue;
+        if (!joinsplit.Verify(*pzcashParams, verifier, tx.joinSplitPubKey)) {
+            return ::error("CProofCheck(): %s:%d joinsplit does not verify", tx.GetHash().ToString(), vJoinSplits[i].second);
+        }
+        vBatched.push_back(i);
+    }
+    size_t nFailed = 0;
+    if (!verifier.VerifyBatch(&nFailed)) {
+        const std::pair<const CTransaction*, unsigned int>& failed = vJoinSplits[vBatched[nFailed]];
+        return ::error("CProofCheck(): %s:%d joinsplit does not verify", failed.first->GetHash().ToString(), failed.second);
+    }
+    if (cacheStore) {
+        BOOST_FOREACH(unsigned int i, vBatched) {
+            const CTransaction& tx = *vJoinSplits[i].first;
+            AddProofToCache(GetProofCacheKey(tx.vjoinsplit[vJoinSplits[i].second], tx.joinSplitPubKey));
+        }
+    }
+    return true;
+}
+
+bool CJoinSplitSigCheck::operator()() {
+    BOOST_FOREACH(const CTransaction* ptx, vTx) {
+        CValidationState state;
+        if (!CheckJoinSplitSigs(*ptx, state, nFlags)) {
+            return ::error("CJoinSplitSigCheck(): %s invalid joinsplit signature", ptx->GetHash().ToString());
+        }
+    }
+    return true;
+}
+
 int GetSpendHeight(const CCoinsViewCache& inputs)
 {
     LOCK(cs_main);
@@ -1797,7 +2079,8 @@ bool ContextualCheckInputs(const CTransaction& tx, CValidationState &state, cons
                 }
             }
 
-            if(!CheckJoinSplitSigs(tx, state, flags))
+            // When the script checks are deferred, so is the joinSplitSig
+            if (!pvChecks && !CheckJoinSplitSigs(tx, state, flags))
                 return false;
         }
     }
@@ -1805,6 +2088,52 @@ bool ContextualCheckInputs(const CTransaction& tx, CValidationState &state, cons
     return true;
 }
 
+void InitScriptExecutionCache()
+{
+    LOCK(cs_main);
+    GetRandBytes(scriptExecutionCacheNonce.begin(), 32);
+    // -maxsigcachesize bounds the signature and script execution caches
+    // together; the other half goes to the signature cache.
+    size_t nMaxCacheSize = std::min(std::max((int64_t)0, GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE) / 2), MAX_MAX_SIG_CACHE_SIZE) * ((size_t) 1 << 20);
+    nScriptExecutionCacheElems = scriptExecutionCache.setup_bytes(nMaxCacheSize);
+    LogPrintf("Using %zu MiB out of %zu requested for script execution cache, able to store %zu elements\n",
+            (nScriptExecutionCacheElems*sizeof(uint256)) >>20, nMaxCacheSize>>20, (size_t)nScriptExecutionCacheElems);
+}
+
+static uint256 GetScriptExecutionCacheEntry(const CTransaction& tx, unsigned int flags)
+{
+    uint256 entry;
+    CSHA256().Write(scriptExecutionCacheNonce.begin(), 32).Write(tx.GetHash().begin(), 32).Write((const unsigned char*)&flags, sizeof(flags)).Finalize(entry.begin());
+    return entry;
+}
+
+bool IsScriptExecutionCached(const CTransaction& tx, unsigned int flags, bool erase)
+{
+    AssertLockHeld(cs_main);
+    if (nScriptExecutionCacheElems == 0)
+        return false;
+    if (scriptExecutionCache.contains(GetScriptExecutionCacheEntry(tx, flags), erase)) {
+        nScriptExecutionCacheHits++;
+        return true;
+    }
+    nScriptExecutionCacheMisses++;
+    return false;
+}
+
+void AddScriptExecutionToCache(const CTransaction& tx, unsigned int flags)
+{
+    AssertLockHeld(cs_main);
+    if (nScriptExecutionCacheElems == 0)
+        return;
+    scriptExecutionCache.insert(GetScriptExecutionCacheEntry(tx, flags));
+}
+
+void GetScriptExecutionCacheStats(uint64_t& nHits, uint64_t& nMisses)
+{
+    nHits = nScriptExecutionCacheHits;
+    nMisses = nScriptExecutionCacheMisses;
+}
+
 namespace {
 
 bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint256& hashBlock, const CMessageHeader::MessageStartChars& messageStart)
@@ -1935,7 +2264,7 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
 
     // undo transactions in reverse order
     for (int i = block.vtx.size() - 1; i >= 0; i--) {
-        const CTransaction &tx = block.vtx[i];
+        const CTransaction &tx = *block.vtx[i];
         uint256 hash = tx.GetHash();
 
         int nNonCBIdx = 0;
@@ -2026,7 +2355,7 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+static CCheckQueue<CBlockCheck> scriptcheckqueue(128);
 
 void ThreadScriptCheck() {
     RenameThread("zcash-scriptch");
@@ -2147,18 +2476,6 @@ static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
 
 
-static unsigned int GetBlockScriptFlags(const CBlockIndex* pindex) {
-    AssertLockHeld(cs_main);
-
-    unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
-    if(isForkEnabled(pindex->nHeight)) {
-        flags |= SCRIPT_VERIFY_FORKID;
-        flags |= SCRIPT_VERIFY_WITNESS;
-    }
-
-    return flags;
-};
-
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck)
 {
     const CChainParams& chainparams = Params();
@@ -2173,11 +2490,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         }
     }
 
-    auto verifier = libzcash::ProofVerifier::Strict();
+    // JoinSplit proofs are verified below, alongside the script checks
     auto disabledVerifier = libzcash::ProofVerifier::Disabled();
 
-    // Check it again to verify JoinSplit proofs, and in case a previous version let a bad block in
-    if (!CheckBlock(block, state, fExpensiveChecks ? verifier : disabledVerifier, !fJustCheck, !fJustCheck))
+    // Check it again in case a previous version let a bad block in
+    if (!CheckBlock(block, state, disabledVerifier, !fJustCheck, !fJustCheck))
         return false;
 
     // verify that the view's current state corresponds to the previous block
@@ -2198,11 +2515,12 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         return true;
     }
 
-    unsigned int flags = GetBlockScriptFlags(pindex);
+    unsigned int flags = GetBlockScriptFlags(pindex->nHeight);
 
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
     // unless those are already completely spent.
-    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+    BOOST_FOREACH(const CTransactionRef& ptx, block.vtx) {
+        const CTransaction& tx = *ptx;
         const CCoins* coins = view.AccessCoins(tx.GetHash());
         if (coins && !coins->IsPruned())
             return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
@@ -2213,9 +2531,55 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     CBlockUndo blockundo;
 
-    CCheckQueueControl<CScriptCheck> control(fExpensiveChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
+    CCheckQueueControl<CBlockCheck> control(fExpensiveChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
 
     int64_t nTimeStart = GetTimeMicros();
+
+    // Queue the JoinSplit proof checks first, so the workers can start on
+    // them while the inputs are being connected below. The proofs are
+    // split into one batch per worker, and each batch is verified with a
+    // single combined pairing check.
+    if (fExpensiveChecks) {
+        size_t nJoinSplits = 0;
+        BOOST_FOREACH(const CTransactionRef& ptx, block.vtx)
+            nJoinSplits += ptx->vjoinsplit.size();
+        size_t nPerBatch = std::max<size_t>(1, nScriptCheckThreads ? (nJoinSplits + nScriptCheckThreads - 1) / nScriptCheckThreads : nJoinSplits);
+
+        std::vector<CProofCheck> vProofChecks(1);
+        BOOST_FOREACH(const CTransactionRef& ptx, block.vtx) {
+            const CTransaction& tx = *ptx;
+            for (unsigned int i = 0; i < tx.vjoinsplit.size(); i++) {
+                if (vProofChecks.back().size() >= nPerBatch)
+                    vProofChecks.push_back(CProofCheck());
+                vProofChecks.back().Add(tx, i);
+            }
+        }
+
+        std::vector<CBlockCheck> vChecks;
+        vChecks.reserve(vProofChecks.size());
+        BOOST_FOREACH(CProofCheck& check, vProofChecks) {
+            if (check.size() == 0)
+                continue;
+            if (nScriptCheckThreads) {
+                vChecks.push_back(CBlockCheck());
+                vChecks.back().swap(check);
+            } else if (!check()) {
+                return state.DoS(100, error("ConnectBlock(): joinsplit does not verify"),
+                                 REJECT_INVALID, "bad-txns-joinsplit-verification-failed");
+            }
+        }
+        control.Add(vChecks);
+    }
+
+    // The joinSplitSigs of shielded transactions are verified on the
+    // workers in batches, one batch per worker.
+    size_t nShieldedTxs = 0;
+    BOOST_FOREACH(const CTransactionRef& ptx, block.vtx)
+        if (!ptx->vjoinsplit.empty())
+            nShieldedTxs++;
+    size_t nJoinSplitSigsPerBatch = std::max<size_t>(1, nScriptCheckThreads ? (nShieldedTxs + nScriptCheckThreads - 1) / nScriptCheckThreads : nShieldedTxs);
+    std::vector<CJoinSplitSigCheck> vJoinSplitSigChecks(1, CJoinSplitSigCheck(flags));
+
     CAmount nFees = 0;
     int nInputs = 0;
     unsigned int nSigOps = 0;
@@ -2245,7 +2609,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
-        const CTransaction &tx = block.vtx[i];
+        const CTransaction &tx = *block.vtx[i];
 
         nInputs += tx.vin.size();
         nSigOps += GetLegacySigOpCount(tx);
@@ -2274,10 +2638,24 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
             nFees += view.GetValueIn(tx)-tx.GetValueOut();
 
-            std::vector<CScriptCheck> vChecks;
-            if (!ContextualCheckInputs(tx, state, view, fExpensiveChecks, flags, false, chainparams.GetConsensus(), nScriptCheckThreads ? &vChecks : NULL))
+            // Transactions accepted to the mempool under these flags have
+            // had their scripts and joinSplitSig checked already. The entry
+            // is no longer needed once the block is connected.
+            bool fScriptChecks = fExpensiveChecks && !IsScriptExecutionCached(tx, flags, !fJustCheck);
+
+            std::vector<CScriptCheck> vScriptChecks;
+            if (!ContextualCheckInputs(tx, state, view, fScriptChecks, flags, false, chainparams.GetConsensus(), nScriptCheckThreads ? &vScriptChecks : NULL))
                 return false;
+            std::vector<CBlockCheck> vChecks(vScriptChecks.size());
+            for (unsigned int j = 0; j < vScriptChecks.size(); j++)
+                vChecks[j].swap(vScriptChecks[j]);
             control.Add(vChecks);
+
+            if (fScriptChecks && nScriptCheckThreads && !tx.vjoinsplit.empty()) {
+                if (vJoinSplitSigChecks.back().size() >= nJoinSplitSigsPerBatch)
+                    vJoinSplitSigChecks.push_back(CJoinSplitSigCheck(flags));
+                vJoinSplitSigChecks.back().Add(tx);
+            }
         }
 
         CTxUndo undoDummy;
@@ -2298,6 +2676,17 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
 
+    {
+        std::vector<CBlockCheck> vChecks;
+        BOOST_FOREACH(CJoinSplitSigCheck& check, vJoinSplitSigChecks) {
+            if (check.size() == 0)
+                continue;
+            vChecks.push_back(CBlockCheck());
+            vChecks.back().swap(check);
+        }
+        control.Add(vChecks);
+    }
+
     if(pindex->nHeight == chainparams.GetConsensus().zResetHeight) {
         tree = ZCIncrementalMerkleTree();
         tree.append(tree.root());
@@ -2316,10 +2705,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     if (!isForkBlock(pindex->nHeight)){  //when block is in forking region - don't check coinbase amount
 #endif
     CAmount blockReward = nFees + GetBlockSubsidy(pindex->nHeight, chainparams.GetConsensus());
-    if (block.vtx[0].GetValueOut() > blockReward)
+    if (block.vtx[0]->GetValueOut() > blockReward)
         return state.DoS(100,
                          error("ConnectBlock(): coinbase pays too much (actual=%d vs limit=%d)",
-                               block.vtx[0].GetValueOut(), blockReward),
+                               block.vtx[0]->GetValueOut(), blockReward),
                                REJECT_INVALID, "bad-cb-amount");
 #ifdef FORK_CB_INPUT
     }
@@ -2365,7 +2754,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     // Watch for changes to the previous coinbase transaction.
     static uint256 hashPrevBestCoinBase;
     GetMainSignals().UpdatedTransaction(hashPrevBestCoinBase);
-    hashPrevBestCoinBase = block.vtx[0].GetHash();
+    hashPrevBestCoinBase = block.vtx[0]->GetHash();
 
     int64_t nTime4 = GetTimeMicros(); nTimeCallbacks += nTime4 - nTime3;
     LogPrint("bench", "    - Callbacks: %.2fms [%.2fs]\n", 0.001 * (nTime4 - nTime3), nTimeCallbacks * 0.000001);
@@ -2394,6 +2783,8 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
     std::set<int> setFilesToPrune;
     bool fFlushForPrune = false;
     try {
+    if (pcoinsWriteBehind && pcoinsWriteBehind->HasFailed())
+        return AbortNode(state, "Failed to write to coin database");
     if (fPruneMode && fCheckForPruning && !fReindex) {
         FindFilesToPrune(setFilesToPrune);
         fCheckForPruning = false;
@@ -2416,7 +2807,8 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
     if (nLastSetChain == 0) {
         nLastSetChain = nNow;
     }
-    size_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+    // The pool the cache allocates from holds whole chunks, free space included.
+    size_t cacheSize = pcoinsTip->DynamicMemoryUsage() + memusage::PoolFreeUsage();
     // The cache is large and close to the limit, but we have time now (not in the middle of a block processing).
     bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize * (10.0/9) > nCoinCacheUsage;
     // The cache is over the limit, we have to write now.
@@ -2467,9 +2859,30 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
         if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
         // Flush the chainstate (which may refer to block index entries).
-        if (!pcoinsTip->Flush())
+        const size_t nLowWater = nCoinCacheUsage / 100 * nCoinCacheLowWater;
+        bool fWritten = true;
+        if (mode == FLUSH_STATE_IF_NEEDED && !fFlushForPrune) {
+            // The cache is over the limit while blocks are being connected:
+            // evict its least recently used entries down to the low-water
+            // mark, writing it out first once its modifications alone are
+            // past that mark.
+            if (!pcoinsTip->Trim(nLowWater, &fWritten))
+                return AbortNode(state, "Failed to write to coin database");
+        } else {
+            // Shutdown, pruning and periodic flushes need the chainstate on
+            // disk: write it out, keeping it warm, and trim it if it is
+            // close to full.
+            if (!pcoinsTip->WriteBack())
+                return AbortNode(state, "Failed to write to coin database");
+            if (fCacheLarge && !pcoinsTip->Trim(nLowWater))
+                return AbortNode(state, "Failed to write to coin database");
+        }
+        // With -writebehind the chainstate is written in the background.
+        // Wait for it when it has to be on disk when we return.
+        if (pcoinsWriteBehind && (mode == FLUSH_STATE_ALWAYS || fFlushForPrune) && !pcoinsWriteBehind->Sync())
             return AbortNode(state, "Failed to write to coin database");
-        nLastFlush = nNow;
+        if (fWritten)
+            nLastFlush = nNow;
     }
     if ((mode == FLUSH_STATE_ALWAYS || mode == FLUSH_STATE_PERIODIC) && nNow > nLastSetChain + (int64_t)DATABASE_WRITE_INTERVAL * 1000000) {
         // Update best block in wallet (so we can detect restored wallets).
@@ -2576,11 +2989,12 @@ bool static DisconnectTip(CValidationState &state) {
     if (!FlushStateToDisk(state, FLUSH_STATE_IF_NEEDED))
         return false;
     // Resurrect mempool transactions from the disconnected block.
-    BOOST_FOREACH(const CTransaction &tx, block.vtx) {
+    BOOST_FOREACH(const CTransactionRef& ptx, block.vtx) {
+        const CTransaction& tx = *ptx;
         // ignore validation errors in resurrected transactions
         list<CTransaction> removed;
         CValidationState stateDummy;
-        if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
+        if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, ptx, false, NULL, false, true))
             mempool.remove(tx, removed, true);
     }
     if (anchorBeforeDisconnect != anchorAfterDisconnect) {
@@ -2592,12 +3006,15 @@ bool static DisconnectTip(CValidationState &state) {
     mempool.check(pcoinsTip);
     // Update chainActive and related variables.
     UpdateTip(pindexDelete->pprev);
+    // Cached header batches may run through the block just disconnected
+    ClearCachedMessages(BLOCK_CACHE_HEADERS);
     // Get the current commitment tree
     ZCIncrementalMerkleTree newTree;
     assert(pcoinsTip->GetAnchorAt(pcoinsTip->GetBestAnchor(), newTree, pindexDelete->nHeight - 1 >= Params().GetConsensus().zResetHeight));
     // Let wallets know transactions went from 1-confirmed to
     // 0-confirmed or conflicted:
-    BOOST_FOREACH(const CTransaction &tx, block.vtx) {
+    BOOST_FOREACH(const CTransactionRef& ptx, block.vtx) {
+        const CTransaction& tx = *ptx;
         SyncWithWallets(tx, NULL);
     }
     // Update cached incremental witnesses
@@ -2660,6 +3077,11 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
     mempool.check(pcoinsTip);
     // Update chainActive & related variables.
     UpdateTip(pindexNew);
+    // Cached header batches that ended at the old tip are now short, and
+    // peers are about to ask for the new tip
+    ClearCachedMessages(BLOCK_CACHE_HEADERS);
+    if (IsBlockCacheEnabled() && !IsInitialBlockDownload())
+        AddMessageToCache(BLOCK_CACHE_BLOCK, pindexNew->GetBlockHash(), MakeSerializedMessage("block", *pblock));
 
     // Tell wallet about transactions that went from mempool
     // to conflicted:
@@ -2667,7 +3089,8 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
         SyncWithWallets(tx, NULL);
     }
     // ... and about transactions that got confirmed:
-    BOOST_FOREACH(const CTransaction &tx, pblock->vtx) {
+    BOOST_FOREACH(const CTransactionRef& ptx, pblock->vtx) {
+        const CTransaction& tx = *ptx;
         SyncWithWallets(tx, pblock);
     }
     // Update cached incremental witnesses
@@ -2762,9 +3185,11 @@ static bool ActivateBestChainStep(CValidationState &state, CBlockIndex *pindexMo
     const CBlockIndex *pindexFork = chainActive.FindFork(pindexMostWork);
 
     // Disconnect active blocks which are no longer in the best chain.
+    bool fBlocksDisconnected = false;
     while (chainActive.Tip() && chainActive.Tip() != pindexFork) {
         if (!DisconnectTip(state))
             return false;
+        fBlocksDisconnected = true;
     }
 
     // Build list of new blocks to connect.
@@ -2784,6 +3209,18 @@ static bool ActivateBestChainStep(CValidationState &state, CBlockIndex *pindexMo
     }
     nHeight = nTargetHeight;
 
+    // Have the blocks after the one connected first read their inputs
+    // into the prefetch layer while we work on it.
+    if (pcoinsPrefetch) {
+        std::vector<CPrefetchBlock> vPrefetch;
+        BOOST_REVERSE_FOREACH(CBlockIndex *pindexPrefetch, vpindexToConnect) {
+            if (!(pindexPrefetch->nStatus & BLOCK_HAVE_DATA))
+                break;
+            vPrefetch.push_back(CPrefetchBlock(pindexPrefetch->GetBlockHash(), pindexPrefetch->nHeight, pindexPrefetch->GetBlockPos()));
+        }
+        pcoinsPrefetch->Enqueue(vPrefetch, chainActive.Height() + 1);
+    }
+
     // Connect new blocks.
     BOOST_REVERSE_FOREACH(CBlockIndex *pindexConnect, vpindexToConnect) {
         if (!ConnectTip(state, pindexConnect, pindexConnect == pindexMostWork ? pblock : NULL)) {
@@ -2810,6 +3247,11 @@ static bool ActivateBestChainStep(CValidationState &state, CBlockIndex *pindexMo
     }
     }
 
+    // Transactions resurrected from disconnected blocks bypassed the size
+    // limit; trim the pool back down now that the reorg is done.
+    if (fBlocksDisconnected)
+        LimitMempoolSize(mempool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+
     // Callbacks/notifications for a new best chain.
     if (fInvalidFound)
         CheckForkWarningConditionsOnNewFork(vpindexToConnect.back());
@@ -3172,7 +3614,7 @@ bool CheckBlock(const CBlock& block, CValidationState& state,
     // Check the merkle root.
     if (fCheckMerkleRoot) {
         bool mutated;
-        uint256 hashMerkleRoot2 = block.BuildMerkleTree(&mutated);
+        uint256 hashMerkleRoot2 = block.ComputeMerkleRoot(&mutated);
         if (block.hashMerkleRoot != hashMerkleRoot2)
             return state.DoS(100, error("CheckBlock(): hashMerkleRoot mismatch"),
                              REJECT_INVALID, "bad-txnmrklroot", true);
@@ -3195,7 +3637,7 @@ bool CheckBlock(const CBlock& block, CValidationState& state,
                          REJECT_INVALID, "bad-blk-length");
 
     // First transaction must be coinbase, the rest must not be
-    if (block.vtx.empty() || !block.vtx[0].IsCoinBase())
+    if (block.vtx.empty() || !block.vtx[0]->IsCoinBase())
         return state.DoS(100, error("CheckBlock(): first tx is not coinbase"),
                          REJECT_INVALID, "bad-cb-missing");
 
@@ -3206,25 +3648,25 @@ bool CheckBlock(const CBlock& block, CValidationState& state,
                              REJECT_INVALID, "bad-fork-too-many-tx");
 
         for (unsigned int i = 1; i < block.vtx.size(); i++)
-            if (!block.vtx[i].IsCoinBase())
+            if (!block.vtx[i]->IsCoinBase())
                 return state.DoS(100, error("CheckBlock(): fork block: non-coinbase found"),
                                  REJECT_INVALID, "bad-fork-non-cb");
     } else {
         for (unsigned int i = 1; i < block.vtx.size(); i++)
-            if (block.vtx[i].IsCoinBase())
+            if (block.vtx[i]->IsCoinBase())
                 return state.DoS(100, error("CheckBlock(): more than one coinbase"),
                                 REJECT_INVALID, "bad-cb-multiple");
     }
 
     // Check transactions
-    BOOST_FOREACH(const CTransaction& tx, block.vtx)
-        if (!CheckTransaction(tx, state, verifier))
+    BOOST_FOREACH(const CTransactionRef& ptx, block.vtx)
+        if (!CheckTransaction(*ptx, state, verifier))
             return error("CheckBlock(): CheckTransaction failed");
 
     unsigned int nSigOps = 0;
-    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    BOOST_FOREACH(const CTransactionRef& ptx, block.vtx)
     {
-        nSigOps += GetLegacySigOpCount(tx);
+        nSigOps += GetLegacySigOpCount(*ptx);
     }
     if (nSigOps > MAX_BLOCK_SIGOPS)
         return state.DoS(100, error("CheckBlock(): out-of-bounds SigOpCount"),
@@ -3294,7 +3736,8 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     const Consensus::Params& consensusParams = Params().GetConsensus();
 
     // Check that all transactions are finalized
-    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+    BOOST_FOREACH(const CTransactionRef& ptx, block.vtx) {
+        const CTransaction& tx = *ptx;
         int nLockTimeFlags = 0;
         int64_t nLockTimeCutoff = (nLockTimeFlags & LOCKTIME_MEDIAN_TIME_PAST)
                                 ? pindexPrev->GetMedianTimePast()
@@ -3311,8 +3754,8 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     if (nHeight > 0)
     {
         CScript expect = CScript() << nHeight;
-        if (block.vtx[0].vin[0].scriptSig.size() < expect.size() ||
-            !std::equal(expect.begin(), expect.end(), block.vtx[0].vin[0].scriptSig.begin())) {
+        if (block.vtx[0]->vin[0].scriptSig.size() < expect.size() ||
+            !std::equal(expect.begin(), expect.end(), block.vtx[0]->vin[0].scriptSig.begin())) {
             return state.DoS(100, error("%s: block height mismatch in coinbase", __func__), REJECT_INVALID, "bad-cb-height");
         }
     }
@@ -3483,10 +3926,10 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
                 }
 
                 int txid = 0;
-                typedef boost::tuple<pair<uint64_t, CScript>&, const CTransaction&> fork_cmp_tuple;
+                typedef boost::tuple<pair<uint64_t, CScript>&, const CTransactionRef&> fork_cmp_tuple;
                 BOOST_FOREACH(fork_cmp_tuple cmp, boost::combine(txFromFile, block.vtx)) {
                     pair<uint64_t, CScript>& rec = cmp.get<0>();
-                    const CTransaction& tx = cmp.get<1>();
+                    const CTransaction& tx = *cmp.get<1>();
 
                     if (rec.first != tx.vout[0].nValue ||
                         rec.second != tx.vout[0].scriptPubKey)
@@ -4002,6 +4445,8 @@ void UnloadBlockIndex()
     mempool.clear();
     mapOrphanTransactions.clear();
     mapOrphanTransactionsByPrev.clear();
+    nOrphanTransactionsSize = 0;
+    vOrphanWorkQueue.clear();
     nSyncStarted = 0;
     mapBlocksUnlinked.clear();
     vinfoBlockFile.clear();
@@ -4185,6 +4630,226 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
     return nLoaded > 0;
 }
 
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+/** Transactions loaded back into the mempool together, see LoadMempool */
+static const unsigned int MEMPOOL_LOAD_BATCH_SIZE = 100;
+
+/**
+ * Verify the JoinSplit proofs and input scripts of a batch of transactions
+ * being loaded into the mempool on the script check threads, storing what
+ * passes in the proof and signature caches, so that AcceptToMemoryPool
+ * finds most of its work done. If everything passes, the scripts are run
+ * again under the next block's flags, now mostly hitting the signature
+ * cache, together with the joinSplitSigs, and the transactions are added
+ * to the script execution cache for ConnectBlock. AcceptToMemoryPool still
+ * gives the verdict: failures here are ignored, as are inputs that are
+ * neither in the UTXO set, the mempool nor earlier in the batch.
+ */
+static void PreverifyMempoolBatch(const std::vector<CTransactionRef>& vtx)
+{
+    // Also keeps ConnectBlock off the check queue.
+    AssertLockHeld(cs_main);
+    if (!nScriptCheckThreads)
+        return;
+
+    size_t nJoinSplits = 0;
+    BOOST_FOREACH(const CTransactionRef& ptx, vtx)
+        nJoinSplits += ptx->vjoinsplit.size();
+    size_t nPerBatch = std::max<size_t>(1, (nJoinSplits + nScriptCheckThreads - 1) / nScriptCheckThreads);
+    std::vector<CProofCheck> vProofChecks(1, CProofCheck(true));
+    unsigned int nBlockFlags = GetBlockScriptFlags(chainActive.Height() + 1);
+
+    CCoinsViewMemPool viewMemPool(pcoinsTip, mempool);
+    CCoinsViewCache view(&viewMemPool);
+    std::vector<CBlockCheck> vChecks;
+    std::vector<CBlockCheck> vBlockFlagChecks;
+    std::vector<const CTransaction*> vChecked;
+    BOOST_FOREACH(const CTransactionRef& ptx, vtx) {
+        const CTransaction& tx = *ptx;
+        for (unsigned int i = 0; i < tx.vjoinsplit.size(); i++) {
+            if (vProofChecks.back().size() >= nPerBatch)
+                vProofChecks.push_back(CProofCheck(true));
+            vProofChecks.back().Add(tx, i);
+        }
+
+        if (!view.HaveInputs(tx))
+            continue;
+        CValidationState state;
+        std::vector<CScriptCheck> vScriptChecks;
+        std::vector<CScriptCheck> vBlockFlagScriptChecks;
+        if (!ContextualCheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true, Params().GetConsensus(), &vScriptChecks) ||
+            !ContextualCheckInputs(tx, state, view, true, nBlockFlags, true, Params().GetConsensus(), &vBlockFlagScriptChecks))
+            continue;
+        size_t nChecks = vChecks.size();
+        vChecks.resize(nChecks + vScriptChecks.size());
+        for (unsigned int j = 0; j < vScriptChecks.size(); j++)
+            vChecks[nChecks + j].swap(vScriptChecks[j]);
+        nChecks = vBlockFlagChecks.size();
+        vBlockFlagChecks.resize(nChecks + vBlockFlagScriptChecks.size());
+        for (unsigned int j = 0; j < vBlockFlagScriptChecks.size(); j++)
+            vBlockFlagChecks[nChecks + j].swap(vBlockFlagScriptChecks[j]);
+        // Deferred script checks leave the joinSplitSig to the caller
+        if (!tx.vjoinsplit.empty()) {
+            CJoinSplitSigCheck check(nBlockFlags);
+            check.Add(tx);
+            vBlockFlagChecks.push_back(CBlockCheck());
+            vBlockFlagChecks.back().swap(check);
+        }
+        vChecked.push_back(&tx);
+        // Later transactions in the batch may spend its outputs
+        UpdateCoins(tx, state, view, chainActive.Height() + 1);
+    }
+    BOOST_FOREACH(CProofCheck& check, vProofChecks) {
+        if (check.size() == 0)
+            continue;
+        vChecks.push_back(CBlockCheck());
+        vChecks.back().swap(check);
+    }
+
+    {
+        CCheckQueueControl<CBlockCheck> control(&scriptcheckqueue);
+        control.Add(vChecks);
+        if (!control.Wait())
+            return;
+    }
+    CCheckQueueControl<CBlockCheck> control(&scriptcheckqueue);
+    control.Add(vBlockFlagChecks);
+    if (!control.Wait())
+        return;
+    BOOST_FOREACH(const CTransaction* ptx, vChecked)
+        AddScriptExecutionToCache(*ptx, nBlockFlags);
+}
+
+bool LoadMempool()
+{
+    boost::filesystem::path path = GetDataDir() / "mempool.dat";
+    CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        LogPrintf("Failed to open mempool file %s. Continuing anyway.\n", path.string());
+        return false;
+    }
+
+    int64_t nStart = GetTimeMicros();
+    int64_t nExpiryTimeout = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+    int64_t nNow = GetTime();
+    unsigned int nLoaded = 0, nFailed = 0, nExpired = 0;
+    try {
+        uint64_t nVersion;
+        file >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+            return error("%s: unknown mempool file version %d", __func__, nVersion);
+
+        // Prioritisation comes first, so that it counts when the
+        // transactions are accepted. Deltas add up, so one the pool
+        // already has (when loading into a running node) is not applied
+        // again.
+        std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+        file >> mapDeltas;
+        for (std::map<uint256, std::pair<double, CAmount> >::const_iterator it = mapDeltas.begin(); it != mapDeltas.end(); ++it) {
+            bool fKnown;
+            {
+                LOCK(mempool.cs);
+                fKnown = mempool.mapDeltas.count(it->first);
+            }
+            if (!fKnown)
+                mempool.PrioritiseTransaction(it->first, it->first.ToString(), it->second.first, it->second.second);
+        }
+
+        // Parents were written before their children.
+        uint64_t nCount;
+        file >> nCount;
+        std::vector<CTransactionRef> vBatch;
+        std::vector<int64_t> vTime;
+        while (nCount > 0) {
+            while (nCount > 0 && vBatch.size() < MEMPOOL_LOAD_BATCH_SIZE) {
+                CTransactionRef ptx;
+                int64_t nTime;
+                file >> ptx;
+                file >> nTime;
+                nCount--;
+                if (nTime + nExpiryTimeout > nNow) {
+                    vBatch.push_back(ptx);
+                    vTime.push_back(nTime);
+                } else {
+                    nExpired++;
+                }
+            }
+
+            {
+                LOCK(cs_main);
+                PreverifyMempoolBatch(vBatch);
+                for (unsigned int i = 0; i < vBatch.size(); i++) {
+                    CValidationState state;
+                    if (AcceptToMemoryPoolWithTime(mempool, state, vBatch[i], true, NULL, vTime[i]))
+                        nLoaded++;
+                    else
+                        nFailed++;
+                }
+            }
+            vBatch.clear();
+            vTime.clear();
+
+            if (ShutdownRequested())
+                return false;
+        }
+    } catch (const std::exception& e) {
+        return error("%s: failed to deserialize mempool data on disk: %s. Continuing anyway.", __func__, e.what());
+    }
+
+    LogPrintf("Imported mempool transactions from disk: %u successes, %u failed, %u expired (%.2fs)\n",
+              nLoaded, nFailed, nExpired, (GetTimeMicros() - nStart) * 0.000001);
+    return true;
+}
+
+bool DumpMempool()
+{
+    int64_t nStart = GetTimeMicros();
+
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    std::vector<std::pair<CTransactionRef, int64_t> > vTx;
+    {
+        LOCK(mempool.cs);
+        mapDeltas = mempool.mapDeltas;
+        std::vector<CTxMemPool::txiter> vSorted;
+        vSorted.reserve(mempool.mapTx.size());
+        for (CTxMemPool::txiter it = mempool.mapTx.begin(); it != mempool.mapTx.end(); ++it)
+            vSorted.push_back(it);
+        // Parents before their children
+        std::sort(vSorted.begin(), vSorted.end(), CompareTxIterByAncestorCount());
+        vTx.reserve(vSorted.size());
+        BOOST_FOREACH(CTxMemPool::txiter it, vSorted)
+            vTx.push_back(std::make_pair(it->GetSharedTx(), it->GetTime()));
+    }
+
+    int64_t nMid = GetTimeMicros();
+
+    try {
+        boost::filesystem::path path = GetDataDir() / "mempool.dat";
+        boost::filesystem::path pathNew = GetDataDir() / "mempool.dat.new";
+        CAutoFile file(fopen(pathNew.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        if (file.IsNull())
+            return error("%s: failed to open %s", __func__, pathNew.string());
+
+        uint64_t nVersion = MEMPOOL_DUMP_VERSION;
+        file << nVersion;
+        file << mapDeltas;
+        file << (uint64_t)vTx.size();
+        for (unsigned int i = 0; i < vTx.size(); i++) {
+            file << vTx[i].first;
+            file << vTx[i].second;
+        }
+        FileCommit(file.Get());
+        file.fclose();
+        RenameOver(pathNew, path);
+    } catch (const std::exception& e) {
+        return error("%s: failed to dump mempool: %s", __func__, e.what());
+    }
+
+    LogPrintf("Dumped %u mempool transactions: %.3fs to copy, %.3fs to dump\n",
+              vTx.size(), (nMid - nStart) * 0.000001, (GetTimeMicros() - nMid) * 0.000001);
+    return true;
+}
+
 void static CheckBlockIndex()
 {
     const Consensus::Params& consensusParams = Params().GetConsensus();
@@ -4472,6 +5137,51 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
     return true;
 }
 
+/**
+ * "block" messages still queued for at least one peer, so that peers asking
+ * for the same block share one buffer even when it isn't in the block cache.
+ */
+static std::map<uint256, std::weak_ptr<const CSerializeData> > mapBlockMessages;
+
+CSerializeDataRef GetBlockMessage(const CBlockIndex* pindex)
+{
+    AssertLockHeld(cs_main);
+    const uint256 hash = pindex->GetBlockHash();
+    CSerializeDataRef pmsg = GetCachedMessage(BLOCK_CACHE_BLOCK, hash);
+    if (pmsg) {
+        CountCacheLookup(BLOCK_CACHE_BLOCK, true);
+        return pmsg;
+    }
+
+    // A message evicted from the cache may still be queued to some peer
+    std::map<uint256, std::weak_ptr<const CSerializeData> >::iterator it = mapBlockMessages.find(hash);
+    if (it != mapBlockMessages.end()) {
+        pmsg = it->second.lock();
+        if (pmsg) {
+            CountCacheLookup(BLOCK_CACHE_BLOCK, true);
+            AddMessageToCache(BLOCK_CACHE_BLOCK, hash, pmsg);
+            return pmsg;
+        }
+    }
+
+    // Forget the messages every peer is done with
+    for (it = mapBlockMessages.begin(); it != mapBlockMessages.end(); ) {
+        if (it->second.expired())
+            mapBlockMessages.erase(it++);
+        else
+            ++it;
+    }
+
+    CountCacheLookup(BLOCK_CACHE_BLOCK, false);
+    std::shared_ptr<CSerializeData> pmsgRead = std::make_shared<CSerializeData>();
+    if (!ReadRawBlockFromDisk(*pmsgRead, pindex, CMessageHeader::HEADER_SIZE))
+        return CSerializeDataRef();
+    WriteMessageHeader(*pmsgRead, "block");
+    mapBlockMessages[hash] = pmsgRead;
+    AddMessageToCache(BLOCK_CACHE_BLOCK, hash, pmsgRead);
+    return pmsgRead;
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -4516,13 +5226,19 @@ void static ProcessGetData(CNode* pfrom)
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
                 {
                     // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
                     if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                    {
+                        // As stored, without deserializing and serializing it again
+                        CSerializeDataRef pmsg = GetBlockMessage((*mi).second);
+                        if (!pmsg)
+                            assert(!"cannot load block from disk");
+                        pfrom->PushSerializedMessage(pmsg);
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
+                        CBlock block;
+                        if (!ReadBlockFromDisk(block, (*mi).second))
+                            assert(!"cannot load block from disk");
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
                         {
@@ -4537,7 +5253,7 @@ void static ProcessGetData(CNode* pfrom)
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
                                 if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
-                                    pfrom->PushMessage("tx", block.vtx[pair.first]);
+                                    pfrom->PushMessage("tx", *block.vtx[pair.first]);
                         }
                         // else
                             // no response
@@ -4562,19 +5278,16 @@ void static ProcessGetData(CNode* pfrom)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CTransactionRef>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushMessage(inv.GetCommand(), *mi->second);
                         pushed = true;
                     }
                 }
                 if (!pushed && inv.type == MSG_TX) {
-                    CTransaction tx;
-                    if (mempool.lookup(inv.hash, tx)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << tx;
-                        pfrom->PushMessage("tx", ss);
+                    CTransactionRef ptx = mempool.get(inv.hash);
+                    if (ptx) {
+                        pfrom->PushMessage("tx", *ptx);
                         pushed = true;
                     }
                 }
@@ -4838,6 +5551,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return error("message inv size() = %u", vInv.size());
         }
 
+        BOOST_FOREACH(const CInv& inv, vInv)
+            pfrom->AddInventoryKnown(inv);
+
         LOCK(cs_main);
 
         std::vector<CInv> vToFetch;
@@ -4847,7 +5563,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             const CInv &inv = vInv[nInv];
 
             boost::this_thread::interruption_point();
-            pfrom->AddInventoryKnown(inv);
 
             bool fAlreadyHave = AlreadyHave(inv);
             LogPrint("net", "got inv: %s  %s peer=%d\n", inv.ToString(), fAlreadyHave ? "have" : "new", pfrom->id);
@@ -4978,26 +5693,34 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 pindex = chainActive.Next(pindex);
         }
 
-        // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
-        vector<CBlock> vHeaders;
-        int nLimit = MAX_HEADERS_RESULTS;
         LogPrint("net", "getheaders %d to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), pfrom->id);
-        for (; pindex; pindex = chainActive.Next(pindex))
-        {
-            vHeaders.push_back(pindex->GetBlockHeader());
-            if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
-                break;
+
+        // Peers catching up from the same point ask for the same batch
+        uint256 hashCacheKey = GetHeadersCacheKey(pindex ? pindex->GetBlockHash() : uint256(), hashStop);
+        CSerializeDataRef pmsg = GetCachedMessage(BLOCK_CACHE_HEADERS, hashCacheKey);
+        CountCacheLookup(BLOCK_CACHE_HEADERS, pmsg != nullptr);
+        if (!pmsg) {
+            // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
+            vector<CBlock> vHeaders;
+            int nLimit = MAX_HEADERS_RESULTS;
+            for (; pindex; pindex = chainActive.Next(pindex))
+            {
+                vHeaders.push_back(pindex->GetBlockHeader());
+                if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
+                    break;
+            }
+            pmsg = MakeSerializedMessage("headers", vHeaders);
+            AddMessageToCache(BLOCK_CACHE_HEADERS, hashCacheKey, pmsg);
         }
-        pfrom->PushMessage("headers", vHeaders);
+        pfrom->PushSerializedMessage(pmsg);
     }
 
 
     else if (strCommand == "tx")
     {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
-        CTransaction tx;
-        vRecv >> tx;
+        CTransactionRef ptx;
+        vRecv >> ptx;
+        const CTransaction& tx = *ptx;
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
@@ -5010,79 +5733,29 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         pfrom->setAskFor.erase(inv.hash);
         mapAlreadyAskedFor.erase(inv);
 
-        if (!AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
+        if (!AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, ptx, true, &fMissingInputs))
         {
             mempool.check(pcoinsTip);
-            RelayTransaction(tx);
-            vWorkQueue.push_back(inv.hash);
+            RelayTransaction(ptx);
 
             LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s: accepted %s (poolsz %u)\n",
                 pfrom->id, pfrom->cleanSubVer,
                 tx.GetHash().ToString(),
                 mempool.mapTx.size());
 
-            // Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-            {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
-                    {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0)
-                        {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                        assert(recentRejects);
-                        recentRejects->insert(orphanHash);
-                    }
-                    mempool.check(pcoinsTip);
-                }
-            }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
+            // Orphans that depended on this one are reconsidered from the
+            // message handler, see ProcessOrphanWorkQueue
+            QueueOrphansOf(tx);
         }
         // TODO: currently, prohibit joinsplits from entering mapOrphans
         else if (fMissingInputs && tx.vjoinsplit.size() == 0)
         {
-            AddOrphanTx(tx, pfrom->GetId());
+            AddOrphanTx(ptx, pfrom->GetId());
 
             // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
             unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+            size_t nMaxOrphanTxSize = (size_t)std::max((int64_t)0, GetArg("-maxorphantxsize", DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE)) * 1000;
+            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx, nMaxOrphanTxSize);
             if (nEvicted > 0)
                 LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
         } else {
@@ -5101,7 +5774,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 int nDoS = 0;
                 if (!state.IsInvalid(nDoS) || nDoS == 0) {
                     LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->id);
-                    RelayTransaction(tx);
+                    RelayTransaction(ptx);
                 } else {
                     LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s (code %d))\n",
                         tx.GetHash().ToString(), pfrom->id, state.GetRejectReason(), state.GetRejectCode());
@@ -5221,7 +5894,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
         pfrom->fSentAddr = true;
 
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_addrSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -5467,12 +6143,46 @@ bool ProcessMessages(CNode* pfrom)
     //
     bool fOk = true;
 
+    {
+        // Don't wait for a block being connected, there is always a next pass
+        TRY_LOCK(cs_main, lockMain);
+        if (lockMain)
+            ProcessOrphanWorkQueue(MAX_ORPHAN_WORK_PER_PASS);
+    }
+
     if (!pfrom->vRecvGetData.empty())
         ProcessGetData(pfrom);
 
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
 
+    // Let the most urgent message overtake transaction and address relay
+    // that arrived before it: block related messages first, then
+    // transactions ahead of addresses. Control messages are never overtaken,
+    // so that the handshake, pings and filter updates keep their place
+    // relative to the rest, and block related messages keep their order
+    // among themselves, as blocks build on the headers before them.
+    if (!pfrom->vRecvMsg.empty() && pfrom->vRecvMsg.front().complete() &&
+        pfrom->vRecvMsg.front().nClass > MSG_CLASS_CONTROL) {
+        int nFrontClass = pfrom->vRecvMsg.front().nClass;
+        bool fBetterQueued = false;
+        for (int nClass = 0; nClass < nFrontClass; nClass++) {
+            if (nClass != MSG_CLASS_CONTROL && pfrom->nRecvQueued[nClass] > 0)
+                fBetterQueued = true;
+        }
+        std::deque<CNetMessage>::iterator best = pfrom->vRecvMsg.begin();
+        for (std::deque<CNetMessage>::iterator mi = best + 1; fBetterQueued && mi != pfrom->vRecvMsg.end() && mi->complete(); ++mi) {
+            if (mi->nClass == MSG_CLASS_CONTROL)
+                break;
+            if (mi->nClass < best->nClass)
+                best = mi;
+            if (mi->nClass < MSG_CLASS_CONTROL)
+                break;
+        }
+        if (best != pfrom->vRecvMsg.begin())
+            std::rotate(pfrom->vRecvMsg.begin(), best, best + 1);
+    }
+
     std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
     while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end()) {
         // Don't bother if send buffer is too full to respond anyway
@@ -5524,6 +6234,9 @@ bool ProcessMessages(CNode* pfrom)
             continue;
         }
 
+        pfrom->nRecvProcessed[msg.nClass]++;
+        pfrom->nRecvWaitTime[msg.nClass] += GetTimeMicros() - msg.nTime;
+
         // Process message
         bool fRet = false;
         try
@@ -5565,8 +6278,11 @@ bool ProcessMessages(CNode* pfrom)
     }
 
     // In case the connection got shut down, its receive buffer was wiped
-    if (!pfrom->fDisconnect)
+    if (!pfrom->fDisconnect) {
+        for (std::deque<CNetMessage>::iterator mi = pfrom->vRecvMsg.begin(); mi != it; ++mi)
+            pfrom->nRecvQueued[mi->nClass]--;
         pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+    }
 
     return fOk;
 }
@@ -5609,6 +6325,78 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             }
         }
 
+        //
+        // Message: addr
+        //
+        if (fSendTrickle)
+        {
+            vector<CAddress> vAddr;
+            {
+                LOCK(pto->cs_addrSend);
+                vAddr.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
+                {
+                    if (!pto->addrKnown.contains(addr.GetKey()))
+                    {
+                        pto->addrKnown.insert(addr.GetKey());
+                        vAddr.push_back(addr);
+                    }
+                }
+                pto->vAddrToSend.clear();
+            }
+            // receiver rejects addr messages larger than 1000
+            for (size_t i = 0; i < vAddr.size(); i += 1000)
+                pto->PushMessage("addr", vector<CAddress>(vAddr.begin() + i, vAddr.begin() + std::min(i + 1000, vAddr.size())));
+        }
+
+        //
+        // Message: inventory
+        //
+        vector<CInv> vInv;
+        vector<CInv> vInvWait;
+        {
+            LOCK(pto->cs_inventory);
+            vInv.reserve(pto->vInventoryToSend.size());
+            vInvWait.reserve(pto->vInventoryToSend.size());
+            BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
+            {
+                if (pto->setInventoryKnown.count(inv))
+                    continue;
+
+                // trickle out tx inv to protect privacy
+                if (inv.type == MSG_TX && !fSendTrickle)
+                {
+                    // 1/4 of tx invs blast to all immediately
+                    static const uint256 hashSalt = GetRandHash();
+                    uint256 hashRand = ArithToUint256(UintToArith256(inv.hash) ^ UintToArith256(hashSalt));
+                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
+                    bool fTrickleWait = ((UintToArith256(hashRand) & 3) != 0);
+
+                    if (fTrickleWait)
+                    {
+                        vInvWait.push_back(inv);
+                        continue;
+                    }
+                }
+
+                // returns true if wasn't already contained in the set
+                if (pto->setInventoryKnown.insert(inv).second)
+                {
+                    vInv.push_back(inv);
+                    if (vInv.size() >= 1000)
+                    {
+                        pto->PushMessage("inv", vInv);
+                        vInv.clear();
+                    }
+                }
+            }
+            pto->vInventoryToSend = vInvWait;
+        }
+        if (!vInv.empty())
+            pto->PushMessage("inv", vInv);
+
+        // Everything above goes out even while cs_main is busy, e.g. with a
+        // block being connected.
         TRY_LOCK(cs_main, lockMain); // Acquire cs_main for IsInitialBlockDownload() and CNodeState()
         if (!lockMain)
             return true;
@@ -5621,8 +6409,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             BOOST_FOREACH(CNode* pnode, vNodes)
             {
                 // Periodically clear addrKnown to allow refresh broadcasts
-                if (nLastRebroadcast)
+                if (nLastRebroadcast) {
+                    LOCK(pnode->cs_addrSend);
                     pnode->addrKnown.reset();
+                }
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -5631,32 +6421,6 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 nLastRebroadcast = GetTime();
         }
 
-        //
-        // Message: addr
-        //
-        if (fSendTrickle)
-        {
-            vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
-            {
-                if (!pto->addrKnown.contains(addr.GetKey()))
-                {
-                    pto->addrKnown.insert(addr.GetKey());
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
-                    {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
-                    }
-                }
-            }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                pto->PushMessage("addr", vAddr);
-        }
-
         CNodeState &state = *State(pto->GetId());
         if (state.fShouldBan) {
             if (pto->fWhitelisted)
@@ -5700,54 +6464,6 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             GetMainSignals().Broadcast(nTimeBestReceived);
         }
 
-        //
-        // Message: inventory
-        //
-        vector<CInv> vInv;
-        vector<CInv> vInvWait;
-        {
-            LOCK(pto->cs_inventory);
-            vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
-            BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
-            {
-                if (pto->setInventoryKnown.count(inv))
-                    continue;
-
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle)
-                {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt.IsNull())
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = ArithToUint256(UintToArith256(inv.hash) ^ UintToArith256(hashSalt));
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((UintToArith256(hashRand) & 3) != 0);
-
-                    if (fTrickleWait)
-                    {
-                        vInvWait.push_back(inv);
-                        continue;
-                    }
-                }
-
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
-                {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
-                }
-            }
-            pto->vInventoryToSend = vInvWait;
-        }
-        if (!vInv.empty())
-            pto->PushMessage("inv", vInv);
-
         // Detect whether we're stalling
         int64_t nNow = GetTimeMicros();
         if (!pto->fDisconnect && state.nStallingSince && state.nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT) {
@@ -5855,5 +6571,7 @@ public:
         // orphan transactions
         mapOrphanTransactions.clear();
         mapOrphanTransactionsByPrev.clear();
+        nOrphanTransactionsSize = 0;
+        vOrphanWorkQueue.clear();
     }
 } instance_of_cmaincleanup;
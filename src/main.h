@@ -41,6 +41,8 @@
 class CBlockIndex;
 class CBlockTreeDB;
 class CBloomFilter;
+class CCoinsViewPrefetch;
+class CCoinsViewWriteBehind;
 class CInv;
 class CScriptCheck;
 class CValidationInterface;
@@ -65,6 +67,28 @@ static const unsigned int MAX_STANDARD_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 static const unsigned int DEFAULT_MIN_RELAY_TX_FEE = 100;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -maxorphantxsize, maximum kilobytes of orphan transactions kept in memory */
+static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE = 1000;
+/** Expiration time for orphan transactions in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Minimum time between orphan transaction expiry checks in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
+/** Maximum number of orphan transactions reconsidered per pass of the message handler */
+static const unsigned int MAX_ORPHAN_WORK_PER_PASS = 25;
+/** Default for -maxmempool, maximum megabytes of mempool memory usage */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+/** Default for -persistmempool */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Default for -limitancestorcount, max number of in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, maximum kilobytes of tx + all in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Default for -limitdescendantcount, max number of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -91,6 +115,10 @@ static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
 static const unsigned int DATABASE_WRITE_INTERVAL = 60 * 60;
 /** Time to wait (in seconds) between flushing chainstate to disk. */
 static const unsigned int DATABASE_FLUSH_INTERVAL = 24 * 60 * 60;
+/** Default for -dbcachelowwater, the percentage of the coins cache limit it is trimmed to when full. */
+static const unsigned int DEFAULT_COIN_CACHE_LOW_WATER = 75;
+/** Default for -dbcachehugepages, backing the coins cache by huge pages. */
+static const bool DEFAULT_COIN_CACHE_HUGE_PAGES = false;
 /** Maximum length of reject messages. */
 static const unsigned int MAX_REJECT_MESSAGE_LENGTH = 111;
 
@@ -129,6 +157,7 @@ extern bool fCheckpointsEnabled;
 // it is unneeded for testing
 extern bool fCoinbaseEnforcedProtectionEnabled;
 extern size_t nCoinCacheUsage;
+extern unsigned int nCoinCacheLowWater;
 extern CFeeRate minRelayTxFee;
 extern bool fAlerts;
 
@@ -187,6 +216,10 @@ FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos &pos, const char *prefix);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp = NULL);
+/** Load the transactions saved by DumpMempool, re-validating them in batches */
+bool LoadMempool();
+/** Save the mempool, with entry times and prioritisation, to mempool.dat */
+bool DumpMempool();
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex();
 /** Load the block tree and coins database from disk */
@@ -249,9 +282,17 @@ void FlushStateToDisk();
 /** Prune block files and flush state to disk. */
 void PruneAndFlush();
 
-/** (try to) add transaction to memory pool **/
+/** (try to) add transaction to memory pool; the pool keeps a reference to ptx rather than a copy **/
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransactionRef &ptx, bool fLimitFree,
+                        bool* pfMissingInputs, bool fRejectAbsurdFee=false, bool fOverrideMempoolLimit=false);
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectAbsurdFee=false);
+                        bool* pfMissingInputs, bool fRejectAbsurdFee=false, bool fOverrideMempoolLimit=false);
+/** As AcceptToMemoryPool, with the time the transaction is recorded to have entered the pool */
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransactionRef &ptx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectAbsurdFee=false, bool fOverrideMempoolLimit=false);
+
+/** Expire old transactions from the memory pool, then evict the lowest fee-rate packages until it fits in limit bytes */
+void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age);
 
 
 /** Get the BIP9 state for a given deployment at the current tip. */
@@ -331,17 +372,35 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& ma
 /**
  * Check whether all inputs of this transaction are valid (no double spends, scripts & sigs, amounts)
  * This does not modify the UTXO set. If pvChecks is not NULL, script checks are pushed onto it
- * instead of being performed inline.
+ * instead of being performed inline, and verifying the transaction's joinSplitSig is left to the
+ * caller (see CJoinSplitSigCheck).
  */
 bool ContextualCheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &view, bool fScriptChecks,
                            unsigned int flags, bool cacheStore, const Consensus::Params& consensusParams,
                            std::vector<CScriptCheck> *pvChecks = NULL);
 
+/** Initialize the script execution cache; to be called once at startup. */
+void InitScriptExecutionCache();
+/**
+ * Check whether tx's input scripts and joinSplitSig are known to pass under
+ * flags, counting a hit or miss. If erase is set, a matching entry is removed.
+ */
+bool IsScriptExecutionCached(const CTransaction& tx, unsigned int flags, bool erase);
+/** Record that tx's input scripts and joinSplitSig pass under flags. */
+void AddScriptExecutionToCache(const CTransaction& tx, unsigned int flags);
+/** Lookups of the script execution cache made while connecting blocks. */
+void GetScriptExecutionCacheStats(uint64_t& nHits, uint64_t& nMisses);
+
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCache &inputs, int nHeight);
 
-/** Context-independent validity checks */
-bool CheckTransaction(const CTransaction& tx, CValidationState& state, libzcash::ProofVerifier& verifier);
+/**
+ * Context-independent validity checks
+ * If cacheStore is set, JoinSplit proofs found in the proof cache are not
+ * verified again, and proofs that verify are added to it. It must only be
+ * set together with a strict verifier.
+ */
+bool CheckTransaction(const CTransaction& tx, CValidationState& state, libzcash::ProofVerifier& verifier, bool cacheStore = false);
 bool CheckTransactionWithoutProofVerification(const CTransaction& tx, CValidationState &state);
 bool CheckJoinSplitSigs(const CTransaction& tx, CValidationState &state, const unsigned int flags);
 
@@ -399,6 +458,120 @@ public:
     ScriptError GetScriptError() const { return error; }
 };
 
+/**
+ * Closure representing the verification of a batch of JoinSplit proofs
+ * Note that this stores references to the transactions containing the JoinSplits
+ * If cacheStore is set, the proofs are added to the proof cache once the
+ * whole batch verifies.
+ */
+class CProofCheck
+{
+private:
+    std::vector<std::pair<const CTransaction*, unsigned int> > vJoinSplits;
+    bool cacheStore;
+
+public:
+    CProofCheck(bool cacheStoreIn = false) : cacheStore(cacheStoreIn) {}
+
+    void Add(const CTransaction& tx, unsigned int nJoinSplit) {
+        vJoinSplits.push_back(std::make_pair(&tx, nJoinSplit));
+    }
+
+    size_t size() const { return vJoinSplits.size(); }
+
+    bool operator()();
+
+    void swap(CProofCheck &check) {
+        vJoinSplits.swap(check.vJoinSplits);
+        std::swap(cacheStore, check.cacheStore);
+    }
+};
+
+/**
+ * Closure representing the verification of the joinSplitSigs of a batch
+ * of transactions
+ * Note that this stores references to the transactions
+ */
+class CJoinSplitSigCheck
+{
+private:
+    std::vector<const CTransaction*> vTx;
+    unsigned int nFlags;
+
+public:
+    CJoinSplitSigCheck(): nFlags(0) {}
+    CJoinSplitSigCheck(unsigned int nFlagsIn): nFlags(nFlagsIn) {}
+
+    void Add(const CTransaction& tx) {
+        vTx.push_back(&tx);
+    }
+
+    size_t size() const { return vTx.size(); }
+
+    bool operator()();
+
+    void swap(CJoinSplitSigCheck &check) {
+        vTx.swap(check.vTx);
+        std::swap(nFlags, check.nFlags);
+    }
+};
+
+/**
+ * Closure representing one deferred check of a block being connected.
+ * Script checks, JoinSplit proof checks and joinSplitSig checks are all
+ * wrapped in this type so that they can be queued on the same CCheckQueue
+ * and share its worker threads.
+ */
+class CBlockCheck
+{
+private:
+    enum Kind { SCRIPT, PROOF, JOINSPLIT_SIG };
+
+    Kind kind;
+    CScriptCheck scriptCheck;
+    CProofCheck proofCheck;
+    CJoinSplitSigCheck joinSplitSigCheck;
+
+public:
+    CBlockCheck(): kind(SCRIPT) {}
+
+    bool operator()() {
+        switch (kind) {
+        case PROOF:
+            return proofCheck();
+        case JOINSPLIT_SIG:
+            return joinSplitSigCheck();
+        default:
+            return scriptCheck();
+        }
+    }
+
+    void swap(CBlockCheck &check) {
+        std::swap(kind, check.kind);
+        scriptCheck.swap(check.scriptCheck);
+        proofCheck.swap(check.proofCheck);
+        joinSplitSigCheck.swap(check.joinSplitSigCheck);
+    }
+
+    //! Take ownership of a script check, leaving check empty
+    void swap(CScriptCheck &check) {
+        kind = SCRIPT;
+        scriptCheck.swap(check);
+    }
+
+    //! Take ownership of a proof check, leaving check empty
+    void swap(CProofCheck &check) {
+        kind = PROOF;
+        proofCheck.swap(check);
+    }
+
+    //! Take ownership of a joinSplitSig check, leaving check empty
+    void swap(CJoinSplitSigCheck &check) {
+        kind = JOINSPLIT_SIG;
+        joinSplitSigCheck.swap(check);
+    }
+};
+
 
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
@@ -408,6 +581,10 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos
 #endif
 );
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+/** Read a block as stored, into vBlock from nOffset on, checking its header against pindex */
+bool ReadRawBlockFromDisk(CSerializeData& vBlock, const CBlockIndex* pindex, size_t nOffset = 0);
+/** The serialized "block" message for a block, from the block cache or straight from disk */
+CSerializeDataRef GetBlockMessage(const CBlockIndex* pindex);
 
 
 /** Functions for validating blocks and updating the block tree */
@@ -524,6 +701,12 @@ extern CChain chainActive;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Prefetching layer under pcoinsTip, or NULL if -prefetchinputs=0 */
+extern CCoinsViewPrefetch *pcoinsPrefetch;
+
+/** Layer writing pcoinsTip flushes in the background, or NULL if -writebehind=0 */
+extern CCoinsViewWriteBehind *pcoinsWriteBehind;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
@@ -5,9 +5,13 @@
 #ifndef BITCOIN_MEMUSAGE_H
 #define BITCOIN_MEMUSAGE_H
 
+#include "prevector.h"
+#include "support/allocators/pool.h"
+
 #include <stdlib.h>
 
 #include <map>
+#include <memory>
 #include <set>
 #include <vector>
 
@@ -55,6 +59,27 @@ static inline size_t MallocUsage(size_t alloc)
     }
 }
 
+/**
+ * Compute the memory used by allocating alloc bytes through a pool_allocator.
+ * This is the block itself; the rest of its chunk is in PoolFreeUsage().
+ */
+static inline size_t PoolUsage(size_t alloc)
+{
+    if (alloc > POOL_MAX_BLOCK)
+        return MallocUsage(alloc);
+    return alloc == 0 ? POOL_ALIGN : (alloc + POOL_ALIGN - 1) / POOL_ALIGN * POOL_ALIGN;
+}
+
+/**
+ * Memory the pool holds beyond the blocks it handed out: released blocks
+ * and the unused space of partly used chunks. Together with PoolUsage() of
+ * every block, this accounts for whole chunks.
+ */
+static inline size_t PoolFreeUsage()
+{
+    return PoolMemory::Instance().GetFreeBytes();
+}
+
 // STL data structures
 
 template<typename X>
@@ -75,17 +100,61 @@ static inline size_t DynamicUsage(const std::vector<X>& v)
 }
 
 template<typename X>
-static inline size_t DynamicUsage(const std::set<X>& s)
+static inline size_t DynamicUsage(const std::vector<X, pool_allocator<X> >& v)
+{
+    return v.capacity() == 0 ? 0 : PoolUsage(v.capacity() * sizeof(X));
+}
+
+template<unsigned int N, typename X, typename S, typename D>
+static inline size_t DynamicUsage(const prevector<N, X, S, D>& v)
+{
+    // Elements stored inline cost nothing beyond the object itself.
+    return v.allocated_memory() == 0 ? 0 : MallocUsage(v.allocated_memory());
+}
+
+template<typename X, typename Y>
+static inline size_t DynamicUsage(const std::set<X, Y>& s)
 {
     return MallocUsage(sizeof(stl_tree_node<X>)) * s.size();
 }
 
 template<typename X, typename Y>
-static inline size_t DynamicUsage(const std::map<X, Y>& m)
+static inline size_t IncrementalDynamicUsage(const std::set<X, Y>& s)
+{
+    return MallocUsage(sizeof(stl_tree_node<X>));
+}
+
+template<typename X, typename Y, typename Z>
+static inline size_t DynamicUsage(const std::map<X, Y, Z>& m)
 {
     return MallocUsage(sizeof(stl_tree_node<std::pair<const X, Y> >)) * m.size();
 }
 
+template<typename X, typename Y, typename Z>
+static inline size_t IncrementalDynamicUsage(const std::map<X, Y, Z>& m)
+{
+    return MallocUsage(sizeof(stl_tree_node<std::pair<const X, Y> >));
+}
+
+template<typename X>
+struct stl_shared_counter
+{
+    /* Various platforms use different sized counters here.
+     * Conservatively assume that they won't be larger than size_t. */
+    X x;
+    size_t use_count;
+    size_t weak_count;
+};
+
+template<typename X>
+static inline size_t DynamicUsage(const std::shared_ptr<X>& p)
+{
+    // A shared_ptr can either use a single continuous memory block for both
+    // the counter and the storage (when using std::make_shared), or separate.
+    // We can't observe the difference, however, so assume the worst.
+    return p ? MallocUsage(sizeof(stl_shared_counter<X>)) : 0;
+}
+
 // Boost data structures
 
 template<typename X>
@@ -107,6 +176,12 @@ static inline size_t DynamicUsage(const boost::unordered_map<X, Y, Z>& m)
     return MallocUsage(sizeof(boost_unordered_node<std::pair<const X, Y> >)) * m.size() + MallocUsage(sizeof(void*) * m.bucket_count());
 }
 
+template<typename X, typename Y, typename Z, typename E>
+static inline size_t DynamicUsage(const boost::unordered_map<X, Y, Z, E, pool_allocator<std::pair<const X, Y> > >& m)
+{
+    return PoolUsage(sizeof(boost_unordered_node<std::pair<const X, Y> >)) * m.size() + MallocUsage(sizeof(void*) * m.bucket_count());
+}
+
 }
 
 #endif
@@ -7,11 +7,21 @@
 #define BITCOIN_MINER_H
 
 #include "primitives/block.h"
+#include "sync.h"
+#include "txmempool.h"
 
-#include <boost/optional.hpp>
+#include <atomic>
+#include <memory>
+#include <set>
 #include <stdint.h>
 
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+#include <boost/optional.hpp>
+
 class CBlockIndex;
+class CChainParams;
+class CCoinsViewCache;
 class CScript;
 #ifdef ENABLE_WALLET
 class CReserveKey;
@@ -26,6 +36,247 @@ struct CBlockTemplate
     std::vector<int64_t> vTxSigOps;
 };
 
+// Container for tracking updates to ancestor feerate as we include (parent)
+// transactions in a block
+struct CTxMemPoolModifiedEntry {
+    CTxMemPoolModifiedEntry(CTxMemPool::txiter entry)
+    {
+        iter = entry;
+        nSizeWithAncestors = entry->GetSizeWithAncestors();
+        nModFeesWithAncestors = entry->GetModFeesWithAncestors();
+    }
+
+    CTxMemPool::txiter iter;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+};
+
+/** Comparator for CTxMemPool::txiter objects.
+ *  It simply compares the internal memory address of the CTxMemPoolEntry object
+ *  pointed to. This means it has no meaning, and is only useful for using them
+ *  as key in other indexes.
+ */
+struct CompareCTxMemPoolIter {
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
+    {
+        return &(*a) < &(*b);
+    }
+};
+
+struct modifiedentry_iter {
+    typedef CTxMemPool::txiter result_type;
+    result_type operator() (const CTxMemPoolModifiedEntry &entry) const
+    {
+        return entry.iter;
+    }
+};
+
+// This matches the calculation in CompareTxMemPoolEntryByAncestorFee,
+// except operating on CTxMemPoolModifiedEntry.
+struct CompareModifiedEntry {
+    bool operator()(const CTxMemPoolModifiedEntry &a, const CTxMemPoolModifiedEntry &b) const
+    {
+        double f1 = (double)a.nModFeesWithAncestors * b.nSizeWithAncestors;
+        double f2 = (double)b.nModFeesWithAncestors * a.nSizeWithAncestors;
+        if (f1 == f2) {
+            return CTxMemPool::CompareIteratorByHash()(a.iter, b.iter);
+        }
+        return f1 > f2;
+    }
+};
+
+// A comparator that sorts transactions based on number of ancestors.
+// This is sufficient to sort an ancestor package in an order that is valid
+// to appear in a block.
+struct CompareTxIterByAncestorCount {
+    bool operator()(const CTxMemPool::txiter &a, const CTxMemPool::txiter &b) const
+    {
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return CTxMemPool::CompareIteratorByHash()(a, b);
+    }
+};
+
+typedef boost::multi_index_container<
+    CTxMemPoolModifiedEntry,
+    boost::multi_index::indexed_by<
+        boost::multi_index::ordered_unique<
+            modifiedentry_iter,
+            CompareCTxMemPoolIter
+        >,
+        // sorted by modified ancestor fee rate
+        boost::multi_index::ordered_non_unique<
+            // Reuse same tag from CTxMemPool's similar index
+            boost::multi_index::tag<ancestor_score>,
+            boost::multi_index::identity<CTxMemPoolModifiedEntry>,
+            CompareModifiedEntry
+        >
+    >
+> indexed_modified_transaction_set;
+
+typedef indexed_modified_transaction_set::nth_index<0>::type::iterator modtxiter;
+typedef indexed_modified_transaction_set::index<ancestor_score>::type::iterator modtxscoreiter;
+
+struct update_for_parent_inclusion
+{
+    update_for_parent_inclusion(CTxMemPool::txiter it) : iter(it) {}
+
+    void operator() (CTxMemPoolModifiedEntry &e)
+    {
+        e.nModFeesWithAncestors -= iter->GetModifiedFee();
+        e.nSizeWithAncestors -= iter->GetTxSize();
+    }
+
+    CTxMemPool::txiter iter;
+};
+
+/**
+ * Generate a new block from the mempool.
+ *
+ * The first -blockprioritysize bytes are filled by coin-age priority. The
+ * rest of the block is filled by package: each transaction is scored
+ * together with the in-mempool ancestors it would pull into the block
+ * (the mempool's ancestor_score index), so a high-fee child pays for its
+ * low-fee parents. As packages are added, the ancestor state of their
+ * descendants is tracked in a side index rather than in the mempool.
+ */
+class BlockAssembler
+{
+private:
+    // The constructed block template
+    std::unique_ptr<CBlockTemplate> pblocktemplate;
+    // A convenience pointer that always refers to the CBlock in pblocktemplate
+    CBlock* pblock;
+
+    // Configuration parameters for the block size
+    unsigned int nBlockMaxSize, nBlockMinSize, nBlockPrioritySize;
+
+    // Information on the current status of the block
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    unsigned int nBlockSigOps;
+    CAmount nFees;
+    CTxMemPool::setEntries inBlock;
+
+    // Chain context for the block
+    int nHeight;
+    int64_t nLockTimeCutoff;
+    const CChainParams& chainparams;
+
+    bool fPrintPriority;
+
+public:
+    BlockAssembler(const CChainParams& chainparams);
+    /** Construct a new block template with coinbase to scriptPubKeyIn */
+    CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn);
+
+private:
+    // utility functions
+    /** Clear the block's state and prepare for assembling a new block */
+    void resetBlock();
+    /** Add a tx to the block, with the fee and sigops found by TestPackageInputs */
+    void AddToBlock(CTxMemPool::txiter iter, unsigned int nTxSigOps);
+
+    // Methods for how to add transactions to a block.
+    /** Add transactions based on tx "priority" */
+    void addPriorityTxs(CCoinsViewCache& view);
+    /** Add transactions based on feerate including unconfirmed ancestors */
+    void addPackageTxs(CCoinsViewCache& view);
+
+    // helper function for addPriorityTxs
+    /** Test if tx will still "fit" in the block */
+    bool TestForBlock(CTxMemPool::txiter iter);
+    /** Test if tx still has unconfirmed parents not yet in block */
+    bool isStillDependent(CTxMemPool::txiter iter);
+
+    // helper functions for addPackageTxs()
+    /** Remove confirmed (inBlock) entries from given set */
+    void onlyUnconfirmed(CTxMemPool::setEntries& testSet);
+    /** Test if a new package would "fit" in the block */
+    bool TestPackage(uint64_t packageSize);
+    /** Check that the transactions, in order, are final and spend coins that
+     *  view (updated by the earlier ones) has, under the consensus script
+     *  flags. On success view is updated and vSigOps holds their sigops. */
+    bool TestPackageInputs(CCoinsViewCache& view, const std::vector<CTxMemPool::txiter>& package, std::vector<unsigned int>& vSigOps);
+    /** Return true if given transaction from mapTx has already been evaluated,
+      * or if the transaction's cached data in mapTx is incorrect. */
+    bool SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set &mapModifiedTx, CTxMemPool::setEntries &failedTx);
+    /** Sort the package in an order that is valid to appear in a block */
+    void SortForBlock(const CTxMemPool::setEntries& package, std::vector<CTxMemPool::txiter>& sortedEntries);
+    /** Add descendants of given transactions to mapModifiedTx with ancestor
+      * state updated assuming given transactions are inBlock. */
+    void UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set &mapModifiedTx);
+};
+
+/** Default for -blocktemplatefeedelta, the fee gain that wakes longpolling getblocktemplate clients */
+static const CAmount DEFAULT_BLOCK_TEMPLATE_FEE_DELTA = 10000;
+/** Seconds between rebuilds of the template for better paying transactions */
+static const int64_t BLOCK_TEMPLATE_REBUILD_INTERVAL = 5;
+
+/**
+ * The block template served by getblocktemplate, kept current with the
+ * mempool so that a request only has to copy it out.
+ *
+ * A template assembled by BlockAssembler is installed with Set(). From then
+ * on, a transaction entering the mempool is appended to it if its
+ * in-mempool parents are already in it, it pays at least the relay fee and
+ * it fits; the coinbase is credited with its fee. The template is invalid,
+ * and must be assembled again, once the tip changes or one of its
+ * transactions leaves the mempool. Any other transaction entering the
+ * mempool makes it outdated instead, and it is then assembled again at
+ * most every BLOCK_TEMPLATE_REBUILD_INTERVAL seconds, as before.
+ *
+ * The sequence number changes whenever the template does. Longpolling
+ * clients are woken when the template's fees have grown by nFeeDelta since
+ * they were last woken.
+ */
+class CBlockTemplateCache
+{
+public:
+    CBlockTemplateCache(CTxMemPool& poolIn, CAmount nFeeDeltaIn);
+    ~CBlockTemplateCache();
+
+    /**
+     * Copy the template out if it can be served on top of pindexPrev,
+     * together with its sequence number. Returns false if it has to be
+     * assembled again first.
+     */
+    bool Get(const CBlockIndex* pindexPrev, CBlockTemplate& blocktemplate, unsigned int& nSequenceOut);
+    /** Install a newly assembled template, taking ownership of it. */
+    void Set(CBlockTemplate* pblocktemplateIn);
+
+    /** Sequence number of the current template */
+    unsigned int GetSequence() const { return nSequence; }
+    /** Sequence number when longpolling clients were last woken */
+    unsigned int GetAnnouncedSequence() const { return nSequenceAnnounced; }
+
+private:
+    void TransactionAdded(CTransactionRef ptx);
+    void TransactionRemoved(CTransactionRef ptx);
+    /** Bump the sequence number, and wake longpolling clients if fees grew enough */
+    void Changed();
+
+    CCriticalSection cs;
+    CTxMemPool& pool;
+    const CAmount nFeeDelta;
+    std::unique_ptr<CBlockTemplate> pblocktemplate;
+    //! Transactions in the template, other than the coinbase
+    std::set<uint256> setTemplateTx;
+    uint64_t nBlockSize;
+    unsigned int nBlockSigOps;
+    unsigned int nBlockMaxSize;
+    CAmount nFees;
+    CAmount nFeesAnnounced;
+    int64_t nTimeSet;
+    bool fInvalid;
+    bool fOutdated;
+    std::atomic<unsigned int> nSequence;
+    std::atomic<unsigned int> nSequenceAnnounced;
+};
+
+/** Template served by getblocktemplate; created at startup */
+extern CBlockTemplateCache* pblocktemplatecache;
+
 /** Generate a new block, without valid proof-of-work */
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn);
 #ifdef ENABLE_WALLET
@@ -23,6 +23,10 @@
 #include <fcntl.h>
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/miniwget.h>
@@ -76,13 +80,17 @@ static bool vfLimited[NET_MAX] = {};
 static CNode* pnodeLocalHost = NULL;
 uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
+#ifdef HAVE_SYS_EPOLL_H
+//! Socket events are waited for with this epoll instance, see SocketEventsEpoll
+static int epollfd = -1;
+#endif
 CAddrMan addrman;
 int nMaxConnections = DEFAULT_MAX_PEER_CONNECTIONS;
 bool fAddressesInitialized = false;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CTransactionRef> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
@@ -101,6 +109,7 @@ CCriticalSection cs_nLastNodeId;
 
 static CSemaphore *semOutbound = NULL;
 boost::condition_variable messageHandlerCondition;
+static boost::mutex messageHandlerMutex;
 
 // Signals for message handling
 static CNodeSignals g_signals;
@@ -358,6 +367,22 @@ CNode* FindNode(const CService& addr)
     return NULL;
 }
 
+#ifdef HAVE_SYS_EPOLL_H
+/** Register a new node's socket for edge-triggered read and write events. */
+static void AddNodeSocketEvents(CNode* pnode)
+{
+    if (epollfd == -1)
+        return;
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = pnode;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, pnode->hSocket, &event) != 0) {
+        LogPrintf("epoll_ctl failed for peer=%d: %s\n", pnode->id, NetworkErrorString(WSAGetLastError()));
+        pnode->CloseSocketDisconnect();
+    }
+}
+#endif
+
 CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
 {
     if (pszDest == NULL) {
@@ -385,7 +410,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed))
     {
         if (!IsSelectableSocket(hSocket)) {
-            LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
+            LogPrintf("Cannot create connection: socket %d is too large for select() (FD_SETSIZE is %d)\n", hSocket, FD_SETSIZE);
             CloseSocket(hSocket);
             return NULL;
         }
@@ -400,6 +425,9 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         }
+#ifdef HAVE_SYS_EPOLL_H
+        AddNodeSocketEvents(pnode);
+#endif
 
         pnode->nTimeConnected = GetTime();
 
@@ -424,8 +452,11 @@ void CNode::CloseSocketDisconnect()
 
     // in case this fails, we'll empty the recv buffer when the CNode is deleted
     TRY_LOCK(cs_vRecvMsg, lockRecv);
-    if (lockRecv)
+    if (lockRecv) {
         vRecvMsg.clear();
+        for (int i = 0; i < MSG_CLASS_MAX; i++)
+            nRecvQueued[i] = 0;
+    }
 }
 
 void CNode::PushVersion()
@@ -541,6 +572,60 @@ void CNode::AddWhitelistedRange(const CSubNet &subnet) {
     vWhitelistedRange.push_back(subnet);
 }
 
+const char* GetMessageClassName(int nClass)
+{
+    switch (nClass) {
+    case MSG_CLASS_BLOCK: return "block";
+    case MSG_CLASS_HEADERS: return "headers";
+    case MSG_CLASS_CONTROL: return "control";
+    case MSG_CLASS_TX: return "tx";
+    case MSG_CLASS_ADDR: return "addr";
+    }
+    return "unknown";
+}
+
+/** Whether an inv or getdata payload lists a block, read in place. */
+static bool InvHasBlock(const CDataStream& vRecv)
+{
+    if (vRecv.empty())
+        return false;
+    const unsigned char* p = (const unsigned char*)&vRecv.begin()[0];
+    const unsigned char* pend = p + vRecv.size();
+    uint64_t nCount = *p++;
+    unsigned int nSizeBytes = nCount == 253 ? 2 : nCount == 254 ? 4 : nCount == 255 ? 8 : 0;
+    if (nSizeBytes) {
+        if ((size_t)(pend - p) < nSizeBytes)
+            return false;
+        nCount = 0;
+        for (unsigned int i = 0; i < nSizeBytes; i++)
+            nCount |= (uint64_t)p[i] << (8 * i);
+        p += nSizeBytes;
+    }
+    // Each CInv is a 4 byte type followed by a 32 byte hash
+    for (; nCount > 0 && pend - p >= 36; nCount--, p += 36) {
+        uint32_t nType = ReadLE32(p);
+        if (nType == MSG_BLOCK || nType == MSG_FILTERED_BLOCK)
+            return true;
+    }
+    return false;
+}
+
+static MessageClass ClassifyMessage(const CNetMessage& msg)
+{
+    std::string strCommand = msg.hdr.GetCommand();
+    if (strCommand == "block")
+        return MSG_CLASS_BLOCK;
+    if (strCommand == "headers" || strCommand == "getheaders" || strCommand == "getblocks")
+        return MSG_CLASS_HEADERS;
+    if (strCommand == "tx")
+        return MSG_CLASS_TX;
+    if (strCommand == "inv" || strCommand == "getdata")
+        return InvHasBlock(msg.vRecv) ? MSG_CLASS_BLOCK : MSG_CLASS_TX;
+    if (strCommand == "addr" || strCommand == "getaddr")
+        return MSG_CLASS_ADDR;
+    return MSG_CLASS_CONTROL;
+}
+
 #undef X
 #define X(name) stats.name = name
 void CNode::copyStats(CNodeStats &stats)
@@ -577,6 +662,13 @@ void CNode::copyStats(CNodeStats &stats)
 
     // Leave string empty if addrLocal invalid (not filled in yet)
     stats.addrLocal = addrLocal.IsValid() ? addrLocal.ToString() : "";
+
+    for (int i = 0; i < MSG_CLASS_MAX; i++) {
+        uint64_t nProcessed = nRecvProcessed[i];
+        stats.nRecvQueueDepth[i] = nRecvQueued[i];
+        stats.nRecvProcessed[i] = nProcessed;
+        stats.dRecvWaitTime[i] = nProcessed ? (((double)nRecvWaitTime[i]) / nProcessed / 1e6) : 0;
+    }
 }
 #undef X
 
@@ -612,6 +704,8 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 
         if (msg.complete()) {
             msg.nTime = GetTimeMicros();
+            msg.nClass = ClassifyMessage(msg);
+            nRecvQueued[msg.nClass]++;
             messageHandlerCondition.notify_one();
         }
     }
@@ -677,10 +771,10 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSerializeDataRef>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
+        const CSerializeData &data = **it;
         assert(data.size() > pnode->nSendOffset);
         int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
         if (nBytes > 0) {
@@ -945,7 +1039,358 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
         LOCK(cs_vNodes);
         vNodes.push_back(pnode);
     }
+#ifdef HAVE_SYS_EPOLL_H
+    AddNodeSocketEvents(pnode);
+#endif
+}
+
+/** Whether a node's receive buffer can take more data */
+static bool NodeCanReceive(CNode* pnode)
+{
+    return pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+           pnode->GetTotalRecvSize() <= ReceiveFloodSize();
+}
+
+/**
+ * Read from a node's socket into its receive buffer. With fDrain the socket
+ * is read until it would block or the receive buffer is full, as needed for
+ * edge-triggered events; otherwise it is read once. Returns whether data
+ * may have been left in the socket.
+ */
+// requires LOCK(cs_vRecvMsg)
+static bool SocketRecvData(CNode* pnode, bool fDrain)
+{
+    while (true)
+    {
+        // typical socket buffer is 8K-64K
+        char pchBuf[0x10000];
+        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+        if (nBytes > 0)
+        {
+            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes)) {
+                pnode->CloseSocketDisconnect();
+                return false;
+            }
+            pnode->nLastRecv = GetTime();
+            pnode->nRecvBytes += nBytes;
+            pnode->RecordBytesRecv(nBytes);
+            if (!fDrain || !NodeCanReceive(pnode))
+                return true;
+        }
+        else if (nBytes == 0)
+        {
+            // socket closed gracefully
+            if (!pnode->fDisconnect)
+                LogPrint("net", "socket closed\n");
+            pnode->CloseSocketDisconnect();
+            return false;
+        }
+        else
+        {
+            // error
+            int nErr = WSAGetLastError();
+            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+            {
+                if (!pnode->fDisconnect)
+                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+                pnode->CloseSocketDisconnect();
+            }
+            return nErr == WSAEINTR;
+        }
+    }
+}
+
+static void InactivityCheck(CNode* pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+        {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+//! Maximum number of events taken from the kernel per epoll_wait
+static const int MAX_SOCKET_EVENTS = 256;
+
+//! Nodes with data to read (or a hang-up to notice) that has not been read yet
+static std::set<CNode*> setNodesRecvPending;
+//! Nodes that became writable while their send buffer was locked
+static std::set<CNode*> setNodesSendPending;
+static int64_t nLastInactivityCheck = 0;
+
+/**
+ * Wait for socket events with epoll and service them.
+ *
+ * Node sockets are edge-triggered: an event is only reported when the socket
+ * becomes readable or writable, so the loop touches just the nodes that have
+ * something to do rather than every connection, and sends are driven by
+ * EPOLLOUT instead of polling. Because an edge is not repeated, a node whose
+ * read could not be completed (its buffers were locked or full, or it still
+ * has data to send) is kept in a pending set and
+ * retried on the next pass.
+ */
+static void SocketEventsEpoll()
+{
+    // Poll again soon while work is pending, otherwise only wake up for
+    // events, or to clean up disconnected nodes.
+    int nTimeout = (setNodesRecvPending.empty() && setNodesSendPending.empty()) ? 100 : 10;
+    struct epoll_event events[MAX_SOCKET_EVENTS];
+    int nEvents = epoll_wait(epollfd, events, MAX_SOCKET_EVENTS, nTimeout);
+    boost::this_thread::interruption_point();
+
+    if (nEvents < 0) {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEINTR) {
+            LogPrintf("socket epoll error %s\n", NetworkErrorString(nErr));
+            MilliSleep(nTimeout);
+        }
+        nEvents = 0;
+    }
+
+    // Nodes are only deleted by this thread, so the pointers stay valid here.
+    for (int i = 0; i < nEvents; i++)
+    {
+        bool fListen = false;
+        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+            if (events[i].data.ptr == &hListenSocket) {
+                // Level-triggered, so a backlog is accepted over several passes
+                AcceptConnection(hListenSocket);
+                fListen = true;
+                break;
+            }
+        }
+        if (fListen)
+            continue;
+
+        CNode* pnode = static_cast<CNode*>(events[i].data.ptr);
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            setNodesRecvPending.insert(pnode);
+        if (events[i].events & EPOLLOUT)
+            setNodesSendPending.insert(pnode);
+    }
+
+    //
+    // Send
+    //
+    for (std::set<CNode*>::iterator it = setNodesSendPending.begin(); it != setNodesSendPending.end(); )
+    {
+        CNode* pnode = *it;
+        if (pnode->hSocket == INVALID_SOCKET) {
+            setNodesSendPending.erase(it++);
+            continue;
+        }
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (!lockSend) {
+            ++it;
+            continue;
+        }
+        if (!pnode->vSendMsg.empty())
+            SocketSendData(pnode);
+        // Whatever is left is sent on the next EPOLLOUT
+        setNodesSendPending.erase(it++);
+    }
+
+    //
+    // Receive
+    //
+    for (std::set<CNode*>::iterator it = setNodesRecvPending.begin(); it != setNodesRecvPending.end(); )
+    {
+        boost::this_thread::interruption_point();
+        CNode* pnode = *it;
+        if (pnode->hSocket == INVALID_SOCKET) {
+            setNodesRecvPending.erase(it++);
+            continue;
+        }
+        // Drain the send buffer before receiving more, to make use of TCP
+        // flow control towards a peer that is not reading what we send
+        if (pnode->nSendSize > 0) {
+            ++it;
+            continue;
+        }
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (!lockRecv || !NodeCanReceive(pnode) || SocketRecvData(pnode, true))
+            ++it;
+        else
+            setNodesRecvPending.erase(it++);
+    }
+
+    //
+    // Inactivity checking
+    //
+    int64_t nTime = GetTime();
+    if (nTime != nLastInactivityCheck)
+    {
+        nLastInactivityCheck = nTime;
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            InactivityCheck(pnode);
+    }
+}
+#else
+/** Wait for socket events with select() and service them. */
+static void SocketEventsSelect()
+{
+    //
+    // Find which sockets have data to receive
+    //
+    struct timeval timeout;
+    timeout.tv_sec  = 0;
+    timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+        FD_SET(hListenSocket.socket, &fdsetRecv);
+        hSocketMax = max(hSocketMax, hListenSocket.socket);
+        have_fds = true;
+    }
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            FD_SET(pnode->hSocket, &fdsetError);
+            hSocketMax = max(hSocketMax, pnode->hSocket);
+            have_fds = true;
+
+            // Implement the following logic:
+            // * If there is data to send, select() for sending data. As this only
+            //   happens when optimistic write failed, we choose to first drain the
+            //   write buffer in this case before receiving more. This avoids
+            //   needlessly queueing received data, if the remote peer is not themselves
+            //   receiving data. This means properly utilizing TCP flow control signalling.
+            // * Otherwise, if there is no (complete) message in the receive buffer,
+            //   or there is space left in the buffer, select() for receiving data.
+            // * (if neither of the above applies, there is certainly one message
+            //   in the receiver buffer ready to be processed).
+            // Together, that means that at least one of the following is always possible,
+            // so we don't deadlock:
+            // * We send some data.
+            // * We wait for data to be received (and disconnect after timeout).
+            // * We process a message in the buffer (message handler thread).
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend && !pnode->vSendMsg.empty()) {
+                    FD_SET(pnode->hSocket, &fdsetSend);
+                    continue;
+                }
+            }
+            {
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv && NodeCanReceive(pnode))
+                    FD_SET(pnode->hSocket, &fdsetRecv);
+            }
+        }
+    }
+
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    boost::this_thread::interruption_point();
+
+    if (nSelect == SOCKET_ERROR)
+    {
+        if (have_fds)
+        {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+            for (unsigned int i = 0; i <= hSocketMax; i++)
+                FD_SET(i, &fdsetRecv);
+        }
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        MilliSleep(timeout.tv_usec/1000);
+    }
+
+    //
+    // Accept new connections
+    //
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+    {
+        if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+        {
+            AcceptConnection(hListenSocket);
+        }
+    }
+
+    //
+    // Service each socket
+    //
+    vector<CNode*> vNodesCopy;
+    {
+        LOCK(cs_vNodes);
+        vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->AddRef();
+    }
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    {
+        boost::this_thread::interruption_point();
+
+        //
+        // Receive
+        //
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+        {
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            if (lockRecv)
+                SocketRecvData(pnode, false);
+        }
+
+        //
+        // Send
+        //
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        if (FD_ISSET(pnode->hSocket, &fdsetSend))
+        {
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend)
+                SocketSendData(pnode);
+        }
+
+        //
+        // Inactivity checking
+        //
+        InactivityCheck(pnode);
+    }
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->Release();
+    }
 }
+#endif
 
 void ThreadSocketHandler()
 {
@@ -977,6 +1422,10 @@ void ThreadSocketHandler()
                     if (pnode->fNetworkNode || pnode->fInbound)
                         pnode->Release();
                     vNodesDisconnected.push_back(pnode);
+#ifdef HAVE_SYS_EPOLL_H
+                    setNodesRecvPending.erase(pnode);
+                    setNodesSendPending.erase(pnode);
+#endif
                 }
             }
         }
@@ -1015,202 +1464,11 @@ void ThreadSocketHandler()
             uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
         }
 
-        //
-        // Find which sockets have data to receive
-        //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
-        }
-
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
-        }
-
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
-
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
-        }
-
-        //
-        // Accept new connections
-        //
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
-        {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
-            {
-                AcceptConnection(hListenSocket);
-            }
-        }
-
-        //
-        // Service each socket
-        //
-        vector<CNode*> vNodesCopy;
-        {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->AddRef();
-        }
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
-        {
-            boost::this_thread::interruption_point();
-
-            //
-            // Receive
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
-            {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
-            }
-
-            //
-            // Send
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
-            {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    SocketSendData(pnode);
-            }
-
-            //
-            // Inactivity checking
-            //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-            }
-        }
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
-        }
+#ifdef HAVE_SYS_EPOLL_H
+        SocketEventsEpoll();
+#else
+        SocketEventsSelect();
+#endif
     }
 }
 
@@ -1623,11 +1881,31 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 }
 
 
-void ThreadMessageHandler()
+/** The most urgent class of message pnode has waiting, or MSG_CLASS_MAX */
+static int GetBestQueuedClass(const CNode* pnode)
 {
-    boost::mutex condition_mutex;
-    boost::unique_lock<boost::mutex> lock(condition_mutex);
+    for (int nClass = 0; nClass < MSG_CLASS_MAX; nClass++) {
+        if (pnode->nRecvQueued[nClass] > 0)
+            return nClass;
+    }
+    return MSG_CLASS_MAX;
+}
+
+static bool CompareBestQueuedClass(const std::pair<int, CNode*>& a, const std::pair<int, CNode*>& b)
+{
+    return a.first < b.first;
+}
 
+/**
+ * Process messages from, and send messages to, the connected nodes. Several
+ * of these threads run at once (-msghandlerthreads). A thread skips any node
+ * another one is working on, so that each node's messages are still handled
+ * one at a time and in order, while a node that is slow to serve (a large
+ * getdata, or a transaction with expensive proofs) does not hold up the
+ * others.
+ */
+void ThreadMessageHandler(int nThread)
+{
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (true)
     {
@@ -1640,18 +1918,38 @@ void ThreadMessageHandler()
             }
         }
 
-        // Poll the connected nodes for messages
+        // Poll the connected nodes for messages. Only one thread trickles,
+        // so that the trickle rate does not depend on the number of threads.
         CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
+        if (!vNodesCopy.empty() && nThread == 0)
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
 
         bool fSleep = true;
 
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        // Start at a different node in each thread, to spread them out, but
+        // serve the nodes by the most urgent class of message they have
+        // waiting. The queue counts change under us, so they are read once.
+        vector<std::pair<int, CNode*> > vNodesByClass;
+        vNodesByClass.reserve(vNodesCopy.size());
+        size_t nStart = vNodesCopy.empty() ? 0 : GetRand(vNodesCopy.size());
+        for (size_t i = 0; i < vNodesCopy.size(); i++) {
+            CNode* pnode = vNodesCopy[(nStart + i) % vNodesCopy.size()];
+            vNodesByClass.push_back(std::make_pair(GetBestQueuedClass(pnode), pnode));
+        }
+        std::stable_sort(vNodesByClass.begin(), vNodesByClass.end(), CompareBestQueuedClass);
+        vector<CNode*> vNodesOrdered;
+        vNodesOrdered.reserve(vNodesByClass.size());
+        for (size_t i = 0; i < vNodesByClass.size(); i++)
+            vNodesOrdered.push_back(vNodesByClass[i].second);
+        BOOST_FOREACH(CNode* pnode, vNodesOrdered)
         {
             if (pnode->fDisconnect)
                 continue;
 
+            TRY_LOCK(pnode->cs_msgHandler, lockHandler);
+            if (!lockHandler)
+                continue;
+
             // Receive messages
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
@@ -1686,8 +1984,10 @@ void ThreadMessageHandler()
                 pnode->Release();
         }
 
-        if (fSleep)
+        if (fSleep) {
+            boost::unique_lock<boost::mutex> lock(messageHandlerMutex);
             messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
+        }
     }
 }
 
@@ -1870,6 +2170,21 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     Discover(threadGroup);
 
+#ifdef HAVE_SYS_EPOLL_H
+    if (epollfd == -1) {
+        epollfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollfd == -1)
+            throw std::runtime_error(strprintf("%s: epoll_create1 failed: %s", __func__, NetworkErrorString(WSAGetLastError())));
+        BOOST_FOREACH(ListenSocket& hListenSocket, vhListenSocket) {
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = &hListenSocket;
+            if (epoll_ctl(epollfd, EPOLL_CTL_ADD, hListenSocket.socket, &event) != 0)
+                LogPrintf("epoll_ctl failed for listening socket: %s\n", NetworkErrorString(WSAGetLastError()));
+        }
+    }
+#endif
+
     //
     // Start threads
     //
@@ -1892,7 +2207,9 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    int nMessageHandlerThreads = std::max(1, std::min(MAX_MESSAGE_HANDLER_THREADS, (int)GetArg("-msghandlerthreads", DEFAULT_MESSAGE_HANDLER_THREADS)));
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand", boost::function<void()>(boost::bind(&ThreadMessageHandler, i))));
 
     // Dump network addresses
     scheduler.scheduleEvery(&DumpAddresses, DUMP_ADDRESSES_INTERVAL);
@@ -1939,6 +2256,11 @@ public:
         vNodes.clear();
         vNodesDisconnected.clear();
         vhListenSocket.clear();
+#ifdef HAVE_SYS_EPOLL_H
+        if (epollfd != -1)
+            close(epollfd);
+        epollfd = -1;
+#endif
         delete semOutbound;
         semOutbound = NULL;
         delete pnodeLocalHost;
@@ -1960,14 +2282,12 @@ instance_of_cnetcleanup;
 
 void RelayTransaction(const CTransaction& tx)
 {
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
-    ss << tx;
-    RelayTransaction(tx, ss);
+    RelayTransaction(MakeTransactionRef(tx));
 }
 
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
+void RelayTransaction(const CTransactionRef& ptx)
 {
+    const CTransaction& tx = *ptx;
     CInv inv(MSG_TX, tx.GetHash());
     {
         LOCK(cs_mapRelay);
@@ -1978,8 +2298,9 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Keep a reference to the transaction, shared with the mempool,
+        // rather than a serialized copy of it
+        mapRelay.insert(std::make_pair(inv, ptx));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
     LOCK(cs_vNodes);
@@ -2198,6 +2519,11 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     nPingUsecStart = 0;
     nPingUsecTime = 0;
     fPingQueued = false;
+    for (int i = 0; i < MSG_CLASS_MAX; i++) {
+        nRecvQueued[i] = 0;
+        nRecvProcessed[i] = 0;
+        nRecvWaitTime[i] = 0;
+    }
     nMinPingUsecTime = std::numeric_limits<int64_t>::max();
 
     {
@@ -2310,13 +2636,43 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    std::shared_ptr<CSerializeData> pmsg = std::make_shared<CSerializeData>();
+    ssSend.GetAndClear(*pmsg);
+    vSendMsg.push_back(pmsg);
+    nSendSize += pmsg->size();
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (vSendMsg.size() == 1)
         SocketSendData(this);
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
 }
+
+void CNode::PushSerializedMessage(const CSerializeDataRef& pmsg)
+{
+    assert(pmsg->size() >= CMessageHeader::HEADER_SIZE);
+    LOCK(cs_vSend);
+    std::string strCommand(&(*pmsg)[MESSAGE_START_SIZE], CMessageHeader::COMMAND_SIZE);
+    LogPrint("net", "sending: %s (%d bytes, shared) peer=%d\n", SanitizeString(strCommand.c_str()),
+        pmsg->size() - CMessageHeader::HEADER_SIZE, id);
+
+    vSendMsg.push_back(pmsg);
+    nSendSize += pmsg->size();
+
+    // If write queue empty, attempt "optimistic write"
+    if (vSendMsg.size() == 1)
+        SocketSendData(this);
+}
+
+void WriteMessageHeader(CSerializeData& vMsg, const char* pszCommand)
+{
+    assert(vMsg.size() >= CMessageHeader::HEADER_SIZE);
+    CMessageHeader hdr(Params().MessageStart(), pszCommand, vMsg.size() - CMessageHeader::HEADER_SIZE);
+    uint256 hash = Hash(vMsg.begin() + CMessageHeader::HEADER_SIZE, vMsg.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+
+    CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
+    ssHeader << hdr;
+    assert(ssHeader.size() == CMessageHeader::HEADER_SIZE);
+    memcpy(&vMsg[0], &ssHeader[0], CMessageHeader::HEADER_SIZE);
+}
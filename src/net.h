@@ -12,6 +12,7 @@
 #include "limitedmap.h"
 #include "mruset.h"
 #include "netbase.h"
+#include "primitives/transaction.h"
 #include "protocol.h"
 #include "random.h"
 #include "streams.h"
@@ -19,6 +20,7 @@
 #include "uint256.h"
 #include "utilstrencodings.h"
 
+#include <atomic>
 #include <deque>
 #include <stdint.h>
 
@@ -63,6 +65,10 @@ static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
 static const size_t SETASKFOR_MAX_SZ = 2 * MAX_INV_SZ;
 /** The maximum number of peer connections to maintain. */
 static const unsigned int DEFAULT_MAX_PEER_CONNECTIONS = 125;
+/** Default for -msghandlerthreads, the number of threads processing peer messages */
+static const int DEFAULT_MESSAGE_HANDLER_THREADS = 4;
+/** Maximum number of message handler threads */
+static const int MAX_MESSAGE_HANDLER_THREADS = 16;
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
@@ -82,6 +88,28 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
 bool StopNode();
 void SocketSendData(CNode *pnode);
 
+/** A complete serialized message, which may be queued for several peers at once */
+typedef std::shared_ptr<const CSerializeData> CSerializeDataRef;
+
+/**
+ * Fill in the message header at the start of vMsg, which must have room for
+ * it followed by the payload of a pszCommand message.
+ */
+void WriteMessageHeader(CSerializeData& vMsg, const char* pszCommand);
+
+/** Serialize obj as a complete pszCommand message, for CNode::PushSerializedMessage */
+template <typename T>
+CSerializeDataRef MakeSerializedMessage(const char* pszCommand, const T& obj)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.resize(CMessageHeader::HEADER_SIZE);
+    ss << obj;
+    std::shared_ptr<CSerializeData> pmsg = std::make_shared<CSerializeData>();
+    ss.GetAndClear(*pmsg);
+    WriteMessageHeader(*pmsg, pszCommand);
+    return pmsg;
+}
+
 typedef int NodeId;
 
 struct CombinerAll
@@ -150,7 +178,7 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CTransactionRef> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
@@ -169,6 +197,25 @@ struct LocalServiceInfo {
 extern CCriticalSection cs_mapLocalHost;
 extern std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
 
+/**
+ * Classes of received messages, in order of priority. Peers are served by
+ * the most urgent class they have waiting, and within a peer a message may
+ * be processed ahead of earlier transaction and address traffic of a lower
+ * priority, but never ahead of a control message (the version handshake,
+ * pings, filters and anything unknown), which keep their order.
+ */
+enum MessageClass {
+    MSG_CLASS_BLOCK = 0,    //!< block, and inv and getdata for blocks
+    MSG_CLASS_HEADERS,      //!< headers, getheaders and getblocks
+    MSG_CLASS_CONTROL,      //!< everything else
+    MSG_CLASS_TX,           //!< tx, and inv and getdata for transactions
+    MSG_CLASS_ADDR,         //!< addr and getaddr
+    MSG_CLASS_MAX
+};
+
+/** Name of a message class, as shown in getpeerinfo */
+const char* GetMessageClassName(int nClass);
+
 class CNodeStats
 {
 public:
@@ -189,6 +236,12 @@ public:
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    //! Complete messages waiting to be processed, per MessageClass
+    int nRecvQueueDepth[MSG_CLASS_MAX];
+    //! Messages processed, per MessageClass
+    uint64_t nRecvProcessed[MSG_CLASS_MAX];
+    //! Average time processed messages waited after being received, in seconds
+    double dRecvWaitTime[MSG_CLASS_MAX];
 };
 
 
@@ -206,6 +259,7 @@ public:
     unsigned int nDataPos;
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
+    MessageClass nClass;            // set once the message is complete
 
     CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), hdr(pchMessageStartIn), vRecv(nTypeIn, nVersionIn) {
         hdrbuf.resize(24);
@@ -213,6 +267,7 @@ public:
         nHdrPos = 0;
         nDataPos = 0;
         nTime = 0;
+        nClass = MSG_CLASS_CONTROL;
     }
 
     bool complete() const
@@ -247,12 +302,22 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSerializeDataRef> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    // Held by the message handler thread working on this node, so that its
+    // messages are processed, and its replies generated, in order
+    CCriticalSection cs_msgHandler;
+    // Per MessageClass: complete messages waiting in vRecvMsg, messages
+    // processed, and the total time (in microseconds) those waited. Atomic
+    // so the message handler and getpeerinfo can read them without
+    // cs_vRecvMsg.
+    std::atomic<int> nRecvQueued[MSG_CLASS_MAX];
+    std::atomic<uint64_t> nRecvProcessed[MSG_CLASS_MAX];
+    std::atomic<int64_t> nRecvWaitTime[MSG_CLASS_MAX];
     uint64_t nRecvBytes;
     int nRecvVersion;
 
@@ -309,6 +374,9 @@ public:
     // flood relay
     std::vector<CAddress> vAddrToSend;
     CRollingBloomFilter addrKnown;
+    // Guards vAddrToSend and addrKnown, which other nodes' message handler
+    // threads push relayed addresses to
+    CCriticalSection cs_addrSend;
     bool fGetAddr;
     std::set<uint256> setKnown;
 
@@ -391,11 +459,13 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_addrSend);
         addrKnown.insert(addr.GetKey());
     }
 
     void PushAddress(const CAddress& addr)
     {
+        LOCK(cs_addrSend);
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
@@ -437,6 +507,9 @@ public:
     // TODO: Document the precondition of this function.  Is cs_vSend locked?
     void EndMessage() UNLOCK_FUNCTION(cs_vSend);
 
+    // Queue a message built with WriteMessageHeader, without copying it
+    void PushSerializedMessage(const CSerializeDataRef& pmsg);
+
     void PushVersion();
 
 
@@ -638,9 +711,8 @@ public:
 
 
 
-class CTransaction;
 void RelayTransaction(const CTransaction& tx);
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
+void RelayTransaction(const CTransactionRef& ptx);
 
 /** Access to the (IP) address database (peers.dat) */
 class CAddrDB
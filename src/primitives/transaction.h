@@ -347,6 +347,7 @@ public:
 
     /** Convert a CMutableTransaction into a CTransaction. */
     CTransaction(const CMutableTransaction &tx);
+    CTransaction(CMutableTransaction &&tx);
 
     CTransaction& operator=(const CTransaction& tx);
 
@@ -448,4 +449,13 @@ struct CMutableTransaction
     uint256 GetHash() const;
 };
 
+/**
+ * Reference-counted handle to an immutable transaction. Blocks, the mempool
+ * and relay share one instance of a transaction through it instead of each
+ * holding a deep copy of it (and of its JoinSplits).
+ */
+typedef std::shared_ptr<const CTransaction> CTransactionRef;
+static inline CTransactionRef MakeTransactionRef() { return std::make_shared<const CTransaction>(); }
+template <typename Tx> static inline CTransactionRef MakeTransactionRef(Tx&& txIn) { return std::make_shared<const CTransaction>(std::forward<Tx>(txIn)); }
+
 #endif // BITCOIN_PRIMITIVES_TRANSACTION_H
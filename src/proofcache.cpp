@@ -0,0 +1,96 @@
+// Copyright (c) 2018 The Bitcoin Private developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "proofcache.h"
+
+#include "hash.h"
+#include "primitives/transaction.h"
+#include "random.h"
+#include "util.h"
+
+#include <set>
+
+#include <boost/thread.hpp>
+
+namespace {
+
+class CProofCache
+{
+private:
+    //! Per-process salt, so that cache keys can't be precomputed by peers
+    uint256 nonce;
+    std::set<uint256> setValid;
+    boost::shared_mutex cs_proofcache;
+
+public:
+    CProofCache()
+    {
+        GetRandBytes(nonce.begin(), 32);
+    }
+
+    uint256 ComputeKey(const JSDescription& joinsplit, const uint256& joinSplitPubKey)
+    {
+        CHashWriter ss(SER_GETHASH, 0);
+        ss << nonce;
+        ss << joinsplit.proof;
+        ss << joinsplit.anchor;
+        ss << joinsplit.nullifiers;
+        ss << joinsplit.commitments;
+        ss << joinsplit.macs;
+        ss << joinsplit.randomSeed;
+        ss << joinsplit.vpub_old;
+        ss << joinsplit.vpub_new;
+        ss << joinSplitPubKey;
+        return ss.GetHash();
+    }
+
+    bool Get(const uint256& key)
+    {
+        boost::shared_lock<boost::shared_mutex> lock(cs_proofcache);
+        return setValid.count(key) != 0;
+    }
+
+    void Set(const uint256& key)
+    {
+        int64_t nMaxCacheSize = GetArg("-maxproofcachesize", DEFAULT_MAX_PROOF_CACHE_SIZE);
+        if (nMaxCacheSize <= 0) return;
+
+        boost::unique_lock<boost::shared_mutex> lock(cs_proofcache);
+
+        while (static_cast<int64_t>(setValid.size()) >= nMaxCacheSize)
+        {
+            // Evict a random entry, as in CSignatureCache. The keys are
+            // salted hashes, so this is uniform over the entries.
+            std::set<uint256>::iterator it = setValid.lower_bound(GetRandHash());
+            if (it == setValid.end())
+                it = setValid.begin();
+            setValid.erase(it);
+        }
+
+        setValid.insert(key);
+    }
+};
+
+CProofCache& GetProofCache()
+{
+    static CProofCache proofCache;
+    return proofCache;
+}
+
+}
+
+uint256 GetProofCacheKey(const JSDescription& joinsplit, const uint256& joinSplitPubKey)
+{
+    return GetProofCache().ComputeKey(joinsplit, joinSplitPubKey);
+}
+
+bool IsProofCached(const uint256& key)
+{
+    return GetProofCache().Get(key);
+}
+
+void AddProofToCache(const uint256& key)
+{
+    GetProofCache().Set(key);
+}
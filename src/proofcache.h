@@ -0,0 +1,29 @@
+// Copyright (c) 2018 The Bitcoin Private developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_PROOFCACHE_H
+#define BITCOIN_PROOFCACHE_H
+
+#include "uint256.h"
+
+class JSDescription;
+
+/** Default for -maxproofcachesize, maximum number of verified JoinSplit proofs to remember */
+static const unsigned int DEFAULT_MAX_PROOF_CACHE_SIZE = 50000;
+
+/**
+ * Valid JoinSplit proof cache, to avoid doing expensive zk-SNARK
+ * verification twice for every shielded transaction (once when accepted
+ * into memory pool, and again when accepted into the block chain).
+ *
+ * Entries are salted hashes of a proof together with all of its public
+ * inputs (anchor, nullifiers, commitments, MACs, random seed, public
+ * values and the transaction's joinSplitPubKey), so a hit means exactly
+ * this statement has been proven before.
+ */
+uint256 GetProofCacheKey(const JSDescription& joinsplit, const uint256& joinSplitPubKey);
+bool IsProofCached(const uint256& key);
+void AddProofToCache(const uint256& key);
+
+#endif // BITCOIN_PROOFCACHE_H
@@ -3,11 +3,13 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "blockcache.h"
 #include "checkpoints.h"
 #include "consensus/validation.h"
 #include "main.h"
 #include "primitives/transaction.h"
 #include "rpcserver.h"
+#include "support/allocators/pool.h"
 #include "sync.h"
 #include "util.h"
 
@@ -119,8 +121,9 @@ UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool tx
     result.push_back(Pair("version", block.nVersion));
     result.push_back(Pair("merkleroot", block.hashMerkleRoot.GetHex()));
     UniValue txs(UniValue::VARR);
-    BOOST_FOREACH(const CTransaction&tx, block.vtx)
+    BOOST_FOREACH(const CTransactionRef& ptx, block.vtx)
     {
+        const CTransaction& tx = *ptx;
         if(txDetails)
         {
             UniValue objTx(UniValue::VOBJ);
@@ -204,10 +207,9 @@ UniValue mempoolToJSON(bool fVerbose = false)
     {
         LOCK(mempool.cs);
         UniValue o(UniValue::VOBJ);
-        BOOST_FOREACH(const PAIRTYPE(uint256, CTxMemPoolEntry)& entry, mempool.mapTx)
+        BOOST_FOREACH(const CTxMemPoolEntry& e, mempool.mapTx)
         {
-            const uint256& hash = entry.first;
-            const CTxMemPoolEntry& e = entry.second;
+            const uint256& hash = e.GetTx().GetHash();
             UniValue info(UniValue::VOBJ);
             info.push_back(Pair("size", (int)e.GetTxSize()));
             info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
@@ -500,6 +502,102 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
     return ret;
 }
 
+UniValue getcoincacheinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getcoincacheinfo\n"
+            "\nReturns details about the in-memory cache of the unspent transaction output set.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"policy\": \"xxxx\",       (string) How entries are chosen for eviction when the cache is full\n"
+            "  \"usage\": n,             (numeric) Current memory usage in bytes\n"
+            "  \"limit\": n,             (numeric) Memory usage at which the cache is trimmed (-dbcache)\n"
+            "  \"lowwater\": n,          (numeric) Memory usage it is trimmed to (-dbcachelowwater)\n"
+            "  \"entries\": n,           (numeric) Number of cached transactions\n"
+            "  \"hits\": n,              (numeric) Lookups answered from the cache\n"
+            "  \"misses\": n,            (numeric) Lookups passed on to the database\n"
+            "  \"hitrate\": x.xxx,       (numeric) hits / (hits + misses)\n"
+            "  \"evicted\": n,           (numeric) Entries evicted to stay within the limit\n"
+            "  \"trims\": n,             (numeric) Number of times the cache had to be trimmed\n"
+            "  \"writebacks\": n,        (numeric) Number of times modified entries were written to the database\n"
+            "  \"poolused\": n,          (numeric) Bytes handed out by the memory pool coins are allocated from\n"
+            "  \"poolreserved\": n       (numeric) Bytes the memory pool holds from the system\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getcoincacheinfo", "")
+            + HelpExampleRpc("getcoincacheinfo", "")
+        );
+
+    LOCK(cs_main);
+    const CCoinsCacheStats& stats = pcoinsTip->GetCacheStats();
+    uint64_t nLookups = stats.nHits + stats.nMisses;
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("policy", "lru"));
+    ret.push_back(Pair("usage", (int64_t)pcoinsTip->DynamicMemoryUsage()));
+    ret.push_back(Pair("limit", (int64_t)nCoinCacheUsage));
+    ret.push_back(Pair("lowwater", (int64_t)(nCoinCacheUsage / 100 * nCoinCacheLowWater)));
+    ret.push_back(Pair("entries", (int64_t)pcoinsTip->GetCacheSize()));
+    ret.push_back(Pair("hits", (int64_t)stats.nHits));
+    ret.push_back(Pair("misses", (int64_t)stats.nMisses));
+    ret.push_back(Pair("hitrate", nLookups ? (double)stats.nHits / nLookups : 0.0));
+    ret.push_back(Pair("evicted", (int64_t)stats.nEvicted));
+    ret.push_back(Pair("trims", (int64_t)stats.nTrims));
+    ret.push_back(Pair("writebacks", (int64_t)stats.nWriteBacks));
+    ret.push_back(Pair("poolused", (int64_t)PoolMemory::Instance().GetUsedBytes()));
+    ret.push_back(Pair("poolreserved", (int64_t)PoolMemory::Instance().GetChunkBytes()));
+    return ret;
+}
+
+static UniValue BlockCacheKindToJSON(const CBlockCacheStats& stats, BlockCacheKind kind)
+{
+    uint64_t nLookups = stats.nHits[kind] + stats.nMisses[kind];
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("hits", (int64_t)stats.nHits[kind]));
+    ret.push_back(Pair("misses", (int64_t)stats.nMisses[kind]));
+    ret.push_back(Pair("hitrate", nLookups ? (double)stats.nHits[kind] / nLookups : 0.0));
+    return ret;
+}
+
+UniValue getblockcacheinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getblockcacheinfo\n"
+            "\nReturns details about the cache of recently served blocks and header batches.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"usage\": n,             (numeric) Size of the cached messages in bytes\n"
+            "  \"limit\": n,             (numeric) Size the cache is kept within (-blockcachesize)\n"
+            "  \"entries\": n,           (numeric) Number of cached blocks and header batches\n"
+            "  \"evicted\": n,           (numeric) Entries evicted to stay within the limit\n"
+            "  \"blocks\": {             (json object) Lookups of blocks, by peers, REST and ZMQ\n"
+            "    \"hits\": n,            (numeric) Lookups answered from the cache\n"
+            "    \"misses\": n,          (numeric) Lookups that read the block from disk\n"
+            "    \"hitrate\": x.xxx      (numeric) hits / (hits + misses)\n"
+            "  },\n"
+            "  \"headers\": {            (json object) Lookups of getheaders replies, as for blocks\n"
+            "    ...\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getblockcacheinfo", "")
+            + HelpExampleRpc("getblockcacheinfo", "")
+        );
+
+    CBlockCacheStats stats = GetBlockCacheStats();
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("usage", (int64_t)stats.nBytes));
+    ret.push_back(Pair("limit", (int64_t)stats.nMaxBytes));
+    ret.push_back(Pair("entries", (int64_t)stats.nEntries));
+    ret.push_back(Pair("evicted", (int64_t)stats.nEvicted));
+    ret.push_back(Pair("blocks", BlockCacheKindToJSON(stats, BLOCK_CACHE_BLOCK)));
+    ret.push_back(Pair("headers", BlockCacheKindToJSON(stats, BLOCK_CACHE_HEADERS)));
+    return ret;
+}
+
 UniValue gettxout(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -841,6 +939,14 @@ UniValue mempoolInfoToJSON()
     ret.push_back(Pair("size", (int64_t) mempool.size()));
     ret.push_back(Pair("bytes", (int64_t) mempool.GetTotalTxSize()));
     ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
+    size_t maxmempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    ret.push_back(Pair("maxmempool", (int64_t) maxmempool));
+    ret.push_back(Pair("mempoolminfee", ValueFromAmount(mempool.GetMinFee(maxmempool).GetFeePerK())));
+
+    uint64_t nScriptCacheHits, nScriptCacheMisses;
+    GetScriptExecutionCacheStats(nScriptCacheHits, nScriptCacheMisses);
+    ret.push_back(Pair("scriptcachehits", nScriptCacheHits));
+    ret.push_back(Pair("scriptcachemisses", nScriptCacheMisses));
 
     return ret;
 }
@@ -856,6 +962,10 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
             "  \"size\": xxxxx                (numeric) Current tx count\n"
             "  \"bytes\": xxxxx               (numeric) Sum of all tx sizes\n"
             "  \"usage\": xxxxx               (numeric) Total memory usage for the mempool\n"
+            "  \"maxmempool\": xxxxx          (numeric) Maximum memory usage for the mempool\n"
+            "  \"mempoolminfee\": xxxxx       (numeric) Minimum fee for tx to be accepted\n"
+            "  \"scriptcachehits\": xxxxx     (numeric) Transactions connected in blocks whose scripts were verified on mempool acceptance\n"
+            "  \"scriptcachemisses\": xxxxx   (numeric) Transactions connected in blocks whose scripts had to be verified\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getmempoolinfo", "")
@@ -865,6 +975,41 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
     return mempoolInfoToJSON();
 }
 
+UniValue loadmempool(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "loadmempool\n"
+            "\nAdds the transactions saved in mempool.dat to the mempool, as on start.\n"
+            "Transactions that are no longer valid or have expired are skipped.\n"
+            "\nExamples:\n"
+            + HelpExampleCli("loadmempool", "")
+            + HelpExampleRpc("loadmempool", "")
+        );
+
+    if (!LoadMempool())
+        throw JSONRPCError(RPC_MISC_ERROR, "Unable to load mempool from disk");
+
+    return NullUniValue;
+}
+
+UniValue savemempool(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "savemempool\n"
+            "\nDumps the mempool to disk, to be loaded again on the next start.\n"
+            "\nExamples:\n"
+            + HelpExampleCli("savemempool", "")
+            + HelpExampleRpc("savemempool", "")
+        );
+
+    if (!DumpMempool())
+        throw JSONRPCError(RPC_MISC_ERROR, "Unable to dump mempool to disk");
+
+    return NullUniValue;
+}
+
 UniValue invalidateblock(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
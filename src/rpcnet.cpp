@@ -105,7 +105,16 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"whitelisted\": true|false, (boolean) Whether the peer is whitelisted\n"
+            "    \"recvqueue\": {            (json object) Received messages, per priority class\n"
+            "      \"class\": {               (json object) block, headers, control, tx or addr\n"
+            "        \"depth\": n,            (numeric) Messages waiting to be processed\n"
+            "        \"processed\": n,        (numeric) Messages processed\n"
+            "        \"avgwait\": n,          (numeric) Average time processed messages waited, in seconds\n"
+            "      },\n"
+            "      ...\n"
+            "    }\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -157,6 +166,15 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             obj.push_back(Pair("inflight", heights));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
+        UniValue recvqueue(UniValue::VOBJ);
+        for (int i = 0; i < MSG_CLASS_MAX; i++) {
+            UniValue queue(UniValue::VOBJ);
+            queue.push_back(Pair("depth", stats.nRecvQueueDepth[i]));
+            queue.push_back(Pair("processed", stats.nRecvProcessed[i]));
+            queue.push_back(Pair("avgwait", stats.dRecvWaitTime[i]));
+            recvqueue.push_back(Pair(GetMessageClassName(i), queue));
+        }
+        obj.push_back(Pair("recvqueue", recvqueue));
 
         ret.push_back(obj);
     }
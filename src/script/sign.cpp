@@ -144,11 +144,11 @@ bool ProduceSignature(const BaseSignatureCreator& creator, const CScript& fromPu
         CScript witnessscript = scriptSig;
         txnouttype subType;
         solved = solved && SignStep(creator, witnessscript, scriptSig, subType) && subType != TX_SCRIPTHASH && subType != TX_WITNESS_V0_SCRIPTHASH && subType != TX_WITNESS_V0_KEYHASH;
-        scriptSig << static_cast<valtype>(witnessscript);
+        scriptSig << ToByteVector(witnessscript);
     }
 
     if (P2SH) {
-        scriptSig << static_cast<valtype>(subscript);
+        scriptSig << ToByteVector(subscript);
     }
 
     // Test solution
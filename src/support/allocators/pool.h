@@ -0,0 +1,161 @@
+// Copyright (c) 2018 The Bitcoin Private developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SUPPORT_ALLOCATORS_POOL_H
+#define BITCOIN_SUPPORT_ALLOCATORS_POOL_H
+
+#include <stddef.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <set>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/once.hpp>
+
+//! Allocations are rounded up to a multiple of this, which is also their alignment
+static const size_t POOL_ALIGN = 16;
+//! Largest allocation served from the pool; larger ones go to the system allocator
+static const size_t POOL_MAX_BLOCK = 256;
+//! Size of the chunks the pool carves allocations from
+static const size_t POOL_CHUNK_SIZE = 256 << 10;
+//! Size and alignment of the chunks when they are backed by huge pages (one x86-64 huge page)
+static const size_t POOL_HUGE_CHUNK_SIZE = 2 << 20;
+
+/**
+ * Thread-safe pool of small, fixed-size memory blocks, used for the many
+ * small allocations the coins cache makes (hash map nodes and output
+ * vectors).
+ *
+ * Each size class carves its blocks out of its own chunks and keeps
+ * released blocks on a free list per chunk, so they cost no malloc header,
+ * and releasing a large map only pushes its nodes onto free lists. New
+ * blocks come from the lowest chunk with room, which lets the others
+ * drain; a chunk is returned to the system as soon as all of its blocks
+ * have been released, except for the one each class is allocating from.
+ * Size classes have their own locks. Optionally the chunks are backed by
+ * transparent huge pages, which cuts TLB misses on large caches.
+ */
+class PoolMemory
+{
+public:
+    static PoolMemory& Instance()
+    {
+        boost::call_once(PoolMemory::CreateInstance, PoolMemory::init_flag);
+        return *PoolMemory::_instance;
+    }
+
+    void* Allocate(size_t size);
+    void Deallocate(void* p, size_t size);
+
+    /** Back chunks allocated from now on by huge pages, if the OS supports it. */
+    bool SetHugePages(bool fHugePages);
+
+    //! Bytes of blocks currently handed out
+    size_t GetUsedBytes();
+    //! Bytes of chunks currently held
+    size_t GetChunkBytes();
+    //! Bytes of chunks currently held but not handed out
+    size_t GetFreeBytes();
+
+private:
+    PoolMemory();
+
+    static void CreateInstance()
+    {
+        // Created on first use, like LockedPageManager, and never destroyed:
+        // static objects that allocate from it may be destroyed after any
+        // local static would be.
+        PoolMemory::_instance = new PoolMemory();
+    }
+
+    static PoolMemory* _instance;
+    static boost::once_flag init_flag;
+
+    struct Chunk
+    {
+        char* begin;
+        char* end;
+        bool fHuge;
+        //! Never used part of the chunk
+        char* pos;
+        //! Released blocks
+        void* pFree;
+        //! Number of blocks handed out
+        size_t nBlocks;
+    };
+
+    //! Chunks and free blocks of one size class
+    struct Bin
+    {
+        boost::mutex mutex;
+        std::map<char*, Chunk> mapChunks;
+        //! Chunk allocations are served from
+        Chunk* pCurrent;
+        //! Other chunks with room, by address
+        std::set<char*> setAvail;
+        size_t nUsed;
+        size_t nChunkBytes;
+    };
+
+    Chunk* NewChunk(Bin& bin, size_t nBlock);
+    void FreeChunk(const Chunk& chunk);
+
+    //! One bin per multiple of POOL_ALIGN
+    Bin vBins[POOL_MAX_BLOCK / POOL_ALIGN];
+    std::atomic<bool> fHugePages;
+};
+
+/**
+ * Allocator that serves single small allocations from PoolMemory and
+ * everything else from std::allocator. It is stateless, so containers
+ * using it can be swapped and moved freely.
+ */
+template <typename T>
+struct pool_allocator : public std::allocator<T> {
+    // MSVC8 default copy constructor is broken
+    typedef std::allocator<T> base;
+    typedef typename base::size_type size_type;
+    typedef typename base::difference_type difference_type;
+    typedef typename base::pointer pointer;
+    typedef typename base::const_pointer const_pointer;
+    typedef typename base::reference reference;
+    typedef typename base::const_reference const_reference;
+    typedef typename base::value_type value_type;
+    pool_allocator() throw() {}
+    pool_allocator(const pool_allocator& a) throw() : base(a) {}
+    template <typename U>
+    pool_allocator(const pool_allocator<U>& a) throw() : base(a)
+    {
+    }
+    ~pool_allocator() throw() {}
+    template <typename _Other>
+    struct rebind {
+        typedef pool_allocator<_Other> other;
+    };
+
+    T* allocate(std::size_t n, const void* hint = 0)
+    {
+        static_assert(POOL_ALIGN % alignof(T) == 0, "pool blocks are not aligned enough");
+        if (n * sizeof(T) <= POOL_MAX_BLOCK)
+            return static_cast<T*>(PoolMemory::Instance().Allocate(n * sizeof(T)));
+        return std::allocator<T>::allocate(n, hint);
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        if (n * sizeof(T) <= POOL_MAX_BLOCK)
+            PoolMemory::Instance().Deallocate(p, n * sizeof(T));
+        else
+            std::allocator<T>::deallocate(p, n);
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const pool_allocator<T>&, const pool_allocator<U>&) { return true; }
+template <typename T, typename U>
+bool operator!=(const pool_allocator<T>&, const pool_allocator<U>&) { return false; }
+
+#endif // BITCOIN_SUPPORT_ALLOCATORS_POOL_H
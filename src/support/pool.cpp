@@ -0,0 +1,192 @@
+// Copyright (c) 2018 The Bitcoin Private developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "support/allocators/pool.h"
+
+#if defined(HAVE_CONFIG_H)
+#include "config/bitcoin-config.h"
+#endif
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <new>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+PoolMemory* PoolMemory::_instance = NULL;
+boost::once_flag PoolMemory::init_flag = BOOST_ONCE_INIT;
+
+/** Index of the free list for blocks of the given size. */
+static inline size_t SizeClass(size_t size)
+{
+    return size == 0 ? 0 : (size - 1) / POOL_ALIGN;
+}
+
+PoolMemory::PoolMemory() : fHugePages(false)
+{
+    for (size_t i = 0; i < POOL_MAX_BLOCK / POOL_ALIGN; i++) {
+        vBins[i].pCurrent = NULL;
+        vBins[i].nUsed = 0;
+        vBins[i].nChunkBytes = 0;
+    }
+}
+
+PoolMemory::Chunk* PoolMemory::NewChunk(Bin& bin, size_t nBlock)
+{
+    Chunk chunk;
+    chunk.begin = NULL;
+    chunk.fHuge = false;
+#if defined(MADV_HUGEPAGE) && defined(MAP_ANONYMOUS)
+    if (fHugePages) {
+        // mmap only aligns to the page size; map one huge page extra and
+        // trim both ends so the chunk can sit in a single huge page.
+        const size_t nMapped = 2 * POOL_HUGE_CHUNK_SIZE;
+        void* p = mmap(NULL, nMapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p != MAP_FAILED) {
+            char* pMapped = static_cast<char*>(p);
+            char* pAligned = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(pMapped) + POOL_HUGE_CHUNK_SIZE - 1) & ~(uintptr_t)(POOL_HUGE_CHUNK_SIZE - 1));
+            if (pAligned != pMapped)
+                munmap(pMapped, pAligned - pMapped);
+            munmap(pAligned + POOL_HUGE_CHUNK_SIZE, pMapped + nMapped - pAligned - POOL_HUGE_CHUNK_SIZE);
+            // Only a hint; the kernel falls back to normal pages if it must.
+            madvise(pAligned, POOL_HUGE_CHUNK_SIZE, MADV_HUGEPAGE);
+            chunk.begin = pAligned;
+            chunk.end = pAligned + POOL_HUGE_CHUNK_SIZE;
+            chunk.fHuge = true;
+        }
+    }
+#endif
+    if (!chunk.fHuge) {
+        chunk.begin = static_cast<char*>(::operator new(POOL_CHUNK_SIZE));
+        chunk.end = chunk.begin + POOL_CHUNK_SIZE;
+    }
+    // The tail that is not a whole block is never used.
+    chunk.end -= (chunk.end - chunk.begin) % nBlock;
+    chunk.pos = chunk.begin;
+    chunk.pFree = NULL;
+    chunk.nBlocks = 0;
+    bin.nChunkBytes += chunk.fHuge ? POOL_HUGE_CHUNK_SIZE : POOL_CHUNK_SIZE;
+    return &bin.mapChunks.insert(std::make_pair(chunk.begin, chunk)).first->second;
+}
+
+void PoolMemory::FreeChunk(const Chunk& chunk)
+{
+#if defined(MADV_HUGEPAGE) && defined(MAP_ANONYMOUS)
+    if (chunk.fHuge) {
+        munmap(chunk.begin, POOL_HUGE_CHUNK_SIZE);
+        return;
+    }
+#endif
+    ::operator delete(chunk.begin);
+}
+
+void* PoolMemory::Allocate(size_t size)
+{
+    assert(size <= POOL_MAX_BLOCK);
+    const size_t nClass = SizeClass(size);
+    const size_t nBlock = (nClass + 1) * POOL_ALIGN;
+    Bin& bin = vBins[nClass];
+
+    boost::mutex::scoped_lock lock(bin.mutex);
+    Chunk* chunk = bin.pCurrent;
+    if (chunk == NULL || (chunk->pFree == NULL && chunk->pos == chunk->end)) {
+        // The current chunk is full: move on to the lowest one with room.
+        if (bin.setAvail.empty()) {
+            chunk = NewChunk(bin, nBlock);
+        } else {
+            chunk = &bin.mapChunks.find(*bin.setAvail.begin())->second;
+            bin.setAvail.erase(bin.setAvail.begin());
+        }
+        bin.pCurrent = chunk;
+    }
+
+    void* p = chunk->pFree;
+    if (p != NULL) {
+        chunk->pFree = *static_cast<void**>(p);
+    } else {
+        p = chunk->pos;
+        chunk->pos += nBlock;
+    }
+    chunk->nBlocks++;
+    bin.nUsed += nBlock;
+    return p;
+}
+
+void PoolMemory::Deallocate(void* p, size_t size)
+{
+    if (p == NULL)
+        return;
+    const size_t nClass = SizeClass(size);
+    Bin& bin = vBins[nClass];
+    char* pBlock = static_cast<char*>(p);
+
+    boost::mutex::scoped_lock lock(bin.mutex);
+    std::map<char*, Chunk>::iterator it = bin.mapChunks.upper_bound(pBlock);
+    assert(it != bin.mapChunks.begin());
+    --it;
+    Chunk& chunk = it->second;
+    assert(pBlock < chunk.end);
+
+    *static_cast<void**>(p) = chunk.pFree;
+    chunk.pFree = p;
+    chunk.nBlocks--;
+    bin.nUsed -= (nClass + 1) * POOL_ALIGN;
+
+    if (&chunk == bin.pCurrent)
+        return;
+    if (chunk.nBlocks == 0) {
+        // Every block of the chunk is free again: give it back.
+        bin.setAvail.erase(chunk.begin);
+        bin.nChunkBytes -= chunk.fHuge ? POOL_HUGE_CHUNK_SIZE : POOL_CHUNK_SIZE;
+        FreeChunk(chunk);
+        bin.mapChunks.erase(it);
+    } else {
+        bin.setAvail.insert(chunk.begin);
+    }
+}
+
+bool PoolMemory::SetHugePages(bool fHugePagesIn)
+{
+#if defined(MADV_HUGEPAGE) && defined(MAP_ANONYMOUS)
+    fHugePages = fHugePagesIn;
+    return true;
+#else
+    return !fHugePagesIn;
+#endif
+}
+
+size_t PoolMemory::GetUsedBytes()
+{
+    size_t nUsed = 0;
+    for (size_t i = 0; i < POOL_MAX_BLOCK / POOL_ALIGN; i++) {
+        boost::mutex::scoped_lock lock(vBins[i].mutex);
+        nUsed += vBins[i].nUsed;
+    }
+    return nUsed;
+}
+
+size_t PoolMemory::GetChunkBytes()
+{
+    size_t nChunkBytes = 0;
+    for (size_t i = 0; i < POOL_MAX_BLOCK / POOL_ALIGN; i++) {
+        boost::mutex::scoped_lock lock(vBins[i].mutex);
+        nChunkBytes += vBins[i].nChunkBytes;
+    }
+    return nChunkBytes;
+}
+
+size_t PoolMemory::GetFreeBytes()
+{
+    size_t nFree = 0;
+    for (size_t i = 0; i < POOL_MAX_BLOCK / POOL_ALIGN; i++) {
+        boost::mutex::scoped_lock lock(vBins[i].mutex);
+        nFree += vBins[i].nChunkBytes - vBins[i].nUsed;
+    }
+    return nFree;
+}
@@ -4,6 +4,8 @@
 
 #include "util.h"
 
+#include "memusage.h"
+#include "support/allocators/pool.h"
 #include "support/allocators/secure.h"
 #include "test/test_bitcoin.h"
 
@@ -117,4 +119,78 @@ BOOST_AUTO_TEST_CASE(test_LockedPageManagerBase)
     BOOST_CHECK((last_unlock_len & (test_page_size-1)) == 0); // always unlock entire pages
 }
 
+BOOST_AUTO_TEST_CASE(pool_allocator_reuse)
+{
+    PoolMemory& pool = PoolMemory::Instance();
+    size_t nUsedBefore = pool.GetUsedBytes();
+
+    // Small blocks are rounded up to POOL_ALIGN, and freed blocks are reused
+    // for the next allocation of the same size class.
+    void* p = pool.Allocate(40);
+    BOOST_CHECK(reinterpret_cast<size_t>(p) % POOL_ALIGN == 0);
+    BOOST_CHECK_EQUAL(pool.GetUsedBytes(), nUsedBefore + 48);
+    pool.Deallocate(p, 40);
+    BOOST_CHECK_EQUAL(pool.GetUsedBytes(), nUsedBefore);
+    BOOST_CHECK(pool.Allocate(33) == p);
+    pool.Deallocate(p, 33);
+
+    // Vectors allocate small buffers from the pool and large ones elsewhere,
+    // and memusage accounts for both.
+    {
+        std::vector<uint64_t, pool_allocator<uint64_t> > v(3, 7);
+        BOOST_CHECK_EQUAL(pool.GetUsedBytes(), nUsedBefore + 32);
+        BOOST_CHECK_EQUAL(memusage::DynamicUsage(v), 32U);
+        v.reserve(POOL_MAX_BLOCK);
+        BOOST_CHECK_EQUAL(pool.GetUsedBytes(), nUsedBefore);
+        BOOST_CHECK_EQUAL(memusage::DynamicUsage(v), memusage::MallocUsage(POOL_MAX_BLOCK * sizeof(uint64_t)));
+        BOOST_CHECK_EQUAL(v[2], 7U);
+    }
+    BOOST_CHECK_EQUAL(pool.GetUsedBytes(), nUsedBefore);
+
+    // Many blocks span several chunks; nothing is lost when they are freed,
+    // and chunks are given back while other chunks are still in use.
+    size_t nChunkBytesBefore = pool.GetChunkBytes();
+    std::vector<void*> blocks;
+    for (size_t i = 0; i < 3 * POOL_CHUNK_SIZE / POOL_MAX_BLOCK; i++)
+        blocks.push_back(pool.Allocate(POOL_MAX_BLOCK));
+    BOOST_CHECK(pool.GetChunkBytes() >= nChunkBytesBefore + 2 * POOL_CHUNK_SIZE);
+    for (size_t i = 1; i < blocks.size(); i++)
+        pool.Deallocate(blocks[i], POOL_MAX_BLOCK);
+    BOOST_CHECK_EQUAL(pool.GetUsedBytes(), nUsedBefore + POOL_MAX_BLOCK);
+    BOOST_CHECK(pool.GetChunkBytes() <= nChunkBytesBefore + 2 * POOL_CHUNK_SIZE);
+    pool.Deallocate(blocks[0], POOL_MAX_BLOCK);
+    BOOST_CHECK_EQUAL(pool.GetUsedBytes(), nUsedBefore);
+    BOOST_CHECK(pool.GetChunkBytes() <= nChunkBytesBefore + POOL_CHUNK_SIZE);
+}
+
+BOOST_AUTO_TEST_CASE(pool_allocator_chunks)
+{
+    PoolMemory& pool = PoolMemory::Instance();
+    size_t nChunkBytesBefore = pool.GetChunkBytes();
+    size_t nFreeBefore = pool.GetFreeBytes();
+
+    // Blocks and free space always add up to whole chunks.
+    std::vector<void*> blocks;
+    for (size_t i = 0; i < 4 * POOL_CHUNK_SIZE / 64; i++)
+        blocks.push_back(pool.Allocate(64));
+    size_t nChunkBytesFull = pool.GetChunkBytes();
+    BOOST_CHECK(nChunkBytesFull >= nChunkBytesBefore + 3 * POOL_CHUNK_SIZE);
+    BOOST_CHECK_EQUAL(pool.GetUsedBytes() + pool.GetFreeBytes(), nChunkBytesFull);
+
+    // Freeing every other block leaves the chunks partly used: they are
+    // kept, and their free space is reported.
+    for (size_t i = 0; i < blocks.size(); i += 2)
+        pool.Deallocate(blocks[i], 64);
+    BOOST_CHECK_EQUAL(pool.GetChunkBytes(), nChunkBytesFull);
+    BOOST_CHECK(pool.GetFreeBytes() >= nFreeBefore + blocks.size() / 2 * 64);
+    BOOST_CHECK_EQUAL(memusage::PoolFreeUsage(), pool.GetFreeBytes());
+
+    // Once the rest is freed, the chunks are given back.
+    for (size_t i = 1; i < blocks.size(); i += 2)
+        pool.Deallocate(blocks[i], 64);
+    BOOST_CHECK(pool.GetChunkBytes() < nChunkBytesFull);
+    BOOST_CHECK(pool.GetChunkBytes() <= nChunkBytesBefore + POOL_CHUNK_SIZE);
+    BOOST_CHECK_EQUAL(pool.GetUsedBytes() + pool.GetFreeBytes(), pool.GetChunkBytes());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
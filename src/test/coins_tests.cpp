@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "coins.h"
+#include "coinsprefetch.h"
 #include "random.h"
 #include "script/standard.h"
 #include "uint256.h"
@@ -10,6 +11,7 @@
 #include "test/test_bitcoin.h"
 #include "consensus/validation.h"
 #include "main.h"
+#include "txdb.h"
 #include "undo.h"
 #include "pubkey.h"
 
@@ -143,11 +145,24 @@ public:
                      memusage::DynamicUsage(cacheAnchors) +
                      memusage::DynamicUsage(cacheNullifiers);
         for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
-            ret += it->second.coins.DynamicMemoryUsage();
+            ret += it->second.coins.DynamicMemoryUsage() + it->second.parent.DynamicMemoryUsage();
         }
         BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
     }
 
+    bool IsCached(const uint256& txid) const { return cacheCoins.count(txid) > 0; }
+};
+
+class CCoinsViewDBTest : public CCoinsViewDB
+{
+public:
+    CCoinsViewDBTest() : CCoinsViewDB("chainstate_test", 1 << 20, true, false) {}
+
+    //! Write a transaction's coins in the old format, one record per transaction
+    void WriteOldCoins(const uint256& txid, const CCoins& coins)
+    {
+        db.Write(std::make_pair('c', txid), coins);
+    }
 };
 
 }
@@ -726,6 +741,257 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(missed_an_entry);
 }
 
+BOOST_AUTO_TEST_CASE(coins_cache_trim)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+
+    std::vector<uint256> txids;
+    for (unsigned int i = 0; i < 100; i++) {
+        txids.push_back(GetRandHash());
+        CCoinsModifier coins = cache.ModifyCoins(txids.back());
+        coins->nVersion = 1;
+        coins->vout.resize(1);
+        coins->vout[0].nValue = i;
+    }
+    uint256 hashBlock = GetRandHash();
+    cache.SetBestBlock(hashBlock);
+
+    // Writing back keeps everything cached.
+    BOOST_CHECK(cache.WriteBack());
+    BOOST_CHECK(base.GetBestBlock() == hashBlock);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 100);
+    BOOST_CHECK_EQUAL(cache.GetCacheStats().nWriteBacks, 1);
+    cache.SelfTest();
+
+    // Keep using the first ten entries over a few blocks; modify the last ten.
+    for (unsigned int nBlock = 0; nBlock < 5; nBlock++) {
+        CCoinsViewCacheTest child(&cache);
+        for (unsigned int i = 0; i < 10; i++)
+            BOOST_CHECK(child.AccessCoins(txids[i]) != NULL);
+        BOOST_CHECK(child.Flush());
+    }
+    for (unsigned int i = 90; i < 100; i++)
+        cache.ModifyCoins(txids[i])->vout[0].nValue = 1000 + i;
+
+    // Evicting unmodified entries is enough here: the least recently used
+    // go, the recently used and modified ones stay, and nothing is written.
+    size_t nTarget = cache.DynamicMemoryUsage() / 2;
+    bool fWritten = true;
+    BOOST_CHECK(cache.Trim(nTarget, &fWritten));
+    BOOST_CHECK(!fWritten);
+    BOOST_CHECK(cache.DynamicMemoryUsage() <= nTarget);
+    for (unsigned int i = 0; i < 10; i++)
+        BOOST_CHECK(cache.IsCached(txids[i]));
+    for (unsigned int i = 90; i < 100; i++)
+        BOOST_CHECK(cache.IsCached(txids[i]));
+    BOOST_CHECK(cache.GetCacheStats().nEvicted > 0);
+    BOOST_CHECK_EQUAL(cache.GetCacheStats().nWriteBacks, 1);
+    cache.SelfTest();
+
+    // Evicting everything requires writing the modifications first.
+    hashBlock = GetRandHash();
+    cache.SetBestBlock(hashBlock);
+    BOOST_CHECK(cache.Trim(0, &fWritten));
+    BOOST_CHECK(fWritten);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 0);
+    BOOST_CHECK_EQUAL(cache.GetCacheStats().nWriteBacks, 2);
+    BOOST_CHECK_EQUAL(cache.GetCacheStats().nTrims, 2);
+    BOOST_CHECK(base.GetBestBlock() == hashBlock);
+    cache.SelfTest();
+
+    // Evicted entries are read back from the base.
+    for (unsigned int i = 0; i < 100; i++) {
+        const CCoins* coins = cache.AccessCoins(txids[i]);
+        BOOST_CHECK(coins != NULL);
+        BOOST_CHECK_EQUAL(coins->vout[0].nValue, (CAmount)(i < 90 ? i : 1000 + i));
+    }
+
+    // Once the modifications alone are over the target, they are written
+    // first, and the recently used entries survive the eviction.
+    for (unsigned int i = 40; i < 100; i++)
+        cache.ModifyCoins(txids[i])->vout[0].scriptPubKey.assign(1000, OP_TRUE);
+    {
+        CCoinsViewCacheTest child(&cache);
+        for (unsigned int i = 0; i < 10; i++)
+            BOOST_CHECK(child.AccessCoins(txids[i]) != NULL);
+        BOOST_CHECK(child.Flush());
+    }
+    nTarget = cache.DynamicMemoryUsage() / 2;
+    BOOST_CHECK(cache.Trim(nTarget, &fWritten));
+    BOOST_CHECK(fWritten);
+    BOOST_CHECK(cache.DynamicMemoryUsage() <= nTarget);
+    for (unsigned int i = 0; i < 10; i++)
+        BOOST_CHECK(cache.IsCached(txids[i]));
+    BOOST_CHECK_EQUAL(cache.GetCacheStats().nWriteBacks, 3);
+    cache.SelfTest();
+    for (unsigned int i = 40; i < 100; i++) {
+        const CCoins* coins = cache.AccessCoins(txids[i]);
+        BOOST_CHECK(coins != NULL);
+        BOOST_CHECK_EQUAL(coins->vout[0].scriptPubKey.size(), 1000U);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(coins_prefetch_lost_race)
+{
+    CCoinsViewTest base;
+    CCoinsViewPrefetch prefetch(&base, DEFAULT_PREFETCH_BLOCKS);
+    CCoinsViewCacheTest cache(&prefetch);
+
+    uint256 txid = GetRandHash();
+    {
+        CCoinsModifier coins = cache.ModifyCoins(txid);
+        coins->nVersion = 1;
+        coins->vout.resize(2);
+        coins->vout[0].nValue = 10;
+        coins->vout[1].nValue = 20;
+    }
+    cache.SetBestBlock(GetRandHash());
+    BOOST_CHECK(cache.Flush());
+
+    // The prefetch reads the coins, but the block being connected spends one
+    // of them and is written before the prefetch lands: it is dropped.
+    uint64_t nGen = prefetch.GetGeneration();
+    CCoins coinsRead;
+    BOOST_CHECK(base.GetCoins(txid, coinsRead));
+    BOOST_CHECK(cache.ModifyCoins(txid)->Spend(0));
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(!prefetch.AddPrefetchedCoins(txid, coinsRead, nGen));
+    BOOST_CHECK_EQUAL(nGen, prefetch.GetGeneration());
+    const CCoins* coins = cache.AccessCoins(txid);
+    BOOST_REQUIRE(coins != NULL);
+    BOOST_CHECK(!coins->IsAvailable(0));
+    BOOST_CHECK(coins->IsAvailable(1));
+
+    // A prefetch landing while the cache holds a newer, unwritten state is
+    // stored, but neither shadows that state nor survives writing it.
+    BOOST_CHECK(base.GetCoins(txid, coinsRead));
+    cache.ModifyCoins(txid)->vout[1].nValue = 30;
+    BOOST_CHECK(prefetch.AddPrefetchedCoins(txid, coinsRead, nGen));
+    BOOST_CHECK_EQUAL(cache.AccessCoins(txid)->vout[1].nValue, 30);
+    BOOST_CHECK(cache.Flush());
+    coins = cache.AccessCoins(txid);
+    BOOST_REQUIRE(coins != NULL);
+    BOOST_CHECK(!coins->IsAvailable(0));
+    BOOST_CHECK_EQUAL(coins->vout[1].nValue, 30);
+}
+
+BOOST_FIXTURE_TEST_CASE(coins_db_upgrade, TestingSetup)
+{
+    CCoinsViewDBTest db;
+
+    std::map<uint256, CCoins> expected;
+    for (unsigned int i = 0; i < 50; i++) {
+        CCoins coins;
+        coins.fCoinBase = (i % 10 == 0);
+        coins.nHeight = i;
+        coins.nVersion = 1 + i % 2;
+        coins.vout.resize(1 + insecure_rand() % 5);
+        for (unsigned int n = 0; n < coins.vout.size(); n++) {
+            coins.vout[n].nValue = insecure_rand() % 1000000;
+            coins.vout[n].scriptPubKey.assign(insecure_rand() & 0x3F, 0);
+        }
+        // Leave some outputs spent, but never the last one.
+        if (coins.vout.size() > 1 && insecure_rand() % 2)
+            coins.vout[0].SetNull();
+        uint256 txid = GetRandHash();
+        db.WriteOldCoins(txid, coins);
+        expected[txid] = coins;
+    }
+    BOOST_CHECK(!db.HaveCoins(expected.begin()->first));
+
+    // Every transaction reads back the same after the upgrade, and a second
+    // upgrade finds nothing left to do.
+    BOOST_CHECK(db.Upgrade());
+    BOOST_CHECK(db.Upgrade());
+    for (std::map<uint256, CCoins>::const_iterator it = expected.begin(); it != expected.end(); it++) {
+        CCoins coins;
+        BOOST_CHECK(db.HaveCoins(it->first));
+        BOOST_CHECK(db.GetCoins(it->first, coins));
+        BOOST_CHECK(coins == it->second);
+    }
+
+    // Spending outputs through a cache only touches those outputs; spending
+    // them all removes the transaction.
+    const uint256& txid = expected.rbegin()->first;
+    CCoins coins = expected.rbegin()->second;
+    {
+        CCoinsViewCacheTest cache(&db);
+        cache.ModifyCoins(txid)->Spend(coins.vout.size() - 1);
+        BOOST_CHECK(cache.Flush());
+    }
+    coins.Spend(coins.vout.size() - 1);
+    CCoins coinsRead;
+    BOOST_CHECK_EQUAL(db.GetCoins(txid, coinsRead), !coins.IsPruned());
+    BOOST_CHECK(coinsRead == coins);
+    {
+        CCoinsViewCacheTest cache(&db);
+        for (unsigned int n = 0; n < coins.vout.size(); n++)
+            cache.ModifyCoins(txid)->Spend(n);
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(!db.HaveCoins(txid));
+    BOOST_CHECK(!db.GetCoins(txid, coinsRead));
+}
+
+BOOST_FIXTURE_TEST_CASE(coins_db_remined, TestingSetup)
+{
+    CCoinsViewDBTest db;
+
+    // Indices from 16512 on take a three byte VARINT, and sort before
+    // smaller ones in the database.
+    uint256 txid = GetRandHash();
+    CCoins coins;
+    coins.nHeight = 100;
+    coins.nVersion = 1;
+    coins.vout.resize(16600);
+    const uint32_t vIndex[] = {0, 127, 128, 16511, 16512, 16599};
+    BOOST_FOREACH(uint32_t n, vIndex) {
+        coins.vout[n].nValue = n + 1;
+        coins.vout[n].scriptPubKey.assign(1, OP_TRUE);
+    }
+    {
+        CCoinsViewCacheTest cache(&db);
+        *cache.ModifyCoins(txid) = coins;
+        BOOST_CHECK(cache.Flush());
+    }
+    CCoins coinsRead;
+    BOOST_CHECK(db.GetCoins(txid, coinsRead));
+    BOOST_CHECK(coinsRead == coins);
+
+    // The transaction is disconnected and mined again at another height, and
+    // one of its outputs is spent: every remaining output gets the new height.
+    {
+        CCoinsViewCacheTest cache(&db);
+        {
+            CCoinsModifier modifier = cache.ModifyCoins(txid);
+            modifier->nHeight = 105;
+            modifier->Spend(16512);
+            coins = *modifier;
+        }
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(db.GetCoins(txid, coinsRead));
+    BOOST_CHECK_EQUAL(coinsRead.nHeight, 105);
+    BOOST_CHECK(coinsRead == coins);
+
+    // An entry kept cached across writes tracks what the database holds:
+    // an output spent in one write and restored in the next is written again.
+    {
+        CCoinsViewCacheTest cache(&db);
+        CTxOut out = coins.vout[0];
+        cache.ModifyCoins(txid)->Spend(0);
+        BOOST_CHECK(cache.WriteBack());
+        BOOST_CHECK(db.GetCoins(txid, coinsRead));
+        BOOST_CHECK(!coinsRead.IsAvailable(0));
+        cache.ModifyCoins(txid)->vout[0] = out;
+        BOOST_CHECK(cache.WriteBack());
+        cache.SelfTest();
+    }
+    BOOST_CHECK(db.GetCoins(txid, coinsRead));
+    BOOST_CHECK(coinsRead == coins);
+}
+
 BOOST_AUTO_TEST_CASE(coins_coinbase_spends)
 {
     CCoinsViewTest base;
@@ -0,0 +1,126 @@
+// Copyright (c) 2012-2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "cuckoocache.h"
+
+#include "random.h"
+#include "test/test_bitcoin.h"
+
+#include <cstring>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+/** Test Suite for CuckooCache
+ *
+ *  1) All tests should have a deterministic result (using insecure rand
+ *  with deterministic seeds)
+ *  2) Some test methods are templated to allow for easier testing
+ *  against new versions / comparing
+ *  3) Results should be treated as a regression test, i.e., did the behavior
+ *  change significantly from what was expected. This can be OK, depending on
+ *  the nature of the change, but requires updating the tests to reflect the new
+ *  expected behavior. For example improving the hit rate may cause some tests
+ *  using BOOST_CHECK_CLOSE to fail.
+ *
+ */
+
+namespace {
+
+struct UInt256Hasher
+{
+    template <uint8_t hash_select>
+    uint32_t operator()(const uint256& key) const
+    {
+        uint32_t u;
+        std::memcpy(&u, key.begin() + 4 * hash_select, 4);
+        return u;
+    }
+};
+
+typedef CuckooCache::cache<uint256, UInt256Hasher> uint256_cache;
+
+std::vector<uint256> RandomHashes(size_t n)
+{
+    std::vector<uint256> hashes;
+    hashes.reserve(n);
+    for (size_t i = 0; i < n; i++)
+        hashes.push_back(GetRandHash());
+    return hashes;
+}
+
+/** Inserts load*size elements into a fresh cache and returns the fraction
+ * of them that can still be found.
+ */
+double HitRate(double load, size_t megabytes)
+{
+    uint256_cache cache;
+    size_t nElems = cache.setup_bytes(megabytes << 20);
+    std::vector<uint256> hashes = RandomHashes(load * nElems);
+    for (size_t i = 0; i < hashes.size(); i++)
+        cache.insert(hashes[i]);
+    size_t nHits = 0;
+    for (size_t i = 0; i < hashes.size(); i++)
+        if (cache.contains(hashes[i], false))
+            nHits++;
+    return double(nHits) / double(hashes.size());
+}
+
+}
+
+BOOST_FIXTURE_TEST_SUITE(cuckoocache_tests, BasicTestingSetup)
+
+/* Test that no values not inserted into the cache are read out of it.
+ *
+ * There are no repeats in the first 200000 GetRandHash calls
+ */
+BOOST_AUTO_TEST_CASE(test_cuckoocache_no_fakes)
+{
+    uint256_cache cache;
+    cache.setup_bytes(32 << 20);
+    for (int x = 0; x < 100000; ++x)
+        cache.insert(GetRandHash());
+    for (int x = 0; x < 100000; ++x)
+        BOOST_CHECK(!cache.contains(GetRandHash(), false));
+}
+
+/* Below the epoch size almost nothing should be evicted, and even a cache
+ * that has been filled to capacity should keep most of its entries.
+ */
+BOOST_AUTO_TEST_CASE(test_cuckoocache_hit_rate)
+{
+    BOOST_CHECK(HitRate(0.4, 2) > 0.99);
+    BOOST_CHECK(HitRate(0.9, 2) > 0.75);
+    BOOST_CHECK(HitRate(2.0, 2) > 0.35);
+}
+
+/* Entries whose erasure has been allowed are overwritten before live ones.
+ */
+BOOST_AUTO_TEST_CASE(test_cuckoocache_erase)
+{
+    uint256_cache cache;
+    size_t nElems = cache.setup_bytes(2 << 20);
+
+    std::vector<uint256> erased = RandomHashes(nElems / 2);
+    for (size_t i = 0; i < erased.size(); i++)
+        cache.insert(erased[i]);
+    for (size_t i = 0; i < erased.size(); i++)
+        cache.contains(erased[i], true);
+
+    // Fill the space freed by the erased half plus the unused half
+    std::vector<uint256> kept = RandomHashes(nElems / 2);
+    for (size_t i = 0; i < kept.size(); i++)
+        cache.insert(kept[i]);
+    std::vector<uint256> more = RandomHashes(nElems / 4);
+    for (size_t i = 0; i < more.size(); i++)
+        cache.insert(more[i]);
+
+    size_t nKept = 0;
+    for (size_t i = 0; i < kept.size(); i++)
+        if (cache.contains(kept[i], false))
+            nKept++;
+    BOOST_CHECK(double(nKept) / kept.size() > 0.99);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
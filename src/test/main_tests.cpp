@@ -84,6 +84,28 @@ BOOST_AUTO_TEST_CASE(subsidy_limit_test)
     //BOOST_CHECK_EQUAL(nSum, 2099999990760000ULL);
 }
 
+BOOST_AUTO_TEST_CASE(read_raw_block)
+{
+    LOCK(cs_main);
+    const CBlockIndex* pindex = chainActive.Genesis();
+    BOOST_REQUIRE(pindex != NULL);
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << Params().GenesisBlock();
+
+    // Read as stored, after room for a message header
+    CSerializeData vBlock;
+    BOOST_CHECK(ReadRawBlockFromDisk(vBlock, pindex, 24));
+    BOOST_CHECK_EQUAL(vBlock.size(), 24 + ss.size());
+    BOOST_CHECK(std::equal(ss.begin(), ss.end(), vBlock.begin() + 24));
+
+    // A block whose header doesn't match the index isn't returned
+    CBlockIndex index(*pindex);
+    uint256 hashOther;
+    index.phashBlock = &hashOther;
+    BOOST_CHECK(!ReadRawBlockFromDisk(vBlock, &index));
+}
+
 bool ReturnFalse() { return false; }
 bool ReturnTrue() { return true; }
 
@@ -101,4 +101,185 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+BOOST_AUTO_TEST_CASE(MempoolAncestorStateTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    // A chain of three, plus a second child of the first
+    CMutableTransaction tx[4];
+    for (int i = 0; i < 4; i++) {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_11;
+        tx[i].vout.resize(2);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx[i].vout[0].nValue = 10000LL;
+        tx[i].vout[1].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx[i].vout[1].nValue = 10000LL;
+    }
+    tx[1].vin[0].prevout = COutPoint(tx[0].GetHash(), 0);
+    tx[2].vin[0].prevout = COutPoint(tx[1].GetHash(), 0);
+    tx[3].vin[0].prevout = COutPoint(tx[0].GetHash(), 1);
+    for (int i = 0; i < 4; i++)
+        pool.addUnchecked(tx[i].GetHash(), CTxMemPoolEntry(tx[i], 1000LL * (i + 1), 0, 0.0, 1));
+
+    CTxMemPool::txiter it[4];
+    for (int i = 0; i < 4; i++)
+        it[i] = pool.mapTx.find(tx[i].GetHash());
+    const uint64_t nSize = it[0]->GetTxSize();
+
+    BOOST_CHECK_EQUAL(it[0]->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(it[0]->GetCountWithDescendants(), 4);
+    BOOST_CHECK_EQUAL(it[0]->GetModFeesWithDescendants(), 10000LL);
+    BOOST_CHECK_EQUAL(it[2]->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(it[2]->GetSizeWithAncestors(), 3 * nSize);
+    BOOST_CHECK_EQUAL(it[2]->GetModFeesWithAncestors(), 6000LL);
+    BOOST_CHECK_EQUAL(it[3]->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(it[3]->GetModFeesWithAncestors(), 5000LL);
+    BOOST_CHECK(pool.GetMemPoolParents(it[2]).count(it[1]));
+    BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(it[0]).size(), 2);
+
+    // Packages are mined best first: tx3 with tx0 pays 2500 per tx
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator ai = pool.mapTx.get<ancestor_score>().begin();
+    BOOST_CHECK(ai->GetTx().GetHash() == tx[3].GetHash());
+
+    // Prioritising reaches both ancestors and descendants
+    pool.PrioritiseTransaction(tx[1].GetHash(), tx[1].GetHash().ToString(), 0.0, 2000LL);
+    BOOST_CHECK_EQUAL(it[1]->GetModifiedFee(), 4000LL);
+    BOOST_CHECK_EQUAL(it[0]->GetModFeesWithDescendants(), 12000LL);
+    BOOST_CHECK_EQUAL(it[2]->GetModFeesWithAncestors(), 8000LL);
+    BOOST_CHECK_EQUAL(it[3]->GetModFeesWithAncestors(), 5000LL);
+    ai = pool.mapTx.get<ancestor_score>().begin();
+    BOOST_CHECK(ai->GetTx().GetHash() == tx[2].GetHash());
+
+    // Mining tx0 leaves its children as roots
+    std::list<CTransaction> removed;
+    pool.remove(tx[0], removed, false);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    BOOST_CHECK_EQUAL(it[1]->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(it[2]->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(it[2]->GetModFeesWithAncestors(), 7000LL);
+    BOOST_CHECK_EQUAL(it[3]->GetSizeWithAncestors(), nSize);
+    BOOST_CHECK(pool.GetMemPoolParents(it[1]).empty());
+
+    // Putting it back, as a reorg does, reattaches them
+    pool.addUnchecked(tx[0].GetHash(), CTxMemPoolEntry(tx[0], 1000LL, 0, 0.0, 1));
+    it[0] = pool.mapTx.find(tx[0].GetHash());
+    BOOST_CHECK_EQUAL(it[0]->GetCountWithDescendants(), 4);
+    BOOST_CHECK_EQUAL(it[0]->GetModFeesWithDescendants(), 12000LL);
+    BOOST_CHECK_EQUAL(it[2]->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(it[2]->GetModFeesWithAncestors(), 8000LL);
+    BOOST_CHECK_EQUAL(it[1]->GetCountWithDescendants(), 2);
+
+    // Ancestor and descendant limits
+    CTxMemPool::setEntries setAncestors;
+    std::string errString;
+    CTxMemPoolEntry entry(tx[2], 0, 0, 0.0, 1);
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entry, setAncestors, 2, 100000, 100, 100000, errString));
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entry, setAncestors, 100, 100000, 4, 100000, errString));
+    setAncestors.clear();
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(entry, setAncestors, 100, 100000, 100, 100000, errString));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 2);
+
+    pool.remove(tx[0], removed, true);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+
+    CMutableTransaction tx1 = CMutableTransaction();
+    tx1.vin.resize(1);
+    tx1.vin[0].scriptSig = CScript() << OP_1;
+    tx1.vout.resize(1);
+    tx1.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+    tx1.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 10000LL, 0, 0.0, 1));
+
+    CMutableTransaction tx2 = CMutableTransaction();
+    tx2.vin.resize(1);
+    tx2.vin[0].scriptSig = CScript() << OP_2;
+    tx2.vout.resize(1);
+    tx2.vout[0].scriptPubKey = CScript() << OP_2 << OP_EQUAL;
+    tx2.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 5000LL, 0, 0.0, 1));
+
+    // Nothing to do while the pool fits
+    pool.TrimToSize(pool.DynamicMemoryUsage());
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(pool.exists(tx2.GetHash()));
+
+    // The lowest fee rate goes first, and sets the minimum fee
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(!pool.exists(tx2.GetHash()));
+    CFeeRate rateTx2(5000LL, ::GetSerializeSize(tx2, SER_NETWORK, PROTOCOL_VERSION));
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), rateTx2.GetFeePerK() + 1000);
+
+    // A high-fee child lifts its parent's package above tx1
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 5000LL, 0, 0.0, 1));
+    CMutableTransaction tx3 = CMutableTransaction();
+    tx3.vin.resize(1);
+    tx3.vin[0].prevout = COutPoint(tx2.GetHash(), 0);
+    tx3.vin[0].scriptSig = CScript() << OP_2;
+    tx3.vout.resize(1);
+    tx3.vout[0].scriptPubKey = CScript() << OP_3 << OP_EQUAL;
+    tx3.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 20000LL, 0, 0.0, 1));
+
+    CTxMemPool::indexed_transaction_set::const_iterator it2 = pool.mapTx.find(tx2.GetHash());
+    BOOST_CHECK_EQUAL(it2->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(it2->GetModFeesWithDescendants(), 25000LL);
+    BOOST_CHECK_EQUAL(it2->GetSizeWithDescendants(), it2->GetTxSize() + pool.mapTx.find(tx3.GetHash())->GetTxSize());
+
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(!pool.exists(tx1.GetHash()));
+    BOOST_CHECK(pool.exists(tx2.GetHash()));
+    BOOST_CHECK(pool.exists(tx3.GetHash()));
+
+    // Evicting a package removes the children with it
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolExpireTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txParent.vout[0].nValue = 33000LL;
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].scriptSig = CScript() << OP_11;
+    txChild.vin[0].prevout = COutPoint(txParent.GetHash(), 0);
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 11000LL;
+    CMutableTransaction txOther;
+    txOther.vin.resize(1);
+    txOther.vin[0].scriptSig = CScript() << OP_12;
+    txOther.vout.resize(1);
+    txOther.vout[0].scriptPubKey = CScript() << OP_12 << OP_EQUAL;
+    txOther.vout[0].nValue = 11000LL;
+
+    pool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 0, 100, 0.0, 1));
+    pool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 0, 300, 0.0, 1));
+    pool.addUnchecked(txOther.GetHash(), CTxMemPoolEntry(txOther, 0, 200, 0.0, 1));
+
+    BOOST_CHECK_EQUAL(pool.Expire(100), 0);
+    BOOST_CHECK_EQUAL(pool.size(), 3);
+
+    // An expired transaction takes its descendants with it, however young
+    BOOST_CHECK_EQUAL(pool.Expire(150), 2);
+    BOOST_CHECK(!pool.exists(txChild.GetHash()));
+    BOOST_CHECK(pool.exists(txOther.GetHash()));
+
+    BOOST_CHECK_EQUAL(pool.Expire(250), 1);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
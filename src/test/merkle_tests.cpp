@@ -0,0 +1,78 @@
+// Copyright (c) 2018 The Bitcoin Private developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "crypto/sha256.h"
+#include "hash.h"
+#include "primitives/block.h"
+#include "test/test_bitcoin.h"
+#include "utilstrencodings.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(merkle_tests, BasicTestingSetup)
+
+// The pairwise merkle tree computation, one hash at a time.
+static uint256 ReferenceMerkleTree(const CBlock& block, bool& mutated, std::vector<uint256>& tree)
+{
+    tree.clear();
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+        tree.push_back(block.vtx[i]->GetHash());
+    int j = 0;
+    mutated = false;
+    for (int nSize = block.vtx.size(); nSize > 1; nSize = (nSize + 1) / 2) {
+        for (int i = 0; i < nSize; i += 2) {
+            int i2 = std::min(i+1, nSize-1);
+            if (i2 == i + 1 && i2 + 1 == nSize && tree[j+i] == tree[j+i2])
+                mutated = true;
+            tree.push_back(Hash(BEGIN(tree[j+i]), END(tree[j+i]), BEGIN(tree[j+i2]), END(tree[j+i2])));
+        }
+        j += nSize;
+    }
+    return tree.empty() ? uint256() : tree.back();
+}
+
+static void CheckMerkleRoots(const CBlock& block)
+{
+    bool fRefMutated, fMutated, fTreeMutated;
+    std::vector<uint256> vRefTree;
+    uint256 refRoot = ReferenceMerkleTree(block, fRefMutated, vRefTree);
+
+    BOOST_CHECK(block.ComputeMerkleRoot(&fMutated) == refRoot);
+    BOOST_CHECK_EQUAL(fMutated, fRefMutated);
+    BOOST_CHECK(block.BuildMerkleTree(&fTreeMutated) == refRoot);
+    BOOST_CHECK_EQUAL(fTreeMutated, fRefMutated);
+    BOOST_CHECK(block.vMerkleTree == vRefTree);
+}
+
+BOOST_AUTO_TEST_CASE(merkle_root_matches_pairwise)
+{
+    static const unsigned int nTxCounts[] = {0, 1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 32, 33, 100, 513};
+    static const int backends[] = {SHA256_STANDARD, SHA256_ALL};
+
+    for (int mask : backends) {
+        BOOST_TEST_MESSAGE("SHA256 implementation: " << SHA256AutoDetect(mask));
+        for (unsigned int nTx : nTxCounts) {
+            CBlock block;
+            for (unsigned int i = 0; i < nTx; i++) {
+                CMutableTransaction mtx;
+                mtx.nLockTime = i;
+                block.vtx.push_back(MakeTransactionRef(mtx));
+            }
+            CheckMerkleRoots(block);
+
+            // Repeat the trailing transactions so that the merkle root is
+            // unchanged (CVE-2012-2459); both must report the mutation.
+            for (unsigned int nDup = 1; nDup <= 2 && nDup < nTx; nDup++) {
+                CBlock mutatedBlock(block);
+                mutatedBlock.vtx.insert(mutatedBlock.vtx.end(), block.vtx.end() - nDup, block.vtx.end());
+                CheckMerkleRoots(mutatedBlock);
+            }
+        }
+    }
+    SHA256AutoDetect();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -165,12 +165,12 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
         // one spacing ahead of the tip. Within 11 blocks of genesis, the median
         // will be closer to the tip, and blocks will appear slower.
         pblock->nTime = chainActive.Tip()->GetMedianTimePast()+6*Params().GetConsensus().nPowTargetSpacing;
-        CMutableTransaction txCoinbase(pblock->vtx[0]);
+        CMutableTransaction txCoinbase(*pblock->vtx[0]);
         txCoinbase.vin[0].scriptSig = CScript() << (chainActive.Height()+1) << OP_0;
         txCoinbase.vout[0].scriptPubKey = CScript();
-        pblock->vtx[0] = CTransaction(txCoinbase);
+        pblock->vtx[0] = MakeTransactionRef(txCoinbase);
         if (txFirst.size() < 2)
-            txFirst.push_back(new CTransaction(pblock->vtx[0]));
+            txFirst.push_back(new CTransaction(*pblock->vtx[0]));
         pblock->hashMerkleRoot = pblock->BuildMerkleTree();
         pblock->nNonce = uint256S(blockinfo[i].nonce_hex);
         pblock->nSolution = ParseHex(blockinfo[i].solution_hex);
@@ -471,4 +471,147 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     fCoinbaseEnforcedProtectionEnabled = true;
 }
 #endif
+
+static CMutableTransaction TemplateTestTx(const uint256& prevHash)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(prevHash, 0);
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_1;
+    tx.vout[0].nValue = 10 * COIN;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(BlockTemplateCache_update)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlockTemplateCache cache(pool, 20000);
+    CBlockIndex* pindexPrev = chainActive.Tip();
+    CBlockTemplate blocktemplate;
+    unsigned int nSequence = 0, nSequenceNext = 0;
+    BOOST_CHECK(!cache.Get(pindexPrev, blocktemplate, nSequence));
+
+    // A template holding tx0, which is in the pool
+    CMutableTransaction tx0 = TemplateTestTx(GetRandHash());
+    pool.addUnchecked(tx0.GetHash(), CTxMemPoolEntry(tx0, 10000, 0, 0.0, 1));
+    CMutableTransaction txCoinbase;
+    txCoinbase.vin.resize(1);
+    txCoinbase.vin[0].prevout.SetNull();
+    txCoinbase.vout.resize(1);
+    txCoinbase.vout[0].nValue = 50 * COIN + 10000;
+    CBlockTemplate* pblocktemplate = new CBlockTemplate();
+    pblocktemplate->block.hashPrevBlock = pindexPrev->GetBlockHash();
+    pblocktemplate->block.vtx.push_back(MakeTransactionRef(txCoinbase));
+    pblocktemplate->block.vtx.push_back(MakeTransactionRef(tx0));
+    pblocktemplate->vTxFees.push_back(-10000);
+    pblocktemplate->vTxFees.push_back(10000);
+    pblocktemplate->vTxSigOps.push_back(0);
+    pblocktemplate->vTxSigOps.push_back(1);
+    cache.Set(pblocktemplate);
+    BOOST_CHECK(cache.Get(pindexPrev, blocktemplate, nSequence));
+    BOOST_CHECK_EQUAL(blocktemplate.block.vtx.size(), 2);
+    BOOST_CHECK(cache.GetAnnouncedSequence() < nSequence);
+
+    // A paying child of tx0 is appended, and the coinbase collects its fee;
+    // the fees have now grown enough to wake longpolls
+    CMutableTransaction tx1 = TemplateTestTx(tx0.GetHash());
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 15000, 0, 0.0, 1));
+    BOOST_CHECK(cache.Get(pindexPrev, blocktemplate, nSequenceNext));
+    BOOST_CHECK(nSequenceNext != nSequence);
+    BOOST_CHECK_EQUAL(blocktemplate.block.vtx.size(), 3);
+    BOOST_CHECK(blocktemplate.block.vtx[2]->GetHash() == tx1.GetHash());
+    BOOST_CHECK_EQUAL(blocktemplate.block.vtx[0]->vout[0].nValue, 50 * COIN + 25000);
+    BOOST_CHECK_EQUAL(blocktemplate.vTxFees[0], -25000);
+    BOOST_CHECK_EQUAL(cache.GetAnnouncedSequence(), nSequenceNext);
+    nSequence = nSequenceNext;
+
+    // One below the relay fee is left for the next rebuild, and so is a
+    // paying child of it. The template is outdated, but still served until
+    // it is due for a rebuild.
+    CMutableTransaction tx2 = TemplateTestTx(GetRandHash());
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 0, 0, 0.0, 1));
+    CMutableTransaction tx3 = TemplateTestTx(tx2.GetHash());
+    pool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 50000, 0, 0.0, 1));
+    BOOST_CHECK(cache.Get(pindexPrev, blocktemplate, nSequenceNext));
+    BOOST_CHECK(nSequenceNext != nSequence);
+    BOOST_CHECK_EQUAL(blocktemplate.block.vtx.size(), 3);
+    BOOST_CHECK_EQUAL(blocktemplate.block.vtx[0]->vout[0].nValue, 50 * COIN + 25000);
+    SetMockTime(GetTime() + BLOCK_TEMPLATE_REBUILD_INTERVAL);
+    BOOST_CHECK(!cache.Get(pindexPrev, blocktemplate, nSequenceNext));
+    SetMockTime(0);
+
+    // Losing one of its transactions makes it unusable
+    cache.Set(new CBlockTemplate(blocktemplate));
+    BOOST_CHECK(cache.Get(pindexPrev, blocktemplate, nSequenceNext));
+    std::list<CTransaction> removed;
+    pool.remove(tx1, removed, false);
+    BOOST_CHECK(!cache.Get(pindexPrev, blocktemplate, nSequenceNext));
+
+    // As does a new tip
+    cache.Set(new CBlockTemplate(blocktemplate));
+    BOOST_CHECK(cache.Get(pindexPrev, blocktemplate, nSequenceNext));
+    CBlockIndex indexNext;
+    uint256 hashNext = GetRandHash();
+    indexNext.phashBlock = &hashNext;
+    BOOST_CHECK(!cache.Get(&indexNext, blocktemplate, nSequenceNext));
+}
+
+BOOST_AUTO_TEST_CASE(CreateNewBlock_package_selection)
+{
+    CScript scriptPubKey = CScript() << OP_1;
+    // Leave coin-age priority out, so that only fees decide
+    mapArgs["-blockprioritysize"] = "0";
+    fCheckpointsEnabled = false;
+
+    // A confirmed coin for the parent to spend
+    uint256 hashCoin = GetRandHash();
+    {
+        LOCK(cs_main);
+        CCoinsModifier coins = pcoinsTip->ModifyCoins(hashCoin);
+        coins->fCoinBase = false;
+        coins->nVersion = 1;
+        coins->nHeight = 0;
+        coins->vout.resize(1);
+        coins->vout[0].scriptPubKey = CScript() << OP_1;
+        coins->vout[0].nValue = 10 * COIN;
+    }
+
+    // The parent pays nothing and its first child pays for both. The second
+    // child pays less, and is left to be scored on its own once the parent
+    // is in the block.
+    CMutableTransaction txParent = TemplateTestTx(hashCoin);
+    txParent.vout.resize(2);
+    txParent.vout[0].nValue = 5 * COIN;
+    txParent.vout[1].scriptPubKey = CScript() << OP_1;
+    txParent.vout[1].nValue = 5 * COIN;
+    CMutableTransaction txChild = TemplateTestTx(txParent.GetHash());
+    txChild.vout[0].nValue = 5 * COIN - 20000;
+    CMutableTransaction txChild2 = TemplateTestTx(txParent.GetHash());
+    txChild2.vin[0].prevout.n = 1;
+    txChild2.vout[0].nValue = 5 * COIN - 5000;
+    // The best paying transaction spends a coin that doesn't exist
+    CMutableTransaction txOrphan = TemplateTestTx(GetRandHash());
+
+    mempool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 0, 0, 0.0, 1));
+    mempool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 20000, 0, 0.0, 1));
+    mempool.addUnchecked(txChild2.GetHash(), CTxMemPoolEntry(txChild2, 5000, 0, 0.0, 1));
+    mempool.addUnchecked(txOrphan.GetHash(), CTxMemPoolEntry(txOrphan, 100000, 0, 0.0, 1));
+
+    CBlockTemplate* pblocktemplate = CreateNewBlock(scriptPubKey);
+    BOOST_REQUIRE(pblocktemplate);
+    const CBlock& block = pblocktemplate->block;
+    BOOST_REQUIRE_EQUAL(block.vtx.size(), 4);
+    BOOST_CHECK(block.vtx[1]->GetHash() == txParent.GetHash());
+    BOOST_CHECK(block.vtx[2]->GetHash() == txChild.GetHash());
+    BOOST_CHECK(block.vtx[3]->GetHash() == txChild2.GetHash());
+    BOOST_CHECK_EQUAL(pblocktemplate->vTxFees[0], -25000);
+    delete pblocktemplate;
+
+    mempool.clear();
+    fCheckpointsEnabled = true;
+    mapArgs.erase("-blockprioritysize");
+}
+
 BOOST_AUTO_TEST_SUITE_END()
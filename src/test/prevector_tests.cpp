@@ -0,0 +1,168 @@
+// Copyright (c) 2018 The Bitcoin Private developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "core_memusage.h"
+#include "prevector.h"
+#include "random.h"
+#include "script/script.h"
+#include "serialize.h"
+#include "streams.h"
+#include "utilstrencodings.h"
+#include "test/test_bitcoin.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(prevector_tests, BasicTestingSetup)
+
+namespace {
+
+/** Applies every operation to both a prevector and a std::vector, and compares them. */
+template<unsigned int N, typename T>
+class prevector_tester {
+    typedef std::vector<T> realtype;
+    typedef prevector<N, T> pretype;
+
+    realtype real_vector;
+    pretype pre_vector;
+
+public:
+    void test() const {
+        BOOST_CHECK_EQUAL(real_vector.size(), pre_vector.size());
+        BOOST_CHECK_EQUAL(real_vector.empty(), pre_vector.empty());
+        BOOST_CHECK(pre_vector.capacity() >= pre_vector.size());
+        for (size_t i = 0; i < real_vector.size(); i++)
+            BOOST_CHECK(real_vector[i] == pre_vector[i]);
+        size_t pos = 0;
+        for (typename pretype::const_iterator it = pre_vector.begin(); it != pre_vector.end(); ++it)
+            BOOST_CHECK(*it == real_vector[pos++]);
+        BOOST_CHECK_EQUAL(pos, real_vector.size());
+
+        // Same serialization as std::vector.
+        CDataStream ss1(SER_DISK, 0);
+        CDataStream ss2(SER_DISK, 0);
+        ss1 << real_vector;
+        ss2 << pre_vector;
+        BOOST_CHECK_EQUAL(ss1.size(), ss2.size());
+        BOOST_CHECK(std::equal(ss1.begin(), ss1.end(), ss2.begin()));
+        pretype pre_copy;
+        ss2 >> pre_copy;
+        BOOST_CHECK(pre_copy == pre_vector);
+    }
+
+    void resize(size_t s) { real_vector.resize(s); pre_vector.resize(s); test(); }
+    void push_back(const T& value) { real_vector.push_back(value); pre_vector.push_back(value); test(); }
+    void pop_back() { real_vector.pop_back(); pre_vector.pop_back(); test(); }
+    void clear() { real_vector.clear(); pre_vector.clear(); test(); }
+    void shrink_to_fit() { pre_vector.shrink_to_fit(); test(); }
+
+    void insert(size_t position, const T& value) {
+        real_vector.insert(real_vector.begin() + position, value);
+        pre_vector.insert(pre_vector.begin() + position, value);
+        test();
+    }
+
+    void insert_range(size_t position, const std::vector<T>& values) {
+        real_vector.insert(real_vector.begin() + position, values.begin(), values.end());
+        pre_vector.insert(pre_vector.begin() + position, values.begin(), values.end());
+        test();
+    }
+
+    void erase(size_t first, size_t last) {
+        real_vector.erase(real_vector.begin() + first, real_vector.begin() + last);
+        pre_vector.erase(pre_vector.begin() + first, pre_vector.begin() + last);
+        test();
+    }
+
+    void copy_and_swap() {
+        pretype copy(pre_vector);
+        BOOST_CHECK(copy == pre_vector);
+        pretype other;
+        other.swap(copy);
+        BOOST_CHECK(other == pre_vector);
+        pre_vector = other;
+        test();
+    }
+
+    size_t size() const { return real_vector.size(); }
+};
+
+}
+
+BOOST_AUTO_TEST_CASE(prevector_random)
+{
+    for (int j = 0; j < 64; j++) {
+        prevector_tester<8, int> test;
+        for (int i = 0; i < 1024; i++) {
+            int r = insecure_rand();
+            switch (r % 8) {
+            case 0:
+                test.insert(insecure_rand() % (test.size() + 1), insecure_rand());
+                break;
+            case 1:
+                test.resize(std::max(0, std::min(30, (int)test.size() + (int)(insecure_rand() % 5) - 2)));
+                break;
+            case 2:
+                if (test.size() > 0) {
+                    size_t first = insecure_rand() % test.size();
+                    test.erase(first, first + insecure_rand() % (test.size() - first + 1));
+                }
+                break;
+            case 3:
+                test.push_back(insecure_rand());
+                break;
+            case 4:
+                if (test.size() > 0)
+                    test.pop_back();
+                break;
+            case 5: {
+                std::vector<int> values(insecure_rand() % 12, insecure_rand());
+                test.insert_range(insecure_rand() % (test.size() + 1), values);
+                break;
+            }
+            case 6:
+                test.copy_and_swap();
+                break;
+            case 7:
+                if (insecure_rand() % 16 == 0)
+                    test.clear();
+                else
+                    test.shrink_to_fit();
+                break;
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(prevector_script_usage)
+{
+    // Standard output scripts fit inline and own no heap memory.
+    std::vector<unsigned char> hash(20, 0x42);
+    CScript p2pkh = CScript() << OP_DUP << OP_HASH160 << hash << OP_EQUALVERIFY << OP_CHECKSIG;
+    CScript p2sh = CScript() << OP_HASH160 << hash << OP_EQUAL;
+    BOOST_CHECK_EQUAL(p2pkh.size(), 25U);
+    BOOST_CHECK_EQUAL(RecursiveDynamicUsage(p2pkh), 0U);
+    BOOST_CHECK_EQUAL(RecursiveDynamicUsage(p2sh), 0U);
+    BOOST_CHECK(p2sh.IsPayToScriptHash());
+
+    // Longer ones move to the heap, and serialize exactly as before.
+    CScript script = p2pkh + p2pkh;
+    BOOST_CHECK(RecursiveDynamicUsage(script) > 0);
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << script;
+    std::vector<unsigned char> bytes(script.begin(), script.end());
+    CDataStream ssVector(SER_NETWORK, PROTOCOL_VERSION);
+    ssVector << bytes;
+    BOOST_CHECK_EQUAL(HexStr(ss.begin(), ss.end()), HexStr(ssVector.begin(), ssVector.end()));
+    CScript script2;
+    ss >> script2;
+    BOOST_CHECK(script2 == script);
+
+    script.clear();
+    BOOST_CHECK(script.empty());
+    BOOST_CHECK_EQUAL(RecursiveDynamicUsage(script), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
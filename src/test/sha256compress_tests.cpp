@@ -8,7 +8,7 @@
 
 BOOST_FIXTURE_TEST_SUITE(sha256compress_tests, BasicTestingSetup)
 
-BOOST_AUTO_TEST_CASE(compression)
+static void TestCompression()
 {
 	{
 		unsigned char preimage[64] = {};
@@ -83,4 +83,15 @@ BOOST_AUTO_TEST_CASE(compression)
     }
 }
 
+BOOST_AUTO_TEST_CASE(compression)
+{
+    // Every SHA-256 back-end on its own, then the default selection
+    static const int backends[] = {SHA256_STANDARD, SHA256_SSE41, SHA256_AVX2, SHA256_SHANI, SHA256_ALL};
+    for (int mask : backends) {
+        BOOST_TEST_MESSAGE("SHA256 implementation: " << SHA256AutoDetect(mask));
+        TestCompression();
+    }
+    SHA256AutoDetect();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
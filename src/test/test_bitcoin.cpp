@@ -7,6 +7,7 @@
 #include "test_bitcoin.h"
 
 #include "crypto/common.h"
+#include "crypto/sha256.h"
 
 #include "key.h"
 #include "main.h"
@@ -33,7 +34,10 @@ extern void noui_connect();
 BasicTestingSetup::BasicTestingSetup()
 {
         assert(init_and_check_sodium() != -1);
+        SHA256AutoDetect();
         ECC_Start();
+        InitSignatureCache();
+        InitScriptExecutionCache();
         pzcashParams = ZCJoinSplit::Unopened();
         SetupEnvironment();
         fPrintToDebugLog = false; // don't want to write to debug.log file
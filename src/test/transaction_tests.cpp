@@ -14,7 +14,10 @@
 #include "main.h"
 #include "script/script.h"
 #include "script/script_error.h"
+#include "primitives/block.h"
 #include "primitives/transaction.h"
+#include "streams.h"
+#include "txmempool.h"
 
 #include "sodium.h"
 
@@ -655,4 +658,37 @@ BOOST_AUTO_TEST_CASE(test_IsStandardV2)
     BOOST_CHECK(!IsStandardTx(t, reason));
 }
 
+BOOST_AUTO_TEST_CASE(test_shared_transaction)
+{
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    mtx.vout.resize(1);
+    mtx.vout[0].nValue = 10*CENT;
+    mtx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    CTransactionRef ptx = MakeTransactionRef(mtx);
+    BOOST_CHECK(ptx->GetHash() == mtx.GetHash());
+
+    // A reference serializes exactly like the transaction itself.
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << ptx;
+    CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+    ssTx << *ptx;
+    BOOST_CHECK(std::equal(ss.begin(), ss.end(), ssTx.begin()) && ss.size() == ssTx.size());
+    CTransactionRef ptx2;
+    ss >> ptx2;
+    BOOST_CHECK(ptx2 && ptx2 != ptx);
+    BOOST_CHECK(ptx2->GetHash() == ptx->GetHash());
+
+    // Blocks and mempool entries share the transaction instead of copying it.
+    CBlock block;
+    block.vtx.push_back(ptx);
+    CBlock blockCopy(block);
+    BOOST_CHECK(blockCopy.vtx[0] == ptx);
+    CTxMemPoolEntry entry(ptx, 0, 0, 0.0, 1);
+    BOOST_CHECK(entry.GetSharedTx() == ptx);
+    BOOST_CHECK(&entry.GetTx() == ptx.get());
+    BOOST_CHECK_EQUAL(ptx.use_count(), 4);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -6,13 +6,19 @@
 #include "txdb.h"
 
 #include "chainparams.h"
+#include "compressor.h"
 #include "hash.h"
+#include "init.h"
 #include "main.h"
 #include "pow.h"
+#include "ui_interface.h"
 #include "uint256.h"
+#include "utiltime.h"
 
 #include <stdint.h>
 
+#include <boost/foreach.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
@@ -20,6 +26,7 @@ using namespace std;
 static const char DB_ANCHOR = 'A';
 static const char DB_NULLIFIER = 's';
 static const char DB_COINS = 'c';
+static const char DB_COIN = 'C';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
 static const char DB_BLOCK_INDEX = 'b';
@@ -31,6 +38,105 @@ static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
 
+//! Number of transactions converted per batch by CCoinsViewDB::Upgrade
+static const size_t UPGRADE_BATCH_TRANSACTIONS = 10000;
+
+namespace {
+
+/**
+ * Key of a single unspent output: DB_COIN, then the txid, then the output
+ * index. All outputs of a transaction share the txid prefix and sort by
+ * index, so they are read with one seek.
+ */
+struct CCoinsOutputKey
+{
+    uint256 txid;
+    uint32_t n;
+
+    CCoinsOutputKey() : n(0) {}
+    CCoinsOutputKey(const uint256 &txidIn, uint32_t nIn) : txid(txidIn), n(nIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        char chType = DB_COIN;
+        READWRITE(chType);
+        READWRITE(txid);
+        READWRITE(VARINT(n));
+    }
+};
+
+/**
+ * Value of a single unspent output. The transaction metadata is repeated in
+ * every output, in the same compact encoding CCoins uses.
+ */
+struct CCoinsOutputRecord
+{
+    CTxOut out;
+    bool fCoinBase;
+    int nHeight;
+    int nVersion;
+
+    CCoinsOutputRecord() : fCoinBase(false), nHeight(0), nVersion(0) {}
+    CCoinsOutputRecord(const CCoins &coins, uint32_t n) :
+        out(coins.vout[n]), fCoinBase(coins.fCoinBase), nHeight(coins.nHeight), nVersion(coins.nVersion) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(VARINT(this->nVersion));
+        unsigned int nCode = nHeight * 2 + (fCoinBase ? 1 : 0);
+        READWRITE(VARINT(nCode));
+        if (ser_action.ForRead()) {
+            nHeight = nCode / 2;
+            fCoinBase = nCode & 1;
+        }
+        READWRITE(REF(CTxOutCompressor(out)));
+    }
+};
+
+}
+
+/**
+ * Read the indices of the unspent outputs of txid stored in the database,
+ * and if pcoins is given the outputs themselves. The indices come in key
+ * order, which is not numeric order once they are large enough to need a
+ * longer VARINT.
+ */
+void static ReadOutputs(const CLevelDBWrapper &db, const uint256 &txid, std::vector<uint32_t> &vIndex, CCoins *pcoins)
+{
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << make_pair(DB_COIN, txid);
+    leveldb::Slice slPrefix(&ssPrefix[0], ssPrefix.size());
+
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewReadIterator());
+    for (pcursor->Seek(slPrefix); pcursor->Valid(); pcursor->Next()) {
+        leveldb::Slice slKey = pcursor->key();
+        if (!slKey.starts_with(slPrefix))
+            break;
+        CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+        CCoinsOutputKey key;
+        ssKey >> key;
+        vIndex.push_back(key.n);
+        if (pcoins) {
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CCoinsOutputRecord record;
+            ssValue >> record;
+            if (pcoins->vout.size() <= key.n)
+                pcoins->vout.resize(key.n + 1);
+            pcoins->vout[key.n] = record.out;
+            pcoins->fCoinBase = record.fCoinBase;
+            pcoins->nHeight = record.nHeight;
+            pcoins->nVersion = record.nVersion;
+        }
+    }
+    if (!pcursor->status().ok())
+        HandleError(pcursor->status());
+}
+
 
 void static BatchWriteAnchor(CLevelDBBatch &batch,
                              const uint256 &croot,
@@ -56,11 +162,27 @@ void static BatchWriteNullifier(CLevelDBBatch &batch, const uint256 &nf, const b
         batch.Write(make_pair(DB_NULLIFIER, nf), true);
 }
 
-void static BatchWriteCoins(CLevelDBBatch &batch, const uint256 &hash, const CCoins &coins) {
-    if (coins.IsPruned())
-        batch.Erase(make_pair(DB_COINS, hash));
-    else
-        batch.Write(make_pair(DB_COINS, hash), coins);
+/**
+ * Only outputs that changed are written: spent outputs are erased, and
+ * outputs that are not in the database yet (new transactions, or outputs
+ * restored by a disconnect) are added. What the database holds is known
+ * from the cache entry, so nothing is read here. An output never changes
+ * once created, but the transaction metadata stored with it does when the
+ * transaction is disconnected and mined again at another height; then all
+ * of its unspent outputs are rewritten.
+ */
+void static BatchWriteCoins(CLevelDBBatch &batch, const uint256 &hash, const CCoinsCacheEntry &entry) {
+    const CCoins &coins = entry.coins;
+    const CCoinsParentState &onDisk = entry.parent;
+    bool fRewrite = !onDisk.HasSameMetadata(coins);
+    for (uint32_t n = 0; n < onDisk.GetOutputCount(); n++) {
+        if (onDisk.IsAvailable(n) && !coins.IsAvailable(n))
+            batch.Erase(CCoinsOutputKey(hash, n));
+    }
+    for (uint32_t n = 0; n < coins.vout.size(); n++) {
+        if (!coins.vout[n].IsNull() && (fRewrite || !onDisk.IsAvailable(n)))
+            batch.Write(CCoinsOutputKey(hash, n), CCoinsOutputRecord(coins, n));
+    }
 }
 
 void static BatchWriteHashBestChain(CLevelDBBatch &batch, const uint256 &hash) {
@@ -101,11 +223,25 @@ bool CCoinsViewDB::GetNullifier(const uint256 &nf) const {
 }
 
 bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
-    return db.Read(make_pair(DB_COINS, txid), coins);
+    std::vector<uint32_t> vIndex;
+    CCoins tmp;
+    ReadOutputs(db, txid, vIndex, &tmp);
+    if (vIndex.empty())
+        return false;
+    coins.swap(tmp);
+    return true;
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
-    return db.Exists(make_pair(DB_COINS, txid));
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << make_pair(DB_COIN, txid);
+    leveldb::Slice slPrefix(&ssPrefix[0], ssPrefix.size());
+
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewReadIterator());
+    pcursor->Seek(slPrefix);
+    if (!pcursor->status().ok())
+        HandleError(pcursor->status());
+    return pcursor->Valid() && pcursor->key().starts_with(slPrefix);
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const {
@@ -127,35 +263,41 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
                               const uint256 &hashAnchor,
                               CAnchorsMap &mapAnchors,
                               CNullifiersMap &mapNullifiers) {
+    bool fOk = BatchWriteDirty(mapCoins, hashBlock, hashAnchor, mapAnchors, mapNullifiers);
+    mapCoins.clear();
+    mapAnchors.clear();
+    mapNullifiers.clear();
+    return fOk;
+}
+
+bool CCoinsViewDB::BatchWriteDirty(const CCoinsMap &mapCoins,
+                                   const uint256 &hashBlock,
+                                   const uint256 &hashAnchor,
+                                   const CAnchorsMap &mapAnchors,
+                                   const CNullifiersMap &mapNullifiers) {
     CLevelDBBatch batch;
     size_t count = 0;
     size_t changed = 0;
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            BatchWriteCoins(batch, it->first, it->second.coins);
+            BatchWriteCoins(batch, it->first, it->second);
             changed++;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
     }
 
-    for (CAnchorsMap::iterator it = mapAnchors.begin(); it != mapAnchors.end();) {
+    for (CAnchorsMap::const_iterator it = mapAnchors.begin(); it != mapAnchors.end(); it++) {
         if (it->second.flags & CAnchorsCacheEntry::DIRTY) {
             BatchWriteAnchor(batch, it->first, it->second.tree, it->second.entered, it->second.postBurn);
             // TODO: changed++?
         }
-        CAnchorsMap::iterator itOld = it++;
-        mapAnchors.erase(itOld);
     }
 
-    for (CNullifiersMap::iterator it = mapNullifiers.begin(); it != mapNullifiers.end();) {
+    for (CNullifiersMap::const_iterator it = mapNullifiers.begin(); it != mapNullifiers.end(); it++) {
         if (it->second.flags & CNullifiersCacheEntry::DIRTY) {
             BatchWriteNullifier(batch, it->first, it->second.entered);
             // TODO: changed++?
         }
-        CNullifiersMap::iterator itOld = it++;
-        mapNullifiers.erase(itOld);
     }
 
     if (!hashBlock.IsNull())
@@ -167,6 +309,76 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
     return db.WriteBatch(batch);
 }
 
+bool CCoinsViewDB::Upgrade() {
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator());
+    pcursor->Seek(std::string(1, DB_COINS));
+    if (!pcursor->Valid() || pcursor->key()[0] != DB_COINS)
+        return true;
+
+    LogPrintf("Upgrading the chainstate database to one record per unspent output...\n");
+    LogPrintf("[0%%]...");
+    uiInterface.ShowProgress(_("Upgrading chainstate database..."), 0);
+    int64_t nStart = GetTimeMillis();
+    size_t nTransactions = 0;
+    size_t nOutputs = 0;
+    size_t nBatch = 0;
+    int nReportDone = 0;
+    CLevelDBBatch batch;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested())
+            break;
+        leveldb::Slice slKey = pcursor->key();
+        if (slKey.size() == 0 || slKey[0] != DB_COINS)
+            break;
+        uint256 txid;
+        CCoins coins;
+        try {
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            ssKey >> chType >> txid;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> coins;
+        } catch (const std::exception& e) {
+            return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+        }
+
+        // Each transaction is converted in the same batch as its old record
+        // is erased, so an interrupted upgrade simply resumes on restart.
+        for (uint32_t n = 0; n < coins.vout.size(); n++) {
+            if (!coins.vout[n].IsNull()) {
+                batch.Write(CCoinsOutputKey(txid, n), CCoinsOutputRecord(coins, n));
+                nOutputs++;
+            }
+        }
+        batch.Erase(make_pair(DB_COINS, txid));
+        nTransactions++;
+
+        if (++nBatch == UPGRADE_BATCH_TRANSACTIONS) {
+            db.WriteBatch(batch);
+            batch.Clear();
+            nBatch = 0;
+            // Transactions are visited in txid order, so the first byte of
+            // the txid tells how far along the upgrade is.
+            int nPercent = (int)*txid.begin() * 100 / 256;
+            uiInterface.ShowProgress(_("Upgrading chainstate database..."), nPercent);
+            if (nPercent >= nReportDone + 10) {
+                nReportDone = nPercent / 10 * 10;
+                LogPrintf("[%d%%]...", nReportDone);
+            }
+        }
+        pcursor->Next();
+    }
+    if (!pcursor->status().ok())
+        HandleError(pcursor->status());
+    db.WriteBatch(batch);
+    uiInterface.ShowProgress("", 100);
+    LogPrintf("[%s]. Converted %u transactions into %u outputs in %dms\n",
+        ShutdownRequested() ? "CANCELLED" : "DONE", nTransactions, nOutputs, GetTimeMillis() - nStart);
+    return !ShutdownRequested();
+}
+
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
 }
 
@@ -201,6 +413,10 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
     stats.hashBlock = GetBestBlock();
     ss << stats.hashBlock;
     CAmount nTotalAmount = 0;
+    // Outputs of a transaction are adjacent, so the hash covers the same
+    // per-transaction serialization as when whole CCoins were stored.
+    uint256 prevhash;
+    bool fFirst = true;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         try {
@@ -208,35 +424,38 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
             CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
             char chType;
             ssKey >> chType;
-            if (chType == DB_COINS) {
+            if (chType == DB_COIN) {
                 leveldb::Slice slValue = pcursor->value();
                 CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CCoins coins;
-                ssValue >> coins;
-                uint256 txhash;
-                ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n');
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
+                CCoinsOutputRecord record;
+                ssValue >> record;
+                CDataStream ssOutputKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+                CCoinsOutputKey key;
+                ssOutputKey >> key;
+                if (fFirst || key.txid != prevhash) {
+                    if (!fFirst)
+                        ss << VARINT(0);
+                    ss << key.txid;
+                    ss << VARINT(record.nVersion);
+                    ss << (record.fCoinBase ? 'c' : 'n');
+                    ss << VARINT(record.nHeight);
+                    stats.nTransactions++;
+                    prevhash = key.txid;
+                    fFirst = false;
                 }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
+                stats.nTransactionOutputs++;
+                ss << VARINT(key.n+1);
+                ss << record.out;
+                nTotalAmount += record.out.nValue;
+                stats.nSerializedSize += slKey.size() + slValue.size();
             }
             pcursor->Next();
         } catch (const std::exception& e) {
             return error("%s: Deserialize or I/O error - %s", __func__, e.what());
         }
     }
+    if (!fFirst)
+        ss << VARINT(0);
     {
         LOCK(cs_main);
         stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
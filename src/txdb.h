@@ -26,7 +26,13 @@ static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 16384 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
 
-/** CCoinsView backed by the LevelDB coin database (chainstate/) */
+/**
+ * CCoinsView backed by the LevelDB coin database (chainstate/).
+ *
+ * Unspent outputs are stored one record per output, keyed by outpoint, so
+ * spending an output only erases that output's record. Lookups still
+ * return all unspent outputs of a transaction as a CCoins.
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
@@ -48,7 +54,19 @@ public:
                     const uint256 &hashAnchor,
                     CAnchorsMap &mapAnchors,
                     CNullifiersMap &mapNullifiers);
+    bool BatchWriteDirty(const CCoinsMap &mapCoins,
+                         const uint256 &hashBlock,
+                         const uint256 &hashAnchor,
+                         const CAnchorsMap &mapAnchors,
+                         const CNullifiersMap &mapNullifiers);
     bool GetStats(CCoinsStats &stats) const;
+
+    /**
+     * Convert records from the old format, one CCoins per transaction, to
+     * one record per output. Returns false if interrupted by a shutdown
+     * request or on error; calling it again resumes the conversion.
+     */
+    bool Upgrade();
 };
 
 /** Access to the block database (blocks/index/) */
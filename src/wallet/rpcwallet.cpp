@@ -2513,11 +2513,16 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
 
     if (fHelp || params.size() < 2) {
         throw runtime_error(
-            "zcbenchmark benchmarktype samplecount\n"
+            "zcbenchmark benchmarktype samplecount ( arg1 arg2 )\n"
             "\n"
             "Runs a benchmark of the selected type samplecount times,\n"
             "returning the running times of each sample.\n"
             "\n"
+            "For verifyjoinsplitbatch, arg1 is the hex-encoded JoinSplit to verify\n"
+            "and arg2 is the number of copies of it verified as one batch.\n"
+            "For verifyjoinsplitsigs, arg1 is the number of transactions whose\n"
+            "JoinSplit signatures are verified.\n"
+            "\n"
             "Output: [\n"
             "  {\n"
             "    \"runningtime\": runningtime\n"
@@ -2549,7 +2554,14 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
 
     JSDescription samplejoinsplit;
 
-    if (benchmarktype == "verifyjoinsplit") {
+    if (benchmarktype == "verifyjoinsplitbatch" && params.size() < 4) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "verifyjoinsplitbatch needs a JoinSplit and a batch size");
+    }
+    if (benchmarktype == "verifyjoinsplitsigs" && params.size() < 3) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "verifyjoinsplitsigs needs a number of transactions");
+    }
+
+    if (benchmarktype == "verifyjoinsplit" || benchmarktype == "verifyjoinsplitbatch") {
         CDataStream ss(ParseHexV(params[2].get_str(), "js"), SER_NETWORK, PROTOCOL_VERSION);
         ss >> samplejoinsplit;
     }
@@ -2571,6 +2583,9 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
             }
         } else if (benchmarktype == "verifyjoinsplit") {
             sample_times.push_back(benchmark_verify_joinsplit(samplejoinsplit));
+        } else if (benchmarktype == "verifyjoinsplitbatch") {
+            int nJoinSplits = params[3].get_int();
+            sample_times.push_back(benchmark_verify_joinsplit_batch(samplejoinsplit, nJoinSplits));
 #ifdef ENABLE_MINING
         } else if (benchmarktype == "solveequihash") {
             if (params.size() < 3) {
@@ -2581,6 +2596,9 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
                 sample_times.insert(sample_times.end(), vals.begin(), vals.end());
             }
 #endif
+        } else if (benchmarktype == "verifyjoinsplitsigs") {
+            int nTxs = params[2].get_int();
+            sample_times.push_back(benchmark_verify_joinsplit_sigs(nTxs));
         } else if (benchmarktype == "verifyequihash") {
             sample_times.push_back(benchmark_verify_equihash());
         } else if (benchmarktype == "validatelargetx") {
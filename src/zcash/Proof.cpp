@@ -16,6 +16,7 @@ typedef alt_bn128_pp::GT_type curve_GT;
 typedef alt_bn128_pp::Fp_type curve_Fr;
 typedef alt_bn128_pp::Fq_type curve_Fq;
 typedef alt_bn128_pp::Fqe_type curve_Fq2;
+typedef alt_bn128_pp::Fqk_type curve_Fqk;
 
 BOOST_STATIC_ASSERT(sizeof(mp_limb_t) == 8);
 
@@ -223,6 +224,25 @@ void initialize_curve_params()
     std::call_once (init_public_params_once_flag, curve_pp::init_public_params);
 }
 
+struct ProofBatch {
+    struct Entry {
+        const r1cs_ppzksnark_verification_key<curve_pp>* vk;
+        const r1cs_ppzksnark_processed_verification_key<curve_pp>* pvk;
+        r1cs_primary_input<curve_Fr> primary_input;
+        r1cs_ppzksnark_proof<curve_pp> proof;
+    };
+
+    std::vector<Entry> entries;
+};
+
+ProofVerifier::ProofVerifier(bool perform_verification, bool batched) :
+    perform_verification(perform_verification),
+    batch(batched ? new ProofBatch() : NULL) { }
+
+ProofVerifier::ProofVerifier(ProofVerifier&&) = default;
+ProofVerifier& ProofVerifier::operator=(ProofVerifier&&) = default;
+ProofVerifier::~ProofVerifier() = default;
+
 ProofVerifier ProofVerifier::Strict() {
     initialize_curve_params();
     return ProofVerifier(true);
@@ -233,6 +253,11 @@ ProofVerifier ProofVerifier::Disabled() {
     return ProofVerifier(false);
 }
 
+ProofVerifier ProofVerifier::Batch() {
+    initialize_curve_params();
+    return ProofVerifier(true, true);
+}
+
 template<>
 bool ProofVerifier::check(
     const r1cs_ppzksnark_verification_key<curve_pp>& vk,
@@ -241,11 +266,114 @@ bool ProofVerifier::check(
     const r1cs_ppzksnark_proof<curve_pp>& proof
 )
 {
-    if (perform_verification) {
-        return r1cs_ppzksnark_online_verifier_strong_IC<curve_pp>(pvk, primary_input, proof);
-    } else {
+    if (!perform_verification) {
+        return true;
+    }
+
+    if (batch) {
+        // The checks r1cs_ppzksnark_online_verifier_strong_IC does
+        // before computing any pairing.
+        if (primary_input.size() != pvk.encoded_IC_query.domain_size() ||
+            !proof.is_well_formed()) {
+            return false;
+        }
+
+        batch->entries.push_back(ProofBatch::Entry {&vk, &pvk, primary_input, proof});
+        return true;
+    }
+
+    return r1cs_ppzksnark_online_verifier_strong_IC<curve_pp>(pvk, primary_input, proof);
+}
+
+// Each proof is valid iff the following five pairing products are one:
+//
+//   e(A, alphaA_g2) * e(-A', P2)
+//   e(alphaB_g1, B) * e(-B', P2)
+//   e(C, alphaC_g2) * e(-C', P2)
+//   e(K, gamma_g2) * e(-(acc + A + C), gamma_beta_g2) * e(-gamma_beta_g1, B)
+//   e(acc + A, B) * e(-H, rC_Z_g2) * e(-C, P2)
+//
+// Raising each of them to an independent random scalar and multiplying
+// them all together, the G1 arguments that are paired with the same
+// verification key element can be summed up front. What remains is six
+// Miller loops against the verification key plus one per proof (for B),
+// and a single final exponentiation.
+static bool CheckBatch(const std::vector<ProofBatch::Entry>& entries)
+{
+    const r1cs_ppzksnark_verification_key<curve_pp>& vk = *entries[0].vk;
+    const r1cs_ppzksnark_processed_verification_key<curve_pp>& pvk = *entries[0].pvk;
+
+    curve_G1 sum_alphaA = curve_G1::zero();
+    curve_G1 sum_alphaC = curve_G1::zero();
+    curve_G1 sum_gamma = curve_G1::zero();
+    curve_G1 sum_gamma_beta = curve_G1::zero();
+    curve_G1 sum_rC_Z = curve_G1::zero();
+    curve_G1 sum_one = curve_G1::zero();
+    curve_Fqk ml = curve_Fqk::one();
+
+    for (const ProofBatch::Entry& entry : entries) {
+        // The sums above are only valid for a single verification key
+        if (entry.pvk != &pvk) {
+            return false;
+        }
+
+        const r1cs_ppzksnark_proof<curve_pp>& proof = entry.proof;
+        const curve_G1 acc = pvk.encoded_IC_query.template accumulate_chunk<curve_Fr>(
+            entry.primary_input.begin(), entry.primary_input.end(), 0).first;
+        const curve_G1 A_acc = proof.g_A.g + acc;
+
+        const curve_Fr r1 = curve_Fr::random_element();
+        const curve_Fr r2 = curve_Fr::random_element();
+        const curve_Fr r3 = curve_Fr::random_element();
+        const curve_Fr r4 = curve_Fr::random_element();
+        const curve_Fr r5 = curve_Fr::random_element();
+
+        sum_alphaA = sum_alphaA + r1 * proof.g_A.g;
+        sum_alphaC = sum_alphaC + r3 * proof.g_C.g;
+        sum_gamma = sum_gamma + r4 * proof.g_K;
+        sum_gamma_beta = sum_gamma_beta - r4 * (A_acc + proof.g_C.g);
+        sum_rC_Z = sum_rC_Z - r5 * proof.g_H;
+        sum_one = sum_one - (r1 * proof.g_A.h + r2 * proof.g_B.h + r3 * proof.g_C.h + r5 * proof.g_C.g);
+
+        const curve_G1 b_coeff = r2 * vk.alphaB_g1 - r4 * vk.gamma_beta_g1 + r5 * A_acc;
+        ml = ml * curve_pp::miller_loop(curve_pp::precompute_G1(b_coeff),
+                                        curve_pp::precompute_G2(proof.g_B.g));
+    }
+
+    ml = ml * curve_pp::double_miller_loop(curve_pp::precompute_G1(sum_alphaA), pvk.vk_alphaA_g2_precomp,
+                                           curve_pp::precompute_G1(sum_alphaC), pvk.vk_alphaC_g2_precomp);
+    ml = ml * curve_pp::double_miller_loop(curve_pp::precompute_G1(sum_gamma), pvk.vk_gamma_g2_precomp,
+                                           curve_pp::precompute_G1(sum_gamma_beta), pvk.vk_gamma_beta_g2_precomp);
+    ml = ml * curve_pp::double_miller_loop(curve_pp::precompute_G1(sum_rC_Z), pvk.vk_rC_Z_g2_precomp,
+                                           curve_pp::precompute_G1(sum_one), pvk.pp_G2_one_precomp);
+
+    return curve_pp::final_exponentiation(ml) == curve_GT::one();
+}
+
+bool ProofVerifier::VerifyBatch(size_t* pnFailed)
+{
+    if (!batch || batch->entries.empty()) {
         return true;
     }
+
+    std::vector<ProofBatch::Entry> entries;
+    entries.swap(batch->entries);
+
+    if (CheckBatch(entries)) {
+        return true;
+    }
+
+    // Find the invalid proof
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (!r1cs_ppzksnark_online_verifier_strong_IC<curve_pp>(*entries[i].pvk, entries[i].primary_input, entries[i].proof)) {
+            if (pnFailed) {
+                *pnFailed = i;
+            }
+            return false;
+        }
+    }
+
+    return true;
 }
 
 }
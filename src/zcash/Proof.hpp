@@ -4,6 +4,8 @@
 #include "serialize.h"
 #include "uint256.h"
 
+#include <memory>
+
 namespace libzcash {
 
 const unsigned char G1_PREFIX_MASK = 0x02;
@@ -237,11 +239,15 @@ public:
 
 void initialize_curve_params();
 
+// Proofs whose pairing checks have been deferred by a batch verifier
+struct ProofBatch;
+
 class ProofVerifier {
 private:
     bool perform_verification;
+    std::unique_ptr<ProofBatch> batch;
 
-    ProofVerifier(bool perform_verification) : perform_verification(perform_verification) { }
+    ProofVerifier(bool perform_verification, bool batched = false);
 
 public:
     // ProofVerifier should never be copied
@@ -249,6 +255,7 @@ public:
     ProofVerifier& operator=(const ProofVerifier&) = delete;
     ProofVerifier(ProofVerifier&&);
     ProofVerifier& operator=(ProofVerifier&&);
+    ~ProofVerifier();
 
     // Creates a verification context that strictly verifies
     // all proofs using libsnark's API.
@@ -259,6 +266,20 @@ public:
     // such as during reindexing.
     static ProofVerifier Disabled();
 
+    // Creates a verification context that only performs the cheap
+    // per-proof checks in check(), and defers the pairing checks of
+    // every proof it is given until VerifyBatch() is called.
+    static ProofVerifier Batch();
+
+    // Checks all proofs deferred since the last call at once, using a
+    // random linear combination of their pairing equations so that the
+    // Miller loops against the verification key and the final
+    // exponentiation are shared. If the combined check fails, the proofs
+    // are checked one at a time and, if pnFailed is not NULL, the index
+    // (in order of check() calls) of the first invalid one is written to
+    // it. Always succeeds for verifiers not created by Batch().
+    bool VerifyBatch(size_t* pnFailed = NULL);
+
     template <typename VerificationKey,
               typename ProcessedVerificationKey,
               typename PrimaryInput,
@@ -130,6 +130,54 @@ double benchmark_verify_joinsplit(const JSDescription &joinsplit)
     return timer_stop(tv_start);
 }
 
+double benchmark_verify_joinsplit_batch(const JSDescription &joinsplit, size_t nJoinSplits)
+{
+    struct timeval tv_start;
+    timer_start(tv_start);
+    uint256 pubKeyHash;
+    auto verifier = libzcash::ProofVerifier::Batch();
+    for (size_t i = 0; i < nJoinSplits; i++) {
+        joinsplit.Verify(*pzcashParams, verifier, pubKeyHash);
+    }
+    verifier.VerifyBatch();
+    return timer_stop(tv_start);
+}
+
+double benchmark_verify_joinsplit_sigs(size_t nTxs)
+{
+    // Shielded transactions with an empty JoinSplit, signed the same way
+    // as transactions from z_sendmany.
+    std::vector<CTransaction> txs;
+    txs.reserve(nTxs);
+    for (size_t i = 0; i < nTxs; i++) {
+        CMutableTransaction mtx;
+        mtx.nVersion = 2;
+        mtx.vjoinsplit.push_back(JSDescription());
+        mtx.vjoinsplit[0].randomSeed = GetRandHash();
+
+        unsigned char joinSplitPrivKey[crypto_sign_SECRETKEYBYTES];
+        crypto_sign_keypair(mtx.joinSplitPubKey.begin(), joinSplitPrivKey);
+
+        CScript scriptCode;
+        CTransaction signTx(mtx);
+        uint256 dataToBeSigned = SignatureHash(scriptCode, signTx, NOT_AN_INPUT, SIGHASH_ALL | SIGHASH_FORKID, FORKID_IN_USE);
+        assert(crypto_sign_detached(&mtx.joinSplitSig[0], NULL,
+                                    dataToBeSigned.begin(), 32,
+                                    joinSplitPrivKey) == 0);
+        txs.push_back(CTransaction(mtx));
+    }
+
+    CJoinSplitSigCheck check(SCRIPT_VERIFY_FORKID);
+    for (const CTransaction& tx : txs) {
+        check.Add(tx);
+    }
+
+    struct timeval tv_start;
+    timer_start(tv_start);
+    assert(check());
+    return timer_stop(tv_start);
+}
+
 #ifdef ENABLE_MINING
 double benchmark_solve_equihash()
 {
@@ -293,7 +341,7 @@ double benchmark_increment_note_witnesses(size_t nTxs)
 
         wtx.SetNoteData(noteData);
         wallet.AddToWallet(wtx, true, NULL);
-        block1.vtx.push_back(wtx);
+        block1.vtx.push_back(MakeTransactionRef(wtx));
     }
     CBlockIndex index1(block1);
     index1.nHeight = 1;
@@ -316,7 +364,7 @@ double benchmark_increment_note_witnesses(size_t nTxs)
 
         wtx.SetNoteData(noteData);
         wallet.AddToWallet(wtx, true, NULL);
-        block2.vtx.push_back(wtx);
+        block2.vtx.push_back(MakeTransactionRef(wtx));
     }
     CBlockIndex index2(block2);
     index2.nHeight = 2;